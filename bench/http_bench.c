@@ -0,0 +1,243 @@
+/*
+   Copyright (C) 2014-2020, Rudolf Sikorski <rudolf.sikorski@freenet.de>
+
+   This file is part of the `drwebmirror' program.
+
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "src/drwebmirror.h"
+
+/*
+   Driver and microbenchmark of HTTP response parser. Canned responses are
+   fed byte by byte and as whole buffers, parsed status, length and body
+   are checked, then parsing speed of large bodies is measured.
+*/
+
+/* Canned response and what parser must get from it */
+typedef struct
+{
+    const char * name;
+    const char * response;
+    int failed;                     /* Parser must fail */
+    int status;                     /* Status code */
+    long length;                    /* Content-Length, -1 if not sent */
+    const char * body;              /* Content */
+} bench_case;
+
+static const bench_case cases[] =
+{
+    {
+        "content-length",
+        "HTTP/1.1 200 OK\r\nContent-Length: 11\r\nConnection: keep-alive\r\n\r\nhello world",
+        0, 200, 11, "hello world"
+    },
+    {
+        "chunked",
+        "HTTP/1.1 200 OK\r\nTransfer-Encoding: chunked\r\n\r\n"
+        "5;name=value\r\nhello\r\n6 \r\n world\r\n0\r\nTrailer-A: 1\r\nTrailer-B: 2\r\n\r\n",
+        0, 200, -1, "hello world"
+    },
+    {
+        "interim and obs-fold",
+        "HTTP/1.1 100 Continue\r\n\r\nHTTP/1.0 200 OK\nX-Folded: a\n  b\nContent-Length:  3 \n\nabc",
+        0, 200, 3, "abc"
+    },
+    {
+        "connection close",
+        "HTTP/1.1 200 OK\r\nConnection: close\r\n\r\nbody until end of connection",
+        0, 200, -1, "body until end of connection"
+    },
+    {
+        "not modified",
+        "HTTP/1.1 304 Not Modified\r\nContent-Length: 100\r\n\r\n",
+        0, 304, 0, ""
+    },
+    {
+        "chunk size overflow",
+        "HTTP/1.1 200 OK\r\nTransfer-Encoding: chunked\r\n\r\nFFFFFFFFFFFFFFFFFFFF\r\nx",
+        1, 200, -1, NULL
+    },
+    {
+        "bad status line",
+        "HTTP/1.1 2x0 OK\r\n\r\n",
+        1, 0, -1, NULL
+    }
+};
+
+/* Content received by last bench_parse() */
+static char * bench_body;
+static size_t bench_body_size, bench_body_alloc;
+
+/* Parse <size> bytes of <response> by pieces of <step> bytes with <hp>, keep content if <keep>,
+ * return EXIT_FAILURE if parser failed or body is incomplete */
+static int bench_parse(http_parser * hp, const char * response, size_t size, size_t step, int keep)
+{
+    size_t pos = 0;
+    http_init(hp);
+    bench_body_size = 0;
+    while(pos < size && !HTTP_FAILED(hp) && !HTTP_BODY_DONE(hp))
+    {
+        const char * piece = response + pos;
+        size_t piece_size = size - pos < step ? size - pos : step;
+        size_t used = 0;
+        while(used < piece_size && !HTTP_FAILED(hp) && !HTTP_BODY_DONE(hp))
+        {
+            const char * data;
+            size_t data_size;
+            if(!HTTP_HEAD_DONE(hp))
+            {
+                used += http_parse_head(hp, piece + used, piece_size - used);
+                continue;
+            }
+            used += http_parse_body(hp, piece + used, piece_size - used, & data, & data_size);
+            if(keep && data_size > 0)
+            {
+                if(bench_body_size + data_size > bench_body_alloc)
+                {
+                    char * body = (char *)realloc(bench_body, bench_body_size + data_size);
+                    if(!body)
+                        return EXIT_FAILURE;
+                    bench_body = body;
+                    bench_body_alloc = bench_body_size + data_size;
+                }
+                memcpy(bench_body + bench_body_size, data, data_size);
+            }
+            bench_body_size += data_size;
+        }
+        pos += piece_size;
+    }
+    if(HTTP_FAILED(hp) || !HTTP_HEAD_DONE(hp))
+        return EXIT_FAILURE;
+    return http_parse_eof(hp);
+}
+
+/* Check canned response <bc> parsed by pieces of <step> bytes, return EXIT_FAILURE if result is wrong */
+static int bench_check(const bench_case * bc, size_t step)
+{
+    http_parser hp;
+    int status = bench_parse(& hp, bc->response, strlen(bc->response), step, 1);
+    const char * error = NULL;
+
+    if(bc->failed)
+    {
+        if(status == EXIT_SUCCESS)
+            error = "parser did not fail";
+    }
+    else if(status != EXIT_SUCCESS)
+        error = "parser failed";
+    else if(hp.status != bc->status)
+        error = "wrong status";
+    else if((bc->length < 0 && hp.has_length) || (bc->length >= 0 && (!hp.has_length || hp.length != (unsigned long)bc->length)))
+        error = "wrong length";
+    else if(bench_body_size != strlen(bc->body) || memcmp(bench_body, bc->body, bench_body_size) != 0)
+        error = "wrong body";
+
+    if(error)
+    {
+        fprintf(ERRFP, "Error: %s, step %lu: %s (status %d, %lu bytes of body)\n",
+                bc->name, (unsigned long)step, error, hp.status, (unsigned long)bench_body_size);
+        return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}
+
+/* Make response with <size> bytes of body, chunked by <chunk> bytes or with Content-Length if <chunk> is 0,
+ * return its length in <length> */
+static char * bench_response(size_t size, size_t chunk, size_t * length)
+{
+    char * response = (char *)malloc(size + size / (chunk ? chunk : size) * 16 + 128);
+    char * curr = response;
+    size_t i;
+    if(!response)
+        return NULL;
+    if(chunk == 0)
+        curr += sprintf(curr, "HTTP/1.1 200 OK\r\nContent-Length: %lu\r\n\r\n", (unsigned long)size);
+    else
+        curr += sprintf(curr, "HTTP/1.1 200 OK\r\nTransfer-Encoding: chunked\r\n\r\n");
+    for(i = 0; i < size; )
+    {
+        size_t piece = chunk && size - i > chunk ? chunk : size - i;
+        if(chunk)
+            curr += sprintf(curr, "%lx\r\n", (unsigned long)piece);
+        memset(curr, 'a' + (int)(i / piece % 26), piece);
+        curr += piece;
+        i += piece;
+        if(chunk)
+            curr += sprintf(curr, "\r\n");
+    }
+    if(chunk)
+        curr += sprintf(curr, "0\r\n\r\n");
+    * length = (size_t)(curr - response);
+    return response;
+}
+
+/* Measure parsing of response with <size> bytes of body by pieces of <step> bytes, return EXIT_FAILURE if it failed */
+static int bench_speed(const char * name, size_t size, size_t chunk, size_t step)
+{
+    http_parser hp;
+    size_t length, count = 0;
+    double begin, elapsed = 0.0;
+    char * response = bench_response(size, chunk, & length);
+    int status = EXIT_SUCCESS;
+
+    if(!response)
+        return EXIT_FAILURE;
+    begin = get_seconds();
+    do
+    {
+        if(bench_parse(& hp, response, length, step, 0) != EXIT_SUCCESS || bench_body_size != size)
+        {
+            fprintf(ERRFP, "Error: %s, step %lu: parser failed\n", name, (unsigned long)step);
+            status = EXIT_FAILURE;
+            break;
+        }
+        count++;
+        elapsed = get_seconds() - begin;
+    }
+    while(elapsed < 0.5);
+    if(status == EXIT_SUCCESS)
+        printf("%-16s step %-8lu %10.1f MB/s\n", name, (unsigned long)step,
+               elapsed > 0.0 ? (double)length * (double)count / 1048576.0 / elapsed : 0.0);
+    free(response);
+    return status;
+}
+
+int main(void)
+{
+    size_t i, steps[] = { 1, 7, 4096 };
+    int status = EXIT_SUCCESS;
+
+    for(i = 0; i < sizeof(cases) / sizeof(cases[0]); i++)
+    {
+        size_t j;
+        for(j = 0; j < sizeof(steps) / sizeof(steps[0]); j++)
+            if(bench_check(cases + i, steps[j]) != EXIT_SUCCESS)
+                status = EXIT_FAILURE;
+        if(bench_check(cases + i, strlen(cases[i].response)) != EXIT_SUCCESS)
+            status = EXIT_FAILURE;
+    }
+    printf("%lu canned responses %s\n", (unsigned long)(sizeof(cases) / sizeof(cases[0])),
+           status == EXIT_SUCCESS ? "passed" : "FAILED");
+
+    for(i = 0; i < sizeof(steps) / sizeof(steps[0]); i++)
+    {
+        if(bench_speed("content-length", 1048576, 0, steps[i]) != EXIT_SUCCESS)
+            status = EXIT_FAILURE;
+        if(bench_speed("chunked", 1048576, 8192, steps[i]) != EXIT_SUCCESS)
+            status = EXIT_FAILURE;
+    }
+    free(bench_body);
+    return status;
+}
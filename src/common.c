@@ -18,6 +18,9 @@
 */
 
 #include "drwebmirror.h"
+#if !defined(_WIN32) && !defined(NO_POSIX_API)
+#include <sys/time.h>
+#endif
 
 /* System timezone */
 time_t tzshift;
@@ -44,6 +47,39 @@ void sighup_handler(int i)
 }
 #endif
 
+/* Get current time in seconds, with fractional part where system allows */
+double get_seconds(void)
+{
+#if defined(_WIN32)
+    return (double)GetTickCount() / 1000.0;
+#elif !defined(NO_POSIX_API)
+    struct timeval tv;
+    gettimeofday(& tv, NULL);
+    return (double)tv.tv_sec + (double)tv.tv_usec / 1000000.0;
+#else
+    return (double)time(NULL);
+#endif
+}
+
+/* Suspend execution for <seconds>, with fractional part where system allows */
+void sleep_seconds(double seconds)
+{
+    if(seconds <= 0.0)
+        return;
+#if defined(_WIN32)
+    Sleep((DWORD)(seconds * 1000.0));
+#elif !defined(NO_POSIX_API)
+    {
+        struct timespec ts;
+        ts.tv_sec = (time_t)seconds;
+        ts.tv_nsec = (long)((seconds - (double)ts.tv_sec) * 1000000000.0);
+        while(nanosleep(& ts, & ts) != 0 && errno == EINTR);
+    }
+#else
+    sleep((unsigned)(seconds + 0.999));
+#endif
+}
+
 /* Convert string to lowercase */
 void to_lowercase(char * str)
 {
@@ -28,6 +28,67 @@ char key_md5sum[33];
 avl_node * tree;
 /* Flag of use fast mode */
 int8_t use_fast;
+/* Flag of skipping update if remote timestamp is unchanged */
+int8_t use_timestamp;
+/* Flag of update which found nothing changed on server */
+int8_t update_unchanged;
+/* Remote timestamp of current update, empty if not known */
+static char timestamp_remote[64];
+
+/* Read first line of file <filename> into <str> of <size> bytes */
+static int read_stamp(const char * filename, char * str, size_t size)
+{
+    FILE * fp = fopen(filename, "r");
+    if(fp == NULL)
+        return EXIT_FAILURE;
+    if(fgets(str, (int)size, fp) == NULL)
+    {
+        fclose(fp);
+        return EXIT_FAILURE;
+    }
+    fclose(fp);
+    str[strcspn(str, "\r\n")] = '\0';
+    return str[0] != '\0' ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+/* Get remote timestamp, return 1 if it is the same as after last successful update */
+static int timestamp_unchanged(void)
+{
+    char buf[STRBUFSIZE], local[64];
+    int status;
+    timestamp_remote[0] = '\0';
+    sprintf(buf, "%s/%s", remotedir, "timestamp");
+    stage_need(buf);
+    status = download_optional(buf);
+    if(!DL_SUCCESS(status) || read_stamp(buf, timestamp_remote, sizeof(timestamp_remote)) != EXIT_SUCCESS)
+    {
+        timestamp_remote[0] = '\0';
+        return 0;
+    }
+    sprintf(buf, "%s/%s", remotedir, STAMPFILENAME);
+    stage_need(buf);
+    if(read_stamp(buf, local, sizeof(local)) != EXIT_SUCCESS)
+        return 0;
+    return strcmp(local, timestamp_remote) == 0;
+}
+
+/* Remember remote timestamp of successful update */
+static void timestamp_save(void)
+{
+    char buf[STRBUFSIZE];
+    FILE * fp;
+    if(timestamp_remote[0] == '\0')
+        return;
+    sprintf(buf, "%s/%s", remotedir, STAMPFILENAME);
+    fp = fopen_new(buf);
+    if(fp == NULL)
+    {
+        fprintf(ERRFP, "Warning: Error %d with fopen() on %s: %s\n", errno, buf, strerror(errno));
+        return;
+    }
+    fprintf(fp, "%s\n", timestamp_remote);
+    fclose(fp);
+}
 
 /* Get UserID and MD5 sum from keyfile */
 int parse_keyfile(const char * filename)
@@ -77,51 +138,630 @@ int parse_keyfile(const char * filename)
     return EXIT_SUCCESS;
 }
 
-/* Build caching tree for v4 */
-static void cache4(void)
+/* Print error about bad entry <line> of manifest */
+static int bad_entry(mf_slice line)
+{
+    fprintf(ERRFP, "Error: Bad entry %.*s\n", (int)line.len, line.ptr);
+    return EXIT_FAILURE;
+}
+
+/* Get directory <directory> of list file <list> */
+static void list_dir(const char * list, char directory[STRBUFSIZE])
+{
+    char * delim;
+    bsd_strlcpy(directory, list, STRBUFSIZE);
+    delim = strrchr(directory, '/');
+    if(delim)
+        * delim = '\0';
+    else
+        strcpy(directory, ".");
+}
+
+/* Parse drweb32.lst <list> into manifest <m>, platform variants of the same file are collapsed */
+static int load4(manifest * m, const char * list)
+{
+    char directory[STRBUFSIZE], filename[STRBUFSIZE], crc_base[9];
+    avl_node * index = NULL;
+    const char * known;
+    mf_file mf;
+    mf_slice line, fields[5];
+    mf_entry * e;
+    int status = EXIT_SUCCESS;
+
+    list_dir(list, directory);
+    if(mf_open(& mf, list) != EXIT_SUCCESS)
+        return EXIT_FAILURE;
+    while(status == EXIT_SUCCESS && mf_line(& mf, & line))
+    {
+        if(line.ptr[0] != '+' && line.ptr[0] != '=' && line.ptr[0] != '!')
+            continue;
+        if(mf_parse_entry(line, directory, filename, fields) == 0)
+        {
+            status = bad_entry(line);
+            break;
+        }
+        while(fields[1].len > 1 && fields[1].ptr[0] == '0') /* if base crc32 beign with zero */
+        {
+            fields[1].ptr++;
+            fields[1].len--;
+        }
+        if(mf_copy(fields[1], crc_base, sizeof(crc_base)) != EXIT_SUCCESS)
+        {
+            status = bad_entry(line);
+            break;
+        }
+        if((known = avl_hash(index, filename)) != NULL) /* Other platform variant of the same file */
+        {
+            if(strcmp(known, crc_base) != 0)
+                fprintf(ERRFP, "Warning: Conflicting CRC32 for %s (%s and %s), first one is used\n", filename, known, crc_base);
+            continue;
+        }
+        index = avl_insert(index, filename, crc_base);
+        if((e = manifest_add(m, filename, line.ptr[0] == '+' ? MF_ADD : MF_REPLACE)) == NULL)
+        {
+            status = EXIT_FAILURE;
+            break;
+        }
+        e->algo = MF_CRC32;
+        e->lzma = 1;
+        strcpy(e->digest, crc_base);
+    }
+
+    mf_rewind(& mf);
+    while(status == EXIT_SUCCESS && mf_line(& mf, & line))
+    {
+        /* Other platform variant of deleted file may be still needed */
+        if(line.ptr[0] == '-' && mf_parse_entry(line, directory, filename, fields) != 0 && !avl_hash(index, filename))
+        {
+            if((e = manifest_add(m, filename, MF_DELETE)) == NULL)
+                status = EXIT_FAILURE;
+            else
+                e->lzma = 1;
+        }
+    }
+    mf_close(& mf);
+    avl_dealloc(index);
+    return status;
+}
+
+/* Parse version.lst or version2.lst <list> into manifest <m> */
+static int load5(manifest * m, const char * list)
+{
+    char directory[STRBUFSIZE], filename[STRBUFSIZE];
+    mf_file mf;
+    mf_slice line, fields[5];
+    mf_entry * e;
+    int status = EXIT_SUCCESS;
+
+    list_dir(list, directory);
+    if(mf_open(& mf, list) != EXIT_SUCCESS)
+        return EXIT_FAILURE;
+    while(status == EXIT_SUCCESS && mf_line(& mf, & line))
+    {
+        if(line.ptr[0] == '+' || line.ptr[0] == '=' || line.ptr[0] == '!') /* Need to download this file */
+        {
+            size_t count = mf_parse_entry(line, directory, filename, fields);
+            if(count == 0)
+                status = bad_entry(line);
+            else if((e = manifest_add(m, filename, line.ptr[0] == '+' ? MF_ADD : MF_REPLACE)) == NULL)
+                status = EXIT_FAILURE;
+            else
+            {
+                e->algo = MF_SHA256;
+                e->lzma = 1;
+                mf_copy(fields[1], e->digest, sizeof(e->digest));
+                if(count > 2)
+                    e->size = (off_t)mf_ulong(fields[2], 10);
+                if(count > 3) /* optional LZMA SHA256 + LZMA size */
+                    mf_copy(fields[3], e->lzma_digest, sizeof(e->lzma_digest));
+                if(count > 4)
+                    e->lzma_size = (off_t)mf_ulong(fields[4], 10);
+            }
+        }
+        else if(line.ptr[0] == '-') /* Need to delete this file */
+        {
+            mf_slice name;
+            line.ptr++;
+            line.len--;
+            mf_split(line, ',', & name, 1);
+            if(mf_path(filename, directory, name) == EXIT_SUCCESS)
+            {
+                if((e = manifest_add(m, filename, MF_DELETE)) == NULL)
+                    status = EXIT_FAILURE;
+                else
+                    e->lzma = 1;
+            }
+        }
+    }
+    mf_close(& mf);
+    return status;
+}
+
+/* Parser of xml list, element and attribute events are collected into entries of manifest */
+typedef struct
+{
+    xml_parser xp;
+    manifest * m;
+    const char * list;              /* Name of list for messages */
+    char directory[STRBUFSIZE];     /* Directory of list */
+    int8_t top;                     /* Descriptions of nested xml lists are taken */
+    int8_t report;                  /* Errors are reported */
+    int8_t entry;                   /* Current element is file description */
+    int8_t is_xml;                  /* Current element is description of nested xml list */
+    char name[STRBUFSIZE];          /* Attributes of current element */
+    char hash[65];
+    off_t size;
+    int status;
+} list7;
+
+/* Prepare parser <lp> of xml list <list> into manifest <m>, descriptions of nested xml lists are taken only if <top> */
+static void list7_init(list7 * lp, manifest * m, const char * list, int8_t top, int8_t report)
+{
+    xml_init(& lp->xp);
+    lp->m = m;
+    lp->list = list;
+    list_dir(list, lp->directory);
+    lp->top = top;
+    lp->report = report;
+    lp->entry = lp->is_xml = 0;
+    lp->status = EXIT_SUCCESS;
+}
+
+/* Add file described by current element of parser <lp> to manifest */
+static void list7_entry(list7 * lp)
+{
+    char filename[STRBUFSIZE];
+    mf_slice name;
+    mf_entry * e;
+
+    name.ptr = lp->name;
+    name.len = strlen(lp->name);
+    if(lp->name[0] == '\0' || lp->hash[0] == '\0' || mf_path(filename, lp->directory, name) != EXIT_SUCCESS)
+    {
+        if(lp->report)
+            fprintf(ERRFP, "Error: Bad entry <%s name=\"%s\" hash=\"%s\"> in %s\n", lp->xp.element, lp->name, lp->hash, lp->list);
+        lp->status = EXIT_FAILURE;
+    }
+    else if((e = manifest_add(lp->m, filename, MF_ADD)) == NULL)
+        lp->status = EXIT_FAILURE;
+    else
+    {
+        e->algo = MF_SHA256;
+        e->nested = lp->is_xml;
+        e->size = lp->size;
+        strcpy(e->digest, lp->hash);
+    }
+}
+
+/* Parse piece <data> of <size> bytes of xml list by <lp> */
+static void list7_feed(list7 * lp, const char * data, size_t size)
+{
+    while(size > 0 && lp->status == EXIT_SUCCESS)
+    {
+        int event;
+        size_t used = xml_parse(& lp->xp, data, size, & event);
+        data += used;
+        size -= used;
+        switch(event)
+        {
+        case XML_ELEMENT:
+            lp->is_xml = lp->top && strcmp(lp->xp.element, "xml") == 0;
+            lp->entry = lp->is_xml || strcmp(lp->xp.element, "lzma") == 0;
+            lp->name[0] = lp->hash[0] = '\0';
+            lp->size = -1;
+            break;
+        case XML_ATTRIBUTE:
+            if(!lp->entry)
+                break;
+            if(strcmp(lp->xp.name, "name") == 0)
+                bsd_strlcpy(lp->name, lp->xp.value, sizeof(lp->name));
+            else if(strcmp(lp->xp.name, "hash") == 0)
+                bsd_strlcpy(lp->hash, lp->xp.value, sizeof(lp->hash));
+            else if(strcmp(lp->xp.name, "size") == 0)
+                lp->size = (off_t)strtoul(lp->xp.value, NULL, 10);
+            break;
+        case XML_TAG_END:
+            if(lp->entry)
+                list7_entry(lp);
+            lp->entry = 0;
+            break;
+        case XML_ERROR:
+            if(lp->report)
+                fprintf(ERRFP, "Error: Malformed xml in %s\n", lp->list);
+            lp->status = EXIT_FAILURE;
+            break;
+        }
+    }
+}
+
+/* Finish parsing by <lp>, return EXIT_SUCCESS if whole list was parsed */
+static int list7_finish(list7 * lp)
+{
+    if(lp->status == EXIT_SUCCESS && !XML_DONE(& lp->xp))
+    {
+        if(lp->report)
+            fprintf(ERRFP, "Error: Unexpected end of xml in %s\n", lp->list);
+        lp->status = EXIT_FAILURE;
+    }
+    return lp->status;
+}
+
+/* Parse xml list <list> into manifest <m>, descriptions of nested xml lists are taken only if <top> */
+static int load7_internal(manifest * m, const char * list, int8_t top)
+{
+    list7 lp;
+    mf_file mf;
+
+    if(mf_open(& mf, list) != EXIT_SUCCESS)
+        return EXIT_FAILURE;
+    list7_init(& lp, m, list, top, 1);
+    list7_feed(& lp, mf.data, mf.size);
+    mf_close(& mf);
+    return list7_finish(& lp);
+}
+
+/* Nested xml list parsed while it is downloaded */
+static list7 stream7;
+static manifest stream7_manifest;
+static char stream7_name[STRBUFSIZE];
+static unsigned long stream7_size;
+
+/* Parse content <data> of <size> bytes of nested xml list <filename> while it is downloaded,
+ * NULL <data> starts new list, NULL <filename> drops parsed one */
+static void stream7_sink(const char * filename, const char * data, size_t size)
+{
+    if(data == NULL)
+    {
+        manifest_free(& stream7_manifest);
+        manifest_init(& stream7_manifest);
+        stream7_name[0] = '\0';
+        stream7_size = 0;
+        if(filename && strlen(filename) < sizeof(stream7_name))
+        {
+            strcpy(stream7_name, filename);
+            list7_init(& stream7, & stream7_manifest, stream7_name, 0, 0);
+        }
+        return;
+    }
+    if(stream7_name[0] == '\0' || strcmp(filename, stream7_name) != 0)
+        return;
+    stream7_size += (unsigned long)size;
+    list7_feed(& stream7, data, size);
+}
+
+/* Parse nested xml list <list> into manifest <m>, entries parsed while it was downloaded are taken if they are complete */
+static int load7_nested(manifest * m, const char * list)
+{
+    int status = EXIT_SUCCESS;
+    size_t i;
+
+    if(stream7_name[0] == '\0' || strcmp(list, stream7_name) != 0 || list7_finish(& stream7) != EXIT_SUCCESS ||
+       get_size(list) != (off_t)stream7_size) /* List was not received or not only from server */
+    {
+        stream7_sink(NULL, NULL, 0);
+        return load7_internal(m, list, 0);
+    }
+    for(i = 0; i < stream7_manifest.count && status == EXIT_SUCCESS; i++)
+    {
+        const mf_entry * from = stream7_manifest.entries + i;
+        mf_entry * e = manifest_add(m, MF_PATH(& stream7_manifest, from), from->op);
+        if(e == NULL)
+            status = EXIT_FAILURE;
+        else
+        {
+            size_t path = e->path;
+            * e = * from;
+            e->path = path;
+        }
+    }
+    stream7_sink(NULL, NULL, 0);
+    return status;
+}
+
+/* Parse versions.xml <list> into manifest <m> */
+static int load7(manifest * m, const char * list)
+{
+    m->nested = & load7_nested;
+    m->nested_sink = & stream7_sink;
+    return load7_internal(m, list, 1);
+}
+
+/* Parse Android list <list> into manifest <m> */
+static int loadA(manifest * m, const char * list)
+{
+    char directory[STRBUFSIZE], filename[STRBUFSIZE], filename_base[STRBUFSIZE];
+    mf_file mf;
+    mf_slice line, fields[7];
+    mf_entry * e;
+    int8_t flag_files = 0;
+    int status = EXIT_SUCCESS;
+
+    list_dir(list, directory);
+    if(mf_open(& mf, list) != EXIT_SUCCESS)
+        return EXIT_FAILURE;
+    while(status == EXIT_SUCCESS && mf_line(& mf, & line))
+    {
+        if(!flag_files)
+        {
+            if(line.len >= 7 && strncmp(line.ptr, "[Files]", 7) == 0)
+                flag_files = 1;
+        }
+        else if(line.ptr[0] == '[' || line.len < 84)
+            break;
+        else
+        {
+            /* _rz1, operation, filesize, md5, _rz3, _rz4, filename */
+            unsigned long file_op;
+            if(mf_split(line, ',', fields, 7) < 7 || mf_copy(fields[6], filename_base, sizeof(filename_base)) != EXIT_SUCCESS ||
+               mf_path(filename, directory, fields[6]) != EXIT_SUCCESS)
+            {
+                status = bad_entry(line);
+                break;
+            }
+            file_op = mf_ulong(fields[1], 16);
+            if(file_op != 0x0 && file_op != 0x2)
+            {
+                fprintf(ERRFP, "Error: Unknown file operation %08lx for fine %s\n", file_op, filename_base);
+                status = EXIT_FAILURE;
+            }
+            else if((e = manifest_add(m, filename, file_op == 0x0 ? MF_ADD : MF_DELETE)) == NULL)
+                status = EXIT_FAILURE;
+            else
+            {
+                e->algo = MF_MD5;
+                e->size = (off_t)mf_ulong(fields[2], 16);
+                mf_copy(fields[3], e->digest, sizeof(e->digest));
+                to_lowercase(e->digest);
+            }
+        }
+    }
+    mf_close(& mf);
+    return status;
+}
+
+/* Build caching tree for fast mode from old list <list> parsed by <load> */
+static void cache_list(int (* load)(manifest *, const char *), const char * list)
+{
+    manifest m;
+    size_t i;
+    if(!exist(list))
+        return;
+    manifest_init(& m);
+    load(& m, list);
+    for(i = 0; i < m.count; i++)
+    {
+        const mf_entry * e = m.entries + i;
+        char filename[STRBUFSIZE];
+        if(e->op == MF_DELETE)
+            continue;
+        tree = avl_insert(tree, MF_PATH(& m, e), e->digest);
+        if(e->lzma && strlen(MF_PATH(& m, e)) + 6 <= sizeof(filename))
+        {
+            sprintf(filename, "%s.lzma", MF_PATH(& m, e));
+            tree = avl_insert(tree, filename, e->digest);
+        }
+    }
+    manifest_free(& m);
+}
+
+/* Checksum functions and their names for MF_* algorithms */
+static int (* const sum_func[])(const char *, char *) = { & crc32sum, & sha256sum, & md5sum };
+static int (* const sum_func_lzma[])(const char *, char *) = { & crc32sum_lzma, & sha256sum_lzma, NULL };
+static const char * const sum_desc[] = { "CRC32", "SHA256", "MD5" };
+static const char * const sum_desc_lzma[] = { "CRC32 LZMA", "SHA256 LZMA", "MD5 LZMA" };
+
+/* Count failed try <counter_global>, return DL_TRY_AGAIN if update should be restarted */
+static int update_retry(int * counter_global)
+{
+    if(* counter_global >= MAX_REPEAT)
+        return EXIT_FAILURE;
+    (* counter_global)++;
+    sleep(REPEAT_SLEEP);
+    return DL_TRY_AGAIN;
+}
+
+/* Queue deletion of files by mask <path>, also their lzma copies if <lzma> */
+static void update_delete(const char * path, int8_t lzma)
+{
+    char directory[STRBUFSIZE], name[STRBUFSIZE];
+    list_dir(path, directory);
+    bsd_strlcpy(name, strrchr(path, '/') ? strrchr(path, '/') + 1 : path, sizeof(name) - 5);
+    if(strpbrk(name, "*?") == NULL && exist(path))
+        printf("Deleting %s\n", path);
+    delete_add(directory, name);
+    if(lzma)
+    {
+        strcat(name, ".lzma");
+        delete_add(directory, name);
+    }
+}
+
+/* Check file of entry <e> of manifest <m> and download it if needed, also its lzma copy,
+ * return DL_TRY_AGAIN if update should be restarted after <counter_global> tries */
+static int update_entry(const manifest * m, const mf_entry * e, int * counter_global)
+{
+    char filename[STRBUFSIZE], buf[STRBUFSIZE], sum_real[65];
+    int status;
+
+    bsd_strlcpy(filename, MF_PATH(m, e), sizeof(filename));
+    if(!exist(filename) && make_path_for(filename) != EXIT_SUCCESS) /* If file not exist, check directories and make it if need */
+    {
+        fprintf(ERRFP, "Error: Can't access to local directory\n");
+        return EXIT_FAILURE;
+    }
+    if(e->nested && tree && * counter_global == 0) /* Old nested list is needed for fast mode */
+        cache_list(m->nested, filename);
+
+    download_expect(e->size);
+    status = download_check(filename, e->digest, sum_real, sum_func[e->algo], sum_desc[e->algo]);
+    download_expect(-1);
+    if(status == DL_TRY_AGAIN) /* Try again */
+        return update_retry(counter_global);
+    else if(!DL_SUCCESS(status))
+        return EXIT_FAILURE;
+    if(e->size >= 0 && !check_size(filename, e->size)) /* Wrong size */
+        return update_retry(counter_global);
+    if(!e->lzma || !sum_func_lzma[e->algo] || strlen(filename) + 6 > sizeof(buf))
+        return EXIT_SUCCESS;
+
+    sprintf(buf, "%s.lzma", filename); /* Also get lzma file, if exist */
+    if(!((status == DL_DOWNLOADED && !missing_known(buf)) || exist(buf)))
+        return EXIT_SUCCESS;
+    download_expect(e->lzma_size);
+    status = download_check(buf, e->digest, sum_real, sum_func_lzma[e->algo], sum_desc_lzma[e->algo]);
+    download_expect(-1);
+    missing_report(buf, status);
+    if(status == DL_NOT_FOUND) /* Need for delete lzma file */
+    {
+        if(exist(buf))
+        {
+            char directory[STRBUFSIZE];
+            list_dir(buf, directory);
+            printf("Deleting... %s\n", strrchr(buf, '/') + 1);
+            delete_add(directory, strrchr(buf, '/') + 1);
+        }
+        return EXIT_SUCCESS;
+    }
+    else if(status == DL_TRY_AGAIN) /* Try again */
+        return update_retry(counter_global);
+    else if(!DL_SUCCESS(status))
+        return EXIT_FAILURE;
+    else if((e->size >= 0 && !check_size_lzma(buf, e->size)) ||
+            (e->lzma_size >= 0 && !check_size(buf, e->lzma_size))) /* Wrong size */
+        return update_retry(counter_global);
+    else if(!use_fast && e->lzma_digest[0] != '\0')
+    {
+        char sha_lzma_real[65];
+        if(verbose)
+            printf("%s %s, checking SHA256 ", buf, (status == DL_EXIST ? "exist" : "downloaded"));
+        if(sha256sum(buf, sha_lzma_real) != EXIT_SUCCESS || strcmp(e->lzma_digest, sha_lzma_real) != 0) /* Sum mismatched */
+        {
+            if(verbose)
+                printf("[NOT OK]\n");
+            fprintf(ERRFP, "Warning: SHA256 mismatch (real=\"%s\", base=\"%s\")\n", sha_lzma_real, e->lzma_digest);
+            return update_retry(counter_global);
+        }
+        if(verbose)
+            printf("[OK]\n");
+    }
+    return EXIT_SUCCESS;
+}
+
+/* Check that file <filename> of entry <e> verified by last update is still in place, sizes come from directory snapshot */
+static int update_intact(const mf_entry * e, const char * filename)
 {
     char buf[STRBUFSIZE];
-    FILE * fp;
-    int8_t flag = 1;
-    sprintf(buf, "%s/%s", remotedir, "drweb32.lst");
-    fp = fopen(buf, "r");
-    if(!fp) return;
-    while(flag)
+    off_t size;
+    if(!file_info(filename, & size, NULL) || (e->size >= 0 && size != e->size))
+        return 0;
+    if(e->lzma && e->lzma_size >= 0 && strlen(filename) + 6 <= sizeof(buf))
     {
-        if(fscanf(fp, "%[^\r\n]\r\n", buf) == -1)
-            flag = 0;
-        else if(buf[0] == '+' || buf[0] == '=' || buf[0] == '!') /* Need to download this file */
-        {
-            char filename[STRBUFSIZE];
-            char crc_base[9];
-            char * beg = buf + 1, * tmp;
-            tmp = strchr(beg, '>'); /* if some as "=<w95>spider.vxd, C54AAA37" */
-            if(tmp) beg = tmp + 1;
-            tmp = strrchr(beg, '\\'); /* if some as "=<wnt>%SYSDIR%\spider.cpl, 871D501E" */
-            if(tmp) beg = tmp + 1;
-            sprintf(filename, "%s/%s", remotedir, beg);
-            * strchr(filename, ',') = '\0';
-            tmp = strchr(filename, '|'); /* if some as "!drwreg.exe|-xi, FE7E4B36" */
-            if(tmp) * tmp = '\0';
-            tmp = strchr(buf, ',');
-            do tmp++; while(* tmp == ' ');
-            bsd_strlcpy(crc_base, tmp, sizeof(crc_base));
-            while(crc_base[0] == '0') /* if base crc32 beign with zero */
-                memmove(crc_base, crc_base + 1, sizeof(char) * strlen(crc_base));
-            tree = avl_insert(tree, filename, crc_base);
-            strcat(filename, ".lzma");
-            tree = avl_insert(tree, filename, crc_base);
+        sprintf(buf, "%s.lzma", filename);
+        if(file_info(buf, & size, NULL) && size != e->lzma_size) /* lzma copy is optional */
+            return 0;
+    }
+    return 1;
+}
+
+/* Bring files of manifest <m> up to date, files of nested lists are appended to it when lists are verified,
+ * files which are the same in manifest <last> of last successful update and still in place are not checked if it is not NULL,
+ * return DL_TRY_AGAIN if update should be restarted after <counter_global> tries */
+static int update_run(manifest * m, manifest * last, int * counter_global)
+{
+    char filename[STRBUFSIZE];
+    unsigned long added = 0, changed = 0, same = 0;
+    size_t i;
+    int status;
+
+    for(i = 0; i < m->count; i++)
+    {
+        int diff = MF_REPLACE;
+        if(m->entries[i].op == MF_DELETE)
+        {
+            update_delete(MF_PATH(m, m->entries + i), m->entries[i].lzma);
+            continue;
+        }
+        bsd_strlcpy(filename, MF_PATH(m, m->entries + i), sizeof(filename));
+        if(last)
+            diff = manifest_diff(last, m, m->entries + i);
+        if(diff == MF_SAME && !update_intact(m->entries + i, filename)) /* Removed or damaged since last update */
+            diff = MF_REPLACE;
+        if(diff == MF_SAME) /* Verified by last update */
+        {
+            same++;
+            prune_keep(filename);
+        }
+        else
+        {
+            if(diff == MF_ADD)
+                added++;
+            else
+                changed++;
+            if(m->entries[i].nested && m->nested_sink) /* Nested list is parsed while it is downloaded */
+            {
+                m->nested_sink(NULL, NULL, 0);
+                download_sink(m->nested_sink);
+            }
+            status = update_entry(m, m->entries + i, counter_global);
+            download_sink(NULL);
+            if(status != EXIT_SUCCESS)
+                return status;
+        }
+        delete_keep(filename); /* Listed file is never removed by deletions of the same list */
+        if(m->entries[i].lzma && strlen(filename) + 6 <= sizeof(filename))
+        {
+            char buf[STRBUFSIZE];
+            sprintf(buf, "%s.lzma", filename);
+            delete_keep(buf);
+            if(diff == MF_SAME)
+                prune_keep(buf);
         }
+        if(m->entries[i].nested && m->nested && m->nested(m, filename) != EXIT_SUCCESS) /* Entries are reallocated here */
+            return EXIT_FAILURE;
     }
-    fclose(fp);
+    if(last && verbose)
+        printf("Since last update: %lu new, %lu changed, %lu removed, %lu unchanged files\n",
+               added, changed, manifest_removed(last), same);
+    return EXIT_SUCCESS;
+}
+
+/* Manifest of brought up to date list, it is saved by update_save() when deletions are done */
+static manifest update_manifest;
+
+/* Save manifest of successful update */
+static void update_save(void)
+{
+    manifest_save(& update_manifest);
+    manifest_free(& update_manifest);
+}
+
+/* Parse list <list> with <load> and bring its files up to date, only new and changed files are checked in fast mode,
+ * manifest is kept for update_save(), return DL_TRY_AGAIN if update should be restarted after <counter_global> tries */
+static int update_list(int (* load)(manifest *, const char *), const char * list, int * counter_global)
+{
+    manifest m, last;
+    int8_t use_last = 0;
+    int status;
+    manifest_init(& m);
+    manifest_init(& last);
+    if(use_fast && manifest_last(& last) == EXIT_SUCCESS)
+        use_last = 1;
+    status = load(& m, list);
+    if(status == EXIT_SUCCESS)
+        status = update_run(& m, use_last ? & last : NULL, counter_global);
+    manifest_free(& update_manifest);
+    if(status == EXIT_SUCCESS)
+        update_manifest = m;
+    else
+        manifest_free(& m);
+    manifest_free(& last);
+    return status;
 }
 
 /* Update using version 4 of update protocol (flat file drweb32.lst, crc32) */
 int update4(void)
 {
     char buf[STRBUFSIZE];
-    FILE * fp;
-    int8_t flag;
     int counter_global = 0, status;
     char main_hash_old[65], main_hash_new[65];
     off_t main_size_old = 0, main_size_new = 0;
@@ -134,9 +774,19 @@ int update4(void)
     if(do_lock(remotedir) != EXIT_SUCCESS)
         return EXIT_FAILURE;
 
+    /* Nothing is downloaded or hashed if remote timestamp is unchanged */
+    if(use_timestamp && timestamp_unchanged())
+    {
+        if(verbose)
+            printf("Nothing was changed\n");
+        update_unchanged = 1;
+        return EXIT_SUCCESS;
+    }
+
+    sprintf(buf, "%s/%s", remotedir, "drweb32.lst");
+    stage_need(buf); /* Staged generation is prepared only if main list was changed */
     if(use_fast)
     {
-        sprintf(buf, "%s/%s", remotedir, "drweb32.lst");
         status = sha256sum(buf, main_hash_old);
         if(status != EXIT_SUCCESS)
         {
@@ -147,7 +797,7 @@ int update4(void)
         else
         {
             main_size_old = get_size(buf);
-            cache4();
+            cache_list(& load4, buf);
         }
     }
 
@@ -172,149 +822,47 @@ repeat4: /* Goto here if checksum mismatch */
             {
                 if(verbose)
                     printf("Nothing was changed\n");
+                timestamp_save();
+                update_unchanged = 1;
                 return EXIT_SUCCESS;
             }
         }
     }
+    if(stage_prepare() != EXIT_SUCCESS)
+        return EXIT_FAILURE;
     /* Optional files */
     sprintf(buf, "%s/%s", remotedir, "drweb32.lst.lzma");
-    download(buf);
+    download_optional(buf);
     sprintf(buf, "%s/%s", remotedir, "version.lst");
-    download(buf);
+    download_optional(buf);
     sprintf(buf, "%s/%s", remotedir, "version.lst.lzma");
-    download(buf);
+    download_optional(buf);
     sprintf(buf, "%s/%s", remotedir, "drweb32.flg");
-    download(buf);
+    download_optional(buf);
     sprintf(buf, "%s/%s", remotedir, "drweb32.flg.lzma");
-    download(buf);
+    download_optional(buf);
 
     /* Main file */
     sprintf(buf, "%s/%s", remotedir, "drweb32.lst");
-    fp = fopen(buf, "r");
-    flag = 1;
-    while(flag)
-    {
-        if(fscanf(fp, "%[^\r\n]\r\n", buf) == -1)
-            flag = 0;
-        else if(buf[0] == '+' || buf[0] == '=' || buf[0] == '!') /* Need to download this file */
-        {
-            char filename[STRBUFSIZE];
-            char crc_base[9], crc_real[9];
-            char * beg = buf + 1, * tmp;
-            tmp = strchr(beg, '>'); /* if some as "=<w95>spider.vxd, C54AAA37" */
-            if(tmp) beg = tmp + 1;
-            tmp = strrchr(beg, '\\'); /* if some as "=<wnt>%SYSDIR%\spider.cpl, 871D501E" */
-            if(tmp) beg = tmp + 1;
-            sprintf(filename, "%s/%s", remotedir, beg);
-            * strchr(filename, ',') = '\0';
-            tmp = strchr(filename, '|'); /* if some as "!drwreg.exe|-xi, FE7E4B36" */
-            if(tmp) * tmp = '\0';
-            tmp = strchr(buf, ',');
-            do tmp++; while(* tmp == ' ');
-            bsd_strlcpy(crc_base, tmp, sizeof(crc_base));
-            while(crc_base[0] == '0') /* if base crc32 beign with zero */
-                memmove(crc_base, crc_base + 1, sizeof(char) * strlen(crc_base));
-
-            status = download_check(filename, crc_base, crc_real, & crc32sum, "CRC32");
-            if(status == DL_TRY_AGAIN && counter_global < MAX_REPEAT) /* Try again */
-            {
-                counter_global++;
-                fclose(fp);
-                sleep(REPEAT_SLEEP);
-                goto repeat4; /* Yes, it is goto. Sorry, Dijkstra... */
-            }
-            else if(!DL_SUCCESS(status))
-            {
-                fclose(fp);
-                return EXIT_FAILURE;
-            }
-
-            sprintf(buf, "%s.lzma", filename); /* Also get lzma file, if exist */
-            if(status == DL_DOWNLOADED || exist(buf))
-            {
-                status = download_check(buf, crc_base, crc_real, & crc32sum_lzma, "CRC32 LZMA");
-                if(status == DL_NOT_FOUND) /* Need for delete lzma file */
-                {
-                    if(exist(buf))
-                    {
-                        char * nm = strrchr(buf, '/') + 1;
-                        memmove(buf, nm, (strlen(nm) + 1) * sizeof(char));
-                        printf("Deleting... %s\n", buf);
-                        delete_files(remotedir, buf);
-                    }
-                }
-                else if(status == DL_TRY_AGAIN && counter_global < MAX_REPEAT) /* Try again */
-                {
-                    counter_global++;
-                    fclose(fp);
-                    sleep(REPEAT_SLEEP);
-                    goto repeat4; /* Yes, it is goto. Sorry, Dijkstra... */
-                }
-                else if(!DL_SUCCESS(status))
-                {
-                    fclose(fp);
-                    return EXIT_FAILURE;
-                }
-            }
-        }
-        else if(buf[0] == '-') /* Need to delete this file */
-        {
-            char filename[STRBUFSIZE];
-            sprintf(filename, "%s", buf + 1);
-            * strchr(filename, ',') = '\0';
-            delete_files(remotedir, filename);
-            strcat(filename, ".lzma");
-            delete_files(remotedir, filename);
-        }
-    }
+    journal_open(buf);
+    status = update_list(& load4, buf, & counter_global);
+    if(status == DL_TRY_AGAIN)
+        goto repeat4; /* Yes, it is goto. Sorry, Dijkstra... */
+    else if(status != EXIT_SUCCESS)
+        return EXIT_FAILURE;
 
-    fclose(fp);
+    delete_flush();
+    prune_run(remotedir, 0);
+    update_save();
+    journal_close(1);
+    timestamp_save();
     return EXIT_SUCCESS;
 }
 
-/* Build caching tree for v5 */
-static void cache5(const char * const version_file)
-{
-    char buf[STRBUFSIZE];
-    FILE * fp;
-    int8_t flag = 1;
-    sprintf(buf, "%s/%s", remotedir, version_file);
-    fp = fopen(buf, "r");
-    if(!fp) return;
-    while(flag)
-    {
-        if(fscanf(fp, "%[^\r\n]\r\n", buf) == -1)
-            flag = 0;
-        else if(buf[0] == '+' || buf[0] == '=' || buf[0] == '!') /* Need to download this file */
-        {
-            char filename[STRBUFSIZE];
-            char sha_base[65];
-            char * beg = buf + 1, * tmp;
-            tmp = strchr(beg, '>'); /* if some as "=<w95>spider.vxd, ..." */
-            if(tmp) beg = tmp + 1;
-            tmp = strrchr(beg, '\\'); /* if some as "=<wnt>%SYSDIR%\spider.cpl, ..." */
-            if(tmp) beg = tmp + 1;
-            sprintf(filename, "%s/%s", remotedir, beg);
-            * strchr(filename, ',') = '\0';
-            tmp = strchr(filename, '|'); /* if some as "!drwreg.exe|-xi, ..." */
-            if(tmp) * tmp = '\0';
-            tmp = strchr(buf, ',');
-            do tmp++; while(* tmp == ' ');
-            bsd_strlcpy(sha_base, tmp, sizeof(sha_base));
-            tree = avl_insert(tree, filename, sha_base);
-            strcat(filename, ".lzma");
-            tree = avl_insert(tree, filename, sha_base);
-        }
-    }
-    fclose(fp);
-}
-
 /* Update using version 5 or 5v2 of update protocol */
 static int update5x_internal(const char * const version_file)
 {
     char buf[STRBUFSIZE];
-    FILE * fp;
-    int8_t flag;
     int counter_global = 0, status;
     char main_hash_old[65], main_hash_new[65];
     off_t main_size_old = 0, main_size_new = 0;
@@ -327,9 +875,19 @@ static int update5x_internal(const char * const version_file)
     if(do_lock(remotedir) != EXIT_SUCCESS)
         return EXIT_FAILURE;
 
+    /* Nothing is downloaded or hashed if remote timestamp is unchanged */
+    if(use_timestamp && timestamp_unchanged())
+    {
+        if(verbose)
+            printf("Nothing was changed\n");
+        update_unchanged = 1;
+        return EXIT_SUCCESS;
+    }
+
+    sprintf(buf, "%s/%s", remotedir, version_file);
+    stage_need(buf); /* Staged generation is prepared only if main list was changed */
     if(use_fast)
     {
-        sprintf(buf, "%s/%s", remotedir, version_file);
         status = sha256sum(buf, main_hash_old);
         if(status != EXIT_SUCCESS)
         {
@@ -340,7 +898,7 @@ static int update5x_internal(const char * const version_file)
         else
         {
             main_size_old = get_size(buf);
-            cache5(version_file);
+            cache_list(& load5, buf);
         }
     }
 
@@ -365,185 +923,51 @@ repeat5: /* Goto here if checksum mismatch */
             {
                 if(verbose)
                     printf("Nothing was changed\n");
+                timestamp_save();
+                update_unchanged = 1;
                 return EXIT_SUCCESS;
             }
         }
     }
+    if(stage_prepare() != EXIT_SUCCESS)
+        return EXIT_FAILURE;
     /* Optional files */
     sprintf(buf, "%s/%s.lzma", remotedir, version_file);
-    download(buf);
+    download_optional(buf);
     /* Usually, these files can be downloaded with version.lst */
     /* Uncomment lines below if something wrong */
     /*
     sprintf(buf, "%s/%s", remotedir, "drweb32.lst");
-    download(buf);
+    download_optional(buf);
     sprintf(buf, "%s/%s", remotedir, "drweb32.lst.lzma");
-    download(buf);
+    download_optional(buf);
     */
     sprintf(buf, "%s/%s", remotedir, "drweb32.flg");
-    download(buf);
+    download_optional(buf);
     sprintf(buf, "%s/%s", remotedir, "drweb32.flg.lzma");
-    download(buf);
+    download_optional(buf);
     if(strcmp(version_file, "version.lst") != 0)
     {
         sprintf(buf, "%s/%s", remotedir, "version.lst");
-        download(buf);
+        download_optional(buf);
         sprintf(buf, "%s/%s", remotedir, "version.lst.lzma");
-        download(buf);
+        download_optional(buf);
     }
 
     /* Main file */
     sprintf(buf, "%s/%s", remotedir, version_file);
-    fp = fopen(buf, "r");
-    flag = 1;
-    while(flag)
-    {
-        if(fscanf(fp, "%[^\r\n]\r\n", buf) == -1)
-            flag = 0;
-        else if(buf[0] == '+' || buf[0] == '=' || buf[0] == '!') /* Need to download this file */
-        {
-            char filename[STRBUFSIZE];
-            char sha_base[65], sha_real[65], sha_lzma_base[65], sha_lzma_real[65];
-            off_t filesize = -1, filesize_lzma = -1;
-            char * beg = buf + 1, * tmp;
-            int8_t has_sha_lzma = 0;
-            tmp = strchr(beg, '>'); /* if some as "=<w95>spider.vxd, ..." */
-            if(tmp) beg = tmp + 1;
-            tmp = strrchr(beg, '\\'); /* if some as "=<wnt>%SYSDIR%\spider.cpl, ..." */
-            if(tmp) beg = tmp + 1;
-            sprintf(filename, "%s/%s", remotedir, beg);
-            * strchr(filename, ',') = '\0';
-            tmp = strchr(filename, '|'); /* if some as "!drwreg.exe|-xi, ..." */
-            if(tmp) * tmp = '\0';
-            tmp = strchr(buf, ',');
-            do tmp++; while(* tmp == ' ');
-            bsd_strlcpy(sha_base, tmp, sizeof(sha_base));
-            tmp += sizeof(sha_base) - 1;
-            tmp = strchr(tmp, ',');
-            if(tmp)
-            {
-                unsigned long filesize_ul = 0;
-                tmp++;
-                sscanf(tmp, "%lu", & filesize_ul);
-                filesize = (off_t)filesize_ul;
-
-                /* optional LZMA SHA256 + LZMA size */
-                tmp = strchr(tmp, ',');
-                if(tmp)
-                {
-                    do tmp++; while(* tmp == ' ');
-                    has_sha_lzma = 1;
-                    bsd_strlcpy(sha_lzma_base, tmp, sizeof(sha_lzma_base));
-                    tmp += sizeof(sha_lzma_base) - 1;
-
-                    tmp = strchr(tmp, ',');
-                    if(tmp)
-                    {
-                        filesize_ul = 0;
-                        tmp++;
-                        sscanf(tmp, "%lu", & filesize_ul);
-                        filesize_lzma = (off_t)filesize_ul;
-                    }
-                }
-            }
-
-            status = download_check(filename, sha_base, sha_real, & sha256sum, "SHA256");
-            if(status == DL_TRY_AGAIN && counter_global < MAX_REPEAT) /* Try again */
-            {
-                counter_global++;
-                fclose(fp);
-                sleep(REPEAT_SLEEP);
-                goto repeat5; /* Yes, it is goto. Sorry, Dijkstra... */
-            }
-            else if(!DL_SUCCESS(status))
-            {
-                fclose(fp);
-                return EXIT_FAILURE;
-            }
-            if(filesize >= 0 && !check_size(filename, filesize)) /* Wrong size */
-            {
-                fclose(fp);
-                if(counter_global >= MAX_REPEAT)
-                    return EXIT_FAILURE;
-                counter_global++;
-                sleep(REPEAT_SLEEP);
-                goto repeat5; /* Yes, it is goto. Sorry, Dijkstra... */
-            }
-
-            sprintf(buf, "%s.lzma", filename); /* Also get lzma file, if exist */
-            if(status == DL_DOWNLOADED || exist(buf))
-            {
-                status = download_check(buf, sha_base, sha_real, & sha256sum_lzma, "SHA256 LZMA");
-                if(status == DL_NOT_FOUND) /* Need for delete lzma file */
-                {
-                    if(exist(buf))
-                    {
-                        char * nm = strrchr(buf, '/') + 1;
-                        memmove(buf, nm, (strlen(nm) + 1) * sizeof(char));
-                        printf("Deleting... %s\n", buf);
-                        delete_files(remotedir, buf);
-                    }
-                }
-                else if(status == DL_TRY_AGAIN && counter_global < MAX_REPEAT) /* Try again */
-                {
-                    counter_global++;
-                    fclose(fp);
-                    sleep(REPEAT_SLEEP);
-                    goto repeat5; /* Yes, it is goto. Sorry, Dijkstra... */
-                }
-                else if(!DL_SUCCESS(status))
-                {
-                    fclose(fp);
-                    return EXIT_FAILURE;
-                }
-                else if((filesize >= 0 && !check_size_lzma(buf, filesize)) ||
-                        (filesize_lzma >= 0 && !check_size(buf, filesize_lzma))) /* Wrong size */
-                {
-                    fclose(fp);
-                    if(counter_global >= MAX_REPEAT)
-                        return EXIT_FAILURE;
-                    counter_global++;
-                    sleep(REPEAT_SLEEP);
-                    goto repeat5; /* Yes, it is goto. Sorry, Dijkstra... */
-                }
-                else if(!use_fast && has_sha_lzma)
-                {
-                    if(verbose)
-                        printf("%s %s, checking SHA256 ", buf, (status == DL_EXIST ? "exist" : "downloaded"));
-                    if(sha256sum(buf, sha_lzma_real) != EXIT_SUCCESS || strcmp(sha_lzma_base, sha_lzma_real) != 0) /* Sum mismatched */
-                    {
-                        if(verbose)
-                            printf("[NOT OK]\n");
-
-                        fprintf(ERRFP, "Warning: SHA256 mismatch (real=\"%s\", base=\"%s\")\n", sha_lzma_real, sha_lzma_base);
-
-                        fclose(fp);
-                        if(counter_global >= MAX_REPEAT)
-                            return EXIT_FAILURE;
-                        counter_global++;
-                        sleep(REPEAT_SLEEP);
-                        goto repeat5; /* Yes, it is goto. Sorry, Dijkstra... */
-                    }
-                    else
-                    {
-                        if(verbose)
-                            printf("[OK]\n");
-                    }
-                }
-            }
-        }
-        else if(buf[0] == '-') /* Need to delete this file */
-        {
-            char filename[STRBUFSIZE];
-            sprintf(filename, "%s", buf + 1);
-            * strchr(filename, ',') = '\0';
-            delete_files(remotedir, filename);
-            strcat(filename, ".lzma");
-            delete_files(remotedir, filename);
-        }
-    }
+    journal_open(buf);
+    status = update_list(& load5, buf, & counter_global);
+    if(status == DL_TRY_AGAIN)
+        goto repeat5; /* Yes, it is goto. Sorry, Dijkstra... */
+    else if(status != EXIT_SUCCESS)
+        return EXIT_FAILURE;
 
-    fclose(fp);
+    delete_flush();
+    prune_run(remotedir, 0);
+    update_save();
+    journal_close(1);
+    timestamp_save();
     return EXIT_SUCCESS;
 }
 
@@ -559,36 +983,10 @@ int update52(void)
     return update5x_internal("version2.lst");
 }
 
-/* Build caching tree for v7 */
-static void cache7(const char * file, const char * directory)
-{
-    char buf[STRBUFSIZE];
-    FILE * fp = fopen(file, "r");
-    int8_t flag = 1;
-    if(!fp) return;
-    while(flag)
-    {
-        if(fscanf(fp, "%[^\r\n]\r\n", buf) == -1)
-            flag = 0;
-        else if(strstr(buf, "<xml") != NULL || strstr(buf, "<lzma") != NULL) /* file description found */
-        {
-            char base_hash[65];
-            char filename[STRBUFSIZE];
-            bsd_strlcpy(base_hash, strstr(buf, "hash=\"") + 6, sizeof(base_hash));
-            sprintf(filename, "%s/%s", directory, strstr(buf, "name=\"") + 6);
-            * strchr(filename, '\"') = '\0';
-            tree = avl_insert(tree, filename, base_hash);
-        }
-    }
-    fclose(fp);
-}
-
 /* Update using version 7 of update protocol (xml files, sha256) */
 int update7(void)
 {
     char buf[STRBUFSIZE];
-    FILE * fp;
-    int8_t flag;
     int counter_global = 0;
     int status;
     char main_hash_old[65], main_hash_new[65];
@@ -602,9 +1000,10 @@ int update7(void)
     if(do_lock(remotedir) != EXIT_SUCCESS)
         return EXIT_FAILURE;
 
+    sprintf(buf, "%s/%s", remotedir, "versions.xml");
+    stage_need(buf); /* Staged generation is prepared only if main list was changed */
     if(use_fast)
     {
-        sprintf(buf, "%s/%s", remotedir, "versions.xml");
         status = sha256sum(buf, main_hash_old);
         if(status != EXIT_SUCCESS)
         {
@@ -615,7 +1014,7 @@ int update7(void)
         else
         {
             main_size_old = get_size(buf);
-            cache7(buf, remotedir);
+            cache_list(& load7, buf);
         }
     }
 
@@ -650,196 +1049,32 @@ repeat7: /* Goto here if hashsum mismatch */
             {
                 if(verbose)
                     printf("Nothing was changed\n");
+                update_unchanged = 1;
                 return EXIT_SUCCESS;
             }
         }
     }
+    if(stage_prepare() != EXIT_SUCCESS)
+        return EXIT_FAILURE;
 
-    /* Parse versions.xml */
-    fp = fopen(buf, "r");
-    flag = 1;
-    while(flag)
-    {
-        if(fscanf(fp, "%[^\r\n]\r\n", buf) == -1)
-            flag = 0;
-        else if(strstr(buf, "<xml") != NULL || strstr(buf, "<lzma") != NULL) /* file description found */
-        {
-            char base_hash[65];
-            char real_hash[65];
-            char filename[STRBUFSIZE];
-            int8_t is_xml = 0;
-            off_t filesize = -1;
-            unsigned long filesize_ul = 0;
-            char * tmpchr;
-
-            if(strstr(buf, "<xml") != NULL) is_xml = 1;
-
-            bsd_strlcpy(base_hash, strstr(buf, "hash=\"") + 6, sizeof(base_hash));
-            sprintf(filename, "%s/%s", remotedir, strstr(buf, "name=\"") + 6);
-            * strchr(filename, '\"') = '\0';
-            if((tmpchr = strstr(buf, "size=\"")) != NULL)
-            {
-                sscanf(tmpchr + 6, "%lu\"", & filesize_ul);
-                filesize = (off_t)filesize_ul;
-            }
-
-            if(!exist(filename) && make_path_for(filename) != EXIT_SUCCESS) /* If file not exist, check directories and make it if need */
-            {
-                fprintf(ERRFP, "Error: Can't access to local directory\n");
-                fclose(fp);
-                return EXIT_FAILURE;
-            }
-            else if(tree && counter_global == 0 && is_xml)
-            {
-                char directory[STRBUFSIZE];
-                bsd_strlcpy(directory, filename, sizeof(directory));
-                * strrchr(directory, '/') = '\0';
-                cache7(filename, directory);
-            }
-
-            status = download_check(filename, base_hash, real_hash, & sha256sum, "SHA256");
-            if(status == DL_TRY_AGAIN && counter_global < MAX_REPEAT) /* Try again */
-            {
-                counter_global++;
-                fclose(fp);
-                sleep(REPEAT_SLEEP);
-                goto repeat7; /* Yes, it is goto. Sorry, Dijkstra... */
-            }
-            else if(!DL_SUCCESS(status))
-            {
-                fclose(fp);
-                return EXIT_FAILURE;
-            }
-            if(filesize >= 0 && !check_size(filename, filesize)) /* Wrong size */
-            {
-                fclose(fp);
-                if(counter_global >= MAX_REPEAT)
-                    return EXIT_FAILURE;
-                counter_global++;
-                sleep(REPEAT_SLEEP);
-                goto repeat7; /* Yes, it is goto. Sorry, Dijkstra... */
-            }
-
-            if(is_xml) /* Parse this xml file */
-            {
-                char directory[STRBUFSIZE];
-                FILE * xfp = fopen(filename, "r");
-                int8_t xflag = 1;
-                char * pp = strrchr(filename, '/');
-                * pp = '\0';
-                bsd_strlcpy(directory, filename, sizeof(directory));
-                * pp = '/';
-
-                while(xflag)
-                {
-                    if(fscanf(xfp, "%[^\r\n]\r\n", buf) == -1)
-                        xflag = 0;
-                    else if(strstr(buf, "<lzma") != NULL) /* lzma file description found */
-                    {
-                        char xfilename[STRBUFSIZE];
-                        int status;
-                        off_t xfilesize = -1;
-                        unsigned long xfilesize_ul = 0;
-
-                        bsd_strlcpy(base_hash, strstr(buf, "hash=\"") + 6, sizeof(base_hash));
-                        sprintf(xfilename, "%s/%s", directory, strstr(buf, "name=\"") + 6);
-                        * strchr(xfilename, '\"') = '\0';
-                        if((tmpchr = strstr(buf, "size=\"")) != NULL)
-                        {
-                            sscanf(tmpchr + 6, "%lu\"", & xfilesize_ul);
-                            xfilesize = (off_t)xfilesize_ul;
-                        }
-
-                        if(!exist(xfilename) && make_path_for(xfilename) != EXIT_SUCCESS) /* If file not exist, check directories and make it if need */
-                        {
-                            fprintf(ERRFP, "Error: Can't access to local directory\n");
-                            fclose(fp);
-                            fclose(xfp);
-                            return EXIT_FAILURE;
-                        }
-
-                        status = download_check(xfilename, base_hash, real_hash, & sha256sum, "SHA256");
-                        if(status == DL_TRY_AGAIN && counter_global < MAX_REPEAT) /* Try again */
-                        {
-                            counter_global++;
-                            fclose(fp);
-                            fclose(xfp);
-                            sleep(REPEAT_SLEEP);
-                            goto repeat7; /* Yes, it is goto. Sorry, Dijkstra... */
-                        }
-                        else if(!DL_SUCCESS(status))
-                        {
-                            fclose(fp);
-                            fclose(xfp);
-                            return EXIT_FAILURE;
-                        }
-                        if(xfilesize >= 0 && !check_size(xfilename, xfilesize)) /* Wrong size */
-                        {
-                            fclose(fp);
-                            fclose(xfp);
-                            if(counter_global >= MAX_REPEAT)
-                                return EXIT_FAILURE;
-                            counter_global++;
-                            sleep(REPEAT_SLEEP);
-                            goto repeat7; /* Yes, it is goto. Sorry, Dijkstra... */
-                        }
-                    }
-                }
-                fclose(xfp);
-            }
-        }
-    }
+    /* Parse versions.xml and nested xml lists */
+    journal_open(buf);
+    status = update_list(& load7, buf, & counter_global);
+    if(status == DL_TRY_AGAIN)
+        goto repeat7; /* Yes, it is goto. Sorry, Dijkstra... */
+    else if(status != EXIT_SUCCESS)
+        return EXIT_FAILURE;
 
-    fclose(fp);
+    prune_run(remotedir, 1);
+    update_save();
+    journal_close(1);
     return EXIT_SUCCESS;
 }
 
-/* Build caching tree for Android */
-static void cacheA(const char * directory)
-{
-    char buf[STRBUFSIZE];
-    FILE * fp;
-    int8_t flag = 1, flag_files = 0;
-    fp = fopen(remotedir, "r");
-    if(!fp) return;
-    while(flag)
-    {
-        if(fscanf(fp, "%[^\n]\n", buf) == -1)
-            flag = 0;
-        else if(flag_files)
-        {
-            if(buf[0] == '[' || strlen(buf) < 84)
-                flag = 0;
-            else
-            {
-                char md5_base[33];
-                char filename_base[STRBUFSIZE], filename[STRBUFSIZE];
-                unsigned long file_op = 0;
-                sscanf(buf, "%*[^,], %lx, %*[^,], %[^,], %*[^,], %*[^,], %s",
-                       & file_op, md5_base, filename_base);
-                if(file_op == 0x0) /* Need to download this file */
-                {
-                    sprintf(filename, "%s/%s", directory, filename_base);
-                    to_lowercase(md5_base);
-                    tree = avl_insert(tree, filename, md5_base);
-                }
-            }
-        }
-        else
-        {
-            if(strncmp(buf, "[Files]", 7) == 0)
-                flag_files = 1;
-        }
-    }
-    fclose(fp);
-}
-
 /* Update using Android update protocol (flat file for mobile devices) */
 int updateA(void)
 {
-    char buf[STRBUFSIZE], real_dir[STRBUFSIZE];
-    FILE * fp;
-    int8_t flag, flag_files;
+    char real_dir[STRBUFSIZE];
     int counter_global = 0;
     int status;
     char main_hash_old[65], main_hash_new[65];
@@ -872,7 +1107,7 @@ int updateA(void)
         else
         {
             main_size_old = get_size(remotedir);
-            cacheA(real_dir);
+            cache_list(& loadA, remotedir);
         }
     }
 
@@ -896,88 +1131,18 @@ repeatA: /* Goto here if checksum mismatch */
             {
                 if(verbose)
                     printf("Nothing was changed\n");
+                update_unchanged = 1;
                 return EXIT_SUCCESS;
             }
         }
     }
-    fp = fopen(remotedir, "r");
-    flag = 1;
-    flag_files = 0;
-    while(flag)
-    {
-        if(fscanf(fp, "%[^\n]\n", buf) == -1)
-            flag = 0;
-        else if(flag_files)
-        {
-            if(buf[0] == '[' || strlen(buf) < 84)
-                flag = 0;
-            else
-            {
-                char md5_base[33], md5_real[33];
-                char filename_base[STRBUFSIZE], filename[STRBUFSIZE];
-                off_t filesize;
-                unsigned long filesize_ul = 0;
-                unsigned long file_op = 0;
-
-                sscanf(buf, "%*[^,], %lx, %lx, %[^,], %*[^,], %*[^,], %s",
-                       & file_op, & filesize_ul, md5_base, filename_base);
-                sprintf(filename, "%s/%s", real_dir, filename_base);
-                to_lowercase(md5_base);
-                filesize = (off_t)filesize_ul;
-
-                switch(file_op)
-                {
-                case 0x0: /* Need to download this file */
-                {
-                    int status = download_check(filename, md5_base, md5_real, & md5sum, "MD5");
-                    if(status == DL_TRY_AGAIN && counter_global < MAX_REPEAT) /* Try again */
-                    {
-                        counter_global++;
-                        fclose(fp);
-                        sleep(REPEAT_SLEEP);
-                        goto repeatA; /* Yes, it is goto. Sorry, Dijkstra... */
-                    }
-                    else if(!DL_SUCCESS(status))
-                    {
-                        fclose(fp);
-                        return EXIT_FAILURE;
-                    }
-                    if(!check_size(filename, filesize)) /* Wrong size */
-                    {
-                        fclose(fp);
-                        if(counter_global >= MAX_REPEAT)
-                            return EXIT_FAILURE;
-                        counter_global++;
-                        sleep(REPEAT_SLEEP);
-                        goto repeatA; /* Yes, it is goto. Sorry, Dijkstra... */
-                    }
-                    break;
-                }
-                case 0x2: /* Need to delete this file */
-                {
-                    if(exist(filename))
-                    {
-                        printf("Deleting %s\n", filename);
-                        delete_files(real_dir, filename_base);
-                    }
-                    break;
-                }
-                default:
-                {
-                    fprintf(ERRFP, "Error: Unknown file operation %08lx for fine %s\n", file_op, filename_base);
-                    fclose(fp);
-                    return EXIT_FAILURE;
-                }
-                }
-            }
-        }
-        else
-        {
-            if(strncmp(buf, "[Files]", 7) == 0)
-                flag_files = 1;
-        }
-    }
+    status = update_list(& loadA, remotedir, & counter_global);
+    if(status == DL_TRY_AGAIN)
+        goto repeatA; /* Yes, it is goto. Sorry, Dijkstra... */
+    else if(status != EXIT_SUCCESS)
+        return EXIT_FAILURE;
 
-    fclose(fp);
+    delete_flush();
+    update_save();
     return EXIT_SUCCESS;
 }
@@ -23,13 +23,38 @@
 /* Begin of custom defines block */
 #define  PROG_VERSION   "1.15"
 #define  LOCKFILENAME   "drwebmirror.lock"
+#define  STAMPFILENAME  "drwebmirror.stamp" /* Remote timestamp of last successful update */
+#define  MISSINGFILENAME "drwebmirror.missing" /* Optional files not found on server */
+#define  JOURNALFILENAME "drwebmirror.journal" /* Files verified by current update */
+#define  PRUNEFILENAME  "drwebmirror.prune" /* Files not referenced by last updates */
+#define  MANIFESTFILENAME "drwebmirror.manifest" /* Manifest of last successful update */
 #define  DEF_USERID     "0144652390"
 #define  DEF_MD5SUM     "7ae8805ed29e46901c3bae677f6c73ca"
 #define  MAX_REPEAT     5
 #define  MAX_REDIRECT   5   /* RFC 2068 */
+#define  REDIRECT_TTL   600 /* Lifetime of cached temporary redirect, seconds */
+#define  REDIRECT_CACHE 16  /* Number of cached redirects */
+#define  MAX_MIRRORS    32
+#define  MIRROR_FAILS   2   /* Failed requests in a row before switching to next server */
+#define  MIRROR_RETRY   60  /* Seconds before server marked as down is probed again */
+#define  MIRROR_SAMPLE  32768 /* Smallest file used to measure server throughput */
+#define  MIRROR_BEST    3   /* Number of best servers saved by --probe */
+#define  PACE_START     (1.0 / REPEAT_SLEEP) /* Requests per second allowed to server after first overload */
+#define  PACE_STEP      0.25/* Increase of allowed rate after each successful request */
+#define  PACE_MAX       8.0 /* Allowed rate above which server is not paced anymore */
+#define  PACE_MIN       0.025 /* Lowest allowed rate, 40 seconds between requests */
+#define  LOW_SPEED_LIMIT 1  /* Default minimal transfer speed, KB/s */
+#define  LOW_SPEED_TIME 30  /* Default time to measure transfer speed, seconds */
+#define  DEADLINE_SCALE 10  /* File may take this many times longer than server speed predicts */
+#define  DEADLINE_RATE  4096.0 /* Bytes per second expected from server whose speed is not measured yet */
+#define  DEADLINE_MIN   60.0 /* Seconds any file may take in addition to expected time */
+#define  MISSING_TTL    3600 /* Seconds before missing optional file is requested again */
+#define  MISSING_TTL_MAX 86400 /* Longest time between requests of missing optional file */
+#define  PRUNE_GRACE    3   /* Default number of updates unreferenced file is kept */
+#define  STAGE_KEEP     3   /* Number of generations kept by staged updates */
 #define  TIMEOUT        10
 #define  REPEAT_SLEEP   10
-#define  NETBUFSIZE     32768
+#define  NETBUFSIZE     131072
 #define  STRBUFSIZE     1024
 #define  MODE_DIR       0755
 #define  MODE_FILE      0644
@@ -70,6 +95,7 @@
 #include <assert.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <limits.h>
 #include <string.h>
 #include <errno.h>
 #include <time.h>
@@ -91,6 +117,7 @@
 #define mkdir(path)             (_mkdir(path))
 #define open(name, flag, mode)  (_open((name), (flag), (mode)))
 #define close(fd)               (_close((fd)))
+#define write(fd, buf, count)   (_write((fd), (buf), (unsigned int)(count)))
 #endif
 #define NO_POSIX_API
 #endif
@@ -131,11 +158,30 @@ extern int8_t use_proxy_auth;
 extern char proxy_address[256];
 extern uint16_t proxy_port;
 extern char proxy_auth[77];
+/* Compression of text lists */
+extern int8_t use_compress;
+/* Transfer slower than <low_speed_limit> KB/s during <low_speed_time> seconds is aborted, 0 = never */
+extern unsigned long low_speed_limit;
+extern unsigned long low_speed_time;
 
 /* Tree for caching checksums in fast mode */
 extern avl_node * tree;
 /* Flag of use fast mode */
 extern int8_t use_fast;
+/* Flag of skipping update if remote timestamp is unchanged */
+extern int8_t use_timestamp;
+/* Flag of update which found nothing changed on server */
+extern int8_t update_unchanged;
+/* Pruning of files not referenced by manifests, one of PRUNE_* values */
+extern int8_t use_prune;
+/* Number of updates file may stay unreferenced before it is deleted */
+extern unsigned long prune_grace;
+/* Flag of staged updates into new generation of remote directory */
+extern int8_t use_stage;
+/* Directory of objects shared by remotes, keyed by SHA256 sum, empty if not used */
+extern char store_dir[STRBUFSIZE];
+/* Directory with other remotes used for seeding, empty if not used */
+extern char seed_dir[STRBUFSIZE];
 
 /* Lokfile name */
 extern char lockfile[384];
@@ -147,6 +193,10 @@ void set_tzshift(void);
 #if !defined(_WIN32)
 void sighup_handler(int i);
 #endif
+/* Get current time in seconds, with fractional part where system allows */
+double get_seconds(void);
+/* Suspend execution for <seconds>, with fractional part where system allows */
+void sleep_seconds(double seconds);
 /* Convert string to lowercase */
 void to_lowercase(char * str);
 /* Base64 encoding (RFC 2045) */
@@ -182,10 +232,272 @@ void conn_startup(void);
 void conn_cleanup(void);
 /* Download file <filename> */
 int download(const char * filename);
+/* Download optional file <filename>, it is not requested again for a while if not found */
+int download_optional(const char * filename);
+/* Check if optional file <filename> was not found on server recently */
+int missing_known(const char * filename);
+/* Account result <status> of download() of optional file <filename> in negative cache */
+void missing_report(const char * filename, int status);
 /* Download file <filename> and compare checksum <checksum_base>
  * with <checksum_real> using <checksum_func> function */
 int download_check(const char * filename, const char * checksum_base, char * checksum_real,
                    int (* checksum_func)(const char *, char *), const char * checksum_desc);
+/* Receiver of downloaded content of file <filename>, <data> is NULL when file is received anew */
+typedef void (* content_sink)(const char * filename, const char * data, size_t size);
+/* Pass content of following downloads also to <sink> while it is written, NULL to stop */
+void download_sink(content_sink sink);
+/* Expect <size> bytes in following downloads if server doesn't tell it, -1 to stop */
+void download_expect(off_t size);
+/* Timings of single request, in seconds */
+typedef struct
+{
+    double dns;             /* Name lookup */
+    double connect;         /* TCP handshake */
+    double ttfb;            /* From sending request to receiving response head */
+    double transfer;        /* Receiving response body */
+    unsigned long size;     /* Size of response body */
+    int status;             /* HTTP status code, 0 if request failed */
+} conn_timing;
+/* Request file <filename> from server <server>:<port> over fresh connection, discard it and measure timings <t> */
+int conn_probe(const char * filename, const char * server, uint16_t port, conn_timing * t);
+
+/* HTTP */
+/* Final states of HTTP response parser */
+#define HTTP_DONE       100
+#define HTTP_ERROR      101
+#define HTTP_HEAD_DONE(hp)  ((hp)->head_done)
+#define HTTP_BODY_DONE(hp)  ((hp)->state == (HTTP_DONE))
+#define HTTP_FAILED(hp)     ((hp)->state == (HTTP_ERROR))
+/* HTTP response parser, works on arbitrary pieces of input and allocates nothing */
+typedef struct
+{
+    int state;                      /* Current state */
+    int status;                     /* Status code */
+    int8_t head_done;               /* Empty line after header fields received */
+    int8_t is_chunked;              /* Transfer-Encoding: chunked */
+    int8_t has_length;              /* Content-Length received */
+    int8_t keep_alive;              /* Connection: 1 = keep-alive, 0 = close, -1 = not set */
+    int8_t has_digits;              /* Chunk size has digits */
+    unsigned long length;           /* Content-Length */
+    unsigned long remain;           /* Bytes of body or chunk left */
+    unsigned long received;         /* Bytes of content passed to caller */
+    unsigned long range_begin;      /* First byte position of Content-Range */
+    unsigned long range_total;      /* Complete length of Content-Range, 0 if not set */
+    time_t last_modified;           /* Last-Modified, 0 if not set */
+    char location[STRBUFSIZE];      /* Location */
+    char transfer_encoding[64];     /* Transfer-Encoding in lowercase */
+    char content_encoding[64];      /* Content-Encoding in lowercase */
+    char name[64];                  /* Current field name */
+    char value[STRBUFSIZE];         /* Current field value */
+    size_t name_len, value_len, line_len;
+} http_parser;
+/* Prepare parser <hp> for new response */
+void http_init(http_parser * hp);
+/* Parse response head from <buf> of <size> bytes, return number of consumed bytes */
+size_t http_parse_head(http_parser * hp, const char * buf, size_t size);
+/* Parse response body from <buf> of <size> bytes, return number of consumed bytes
+ * and next piece of content in <data> and <data_size> */
+size_t http_parse_body(http_parser * hp, const char * buf, size_t size, const char ** data, size_t * data_size);
+/* Account <size> bytes of identity body that were received bypassing the parser */
+void http_skip_body(http_parser * hp, unsigned long size);
+/* Connection was closed by server, return EXIT_SUCCESS if this completes the body */
+int http_parse_eof(http_parser * hp);
+
+/* XML */
+/* Events of XML parser */
+#define XML_NONE        0   /* Input ended before next event */
+#define XML_ELEMENT     1   /* Start tag, name in element */
+#define XML_ATTRIBUTE   2   /* Attribute of start tag, name in name and value in value */
+#define XML_TAG_END     3   /* End of start tag, empty is set for "/>" */
+#define XML_CLOSE       4   /* End tag, name in element */
+#define XML_ERROR       5   /* Malformed input */
+#define XML_DONE(xp)    ((xp)->state == 0)  /* Parser is outside of markup */
+/* XML parser, works on arbitrary pieces of input and allocates nothing */
+typedef struct
+{
+    int state;                      /* Current state */
+    char quote;                     /* Quote of current attribute value */
+    int8_t empty;                   /* Start tag ends with "/>" */
+    unsigned long count;            /* Counter of current state */
+    char element[64];               /* Current element name */
+    char name[64];                  /* Current attribute name */
+    char value[STRBUFSIZE];         /* Current attribute value with references replaced */
+    size_t element_len, name_len, value_len;
+} xml_parser;
+/* Prepare parser <xp> for new document */
+void xml_init(xml_parser * xp);
+/* Parse <buf> of <size> bytes until next event <event>, return number of consumed bytes */
+size_t xml_parse(xml_parser * xp, const char * buf, size_t size, int * event);
+
+/* Mirrors */
+/* Update server */
+typedef struct
+{
+    char name[256];
+    uint16_t port;
+    int8_t fallback;        /* Used only if all other servers are down */
+    int8_t failures;        /* Failed requests in a row */
+    time_t down_until;      /* Server is not used until this time, 0 if it is up */
+    double speed;           /* Average throughput, bytes per second, 0 if unknown */
+    double error_rate;      /* Average share of failed requests */
+    unsigned long requests; /* Number of requests */
+    unsigned long errors;   /* Number of failed requests */
+    double bytes;           /* Bytes received */
+    double rate;            /* Allowed requests per second, 0 if not limited */
+    double next_time;       /* Earliest time of next request if rate is limited */
+} mirror_server;
+/* Update servers, first one is primary */
+extern mirror_server mirrors[MAX_MIRRORS];
+extern size_t mirrors_count;
+/* Add update server <name>:<port>, <fallback> server is used only if others are down */
+int mirror_add(const char * name, uint16_t port, int8_t fallback);
+/* Add update servers from comma-separated list <list> of addresses or group names, or from file if <list> is "@FILE" */
+int mirror_add_list(const char * list);
+/* Select update server for next request, other than <avoid> if possible */
+mirror_server * mirror_select(const mirror_server * avoid);
+/* Account result of request to update server <m>, <size> bytes were received in <seconds> */
+void mirror_report(mirror_server * m, int8_t success, double size, double seconds);
+/* Wait until request to update server <m> is allowed by its rate limit */
+void mirror_pace(mirror_server * m);
+/* Update server <m> is overloaded, halve its allowed request rate, next request waits at least REPEAT_SLEEP */
+void mirror_backoff(mirror_server * m);
+/* Show statistics of update servers */
+void mirror_stats(void);
+/* Measure update servers by downloading files <small> and <large>, which are fetched once if they are the same,
+ * show them ranked and save best ones to file <save> if it is not NULL */
+int mirror_probe(const char * small, const char * large, const char * save);
+
+/* Manifest */
+/* Piece of manifest, it is not terminated by zero */
+typedef struct
+{
+    const char * ptr;
+    size_t len;
+} mf_slice;
+/* Manifest mapped into memory */
+typedef struct
+{
+    const char * data;      /* Content of file */
+    size_t size;            /* Size of file */
+    size_t pos;             /* Begin of next line */
+    int8_t mapped;          /* Content must be released */
+} mf_file;
+/* Map manifest <filename> into <mf> */
+int mf_open(mf_file * mf, const char * filename);
+/* Get next non-empty line <line> of <mf> without line break, return 0 at end of file */
+int mf_line(mf_file * mf, mf_slice * line);
+/* Restart reading <mf> from first line */
+void mf_rewind(mf_file * mf);
+/* Unmap manifest <mf> */
+void mf_close(mf_file * mf);
+/* Split <line> by <delim> into at most <max> fields <fields> with spaces trimmed, return number of fields */
+size_t mf_split(mf_slice line, char delim, mf_slice * fields, size_t max);
+/* Copy <s> into string <str> of <size> bytes, return EXIT_FAILURE if it was truncated */
+int mf_copy(mf_slice s, char * str, size_t size);
+/* Make path <path> of file <name> in directory <directory>, return EXIT_FAILURE if it is too long */
+int mf_path(char path[STRBUFSIZE], const char * directory, mf_slice name);
+/* Split entry <line> of flat list into fields <fields> and get its target <filename> in <directory>,
+ * platform prefix and path are dropped, return number of fields or 0 if entry is bad */
+size_t mf_parse_entry(mf_slice line, const char * directory, char filename[STRBUFSIZE], mf_slice fields[5]);
+/* Get number from <s> in base <base> */
+unsigned long mf_ulong(mf_slice s, int base);
+
+/* Operations of manifest entries */
+#define MF_ADD          0   /* New file */
+#define MF_REPLACE      1   /* Changed file */
+#define MF_DELETE       2   /* Files by mask must be deleted */
+#define MF_SAME         3   /* Entry is the same as in last manifest, only result of manifest_diff() */
+/* Checksum algorithms of manifest entries */
+#define MF_CRC32        0
+#define MF_SHA256       1
+#define MF_MD5          2
+/* Entry of manifest */
+typedef struct
+{
+    size_t path;            /* Offset of target file name in names of manifest */
+    int8_t op;              /* One of MF_* operations */
+    int8_t algo;            /* One of MF_* checksum algorithms */
+    int8_t lzma;            /* File may have lzma compressed copy <path>.lzma */
+    int8_t nested;          /* File is list with more entries */
+    int8_t matched;         /* Entry of last manifest was found in current one */
+    off_t size;             /* Expected size, -1 if not known */
+    off_t lzma_size;        /* Expected size of lzma copy, -1 if not known */
+    char digest[65];        /* Expected checksum */
+    char lzma_digest[65];   /* Expected SHA256 sum of lzma copy, empty if not known */
+} mf_entry;
+/* Manifest of remote directory */
+typedef struct manifest
+{
+    mf_entry * entries;
+    size_t count, alloc;
+    char * names;           /* Names of all entries */
+    size_t names_size, names_alloc;
+    int (* nested)(struct manifest * m, const char * list);    /* Parser of nested lists, NULL if none */
+    content_sink nested_sink;   /* Parser of nested lists while they are downloaded, NULL if none */
+} manifest;
+/* Target file name of entry <e> of manifest <m> */
+#define MF_PATH(m, e)   ((m)->names + (e)->path)
+/* Prepare empty manifest <m> */
+void manifest_init(manifest * m);
+/* Add entry with target file <path> and operation <op> to manifest <m>, return NULL if there is no memory */
+mf_entry * manifest_add(manifest * m, const char * path, int8_t op);
+/* Free manifest <m> */
+void manifest_free(manifest * m);
+/* Load manifest <last> of last successful update of directory with lock file */
+int manifest_last(manifest * last);
+/* Compare entry <e> of manifest <m> with manifest <last>, return MF_ADD if it is new,
+ * MF_REPLACE if it was changed or MF_SAME */
+int manifest_diff(manifest * last, const manifest * m, const mf_entry * e);
+/* Count entries of manifest <last> which were not found by manifest_diff() */
+unsigned long manifest_removed(const manifest * last);
+/* Save manifest <m> of successful update of directory with lock file */
+void manifest_save(const manifest * m);
+
+/* Journal */
+/* Start journal of update with main list <list>, entries of interrupted run are kept if list is the same */
+int journal_open(const char * list);
+/* Check if file <filename> with checksum <checksum> was verified by interrupted run and was not changed since */
+int journal_check(const char * filename, const char * checksum);
+/* Record file <filename> with verified checksum <checksum> */
+void journal_add(const char * filename, const char * checksum);
+/* Finish journal, it is removed if update is <complete> */
+void journal_close(int8_t complete);
+
+/* Prune */
+/* Values of use_prune */
+#define PRUNE_OFF       0
+#define PRUNE_ON        1
+#define PRUNE_DRY_RUN   2
+/* Remember file <filename> as referenced by manifest */
+void prune_keep(const char * filename);
+/* Delete files in <directory> which were not referenced by manifests for more than prune_grace updates,
+ * also in subdirectories if <recursive> */
+void prune_run(const char * directory, int8_t recursive);
+
+/* Store */
+/* Make file <filename> from object with SHA256 sum <hash> if store has it */
+int store_fetch(const char * filename, const char * hash);
+/* Put verified file <filename> with SHA256 sum <hash> into store */
+void store_add(const char * filename, const char * hash);
+/* Remove broken object with SHA256 sum <hash> from store */
+void store_drop(const char * hash);
+/* Make file <filename> from file with SHA256 sum <hash> of other remote if seed directory has it */
+int seed_fetch(const char * filename, const char * hash);
+
+/* Stage */
+/* Lock directory <directory>, make its new generation working directory, it is filled by stage_prepare() */
+int stage_begin(const char * directory);
+/* Link file <filename> of current generation into new generation before it is prepared */
+void stage_need(const char * filename);
+/* Fill new generation with all files of current generation, files which are already there are kept */
+int stage_prepare(void);
+/* Return to working directory before update, generation is kept for next try */
+void stage_abort(void);
+/* Return to working directory before update and remove new generation of directory <directory>,
+ * nothing was changed on server, only remote timestamp is kept */
+void stage_discard(const char * directory);
+/* Switch directory <directory> to new generation and remove generations older than STAGE_KEEP */
+int stage_commit(const char * directory);
 
 /* Filesystem */
 /* Set modification time <mtime> to file <filename> */
@@ -194,14 +506,27 @@ int set_mtime(const char * filename, const time_t mtime);
 int make_path(const char * path);
 /* Recursive make directoty for file <filename> */
 int make_path_for(char * filename);
-/* Delete files by mask <mask> in directory <directory> */
-int delete_files(const char * directory, const char * mask);
+/* Queue deletion of files by mask <mask> in directory <directory>, it is done by delete_flush() */
+void delete_add(const char * directory, const char * mask);
+/* Keep file <filename> from queued deletions, it is referenced by list being applied */
+void delete_keep(const char * filename);
+/* Do all deletions queued by delete_add() */
+void delete_flush(void);
+/* Get size <size> and modification time <mtime> of <filename> from directory snapshot,
+ * return 0 if file not exist */
+int file_info(const char * filename, off_t * size, time_t * mtime);
+/* Forget snapshot of <filename> before it is written or deleted */
+void file_changed(const char * filename);
 /* Check <filename> exist */
 int exist(const char * filename);
 /* Get <filename> size */
 off_t get_size(const char * filename);
 /* Compare size of <filename> with <filesize> */
 int check_size(const char * filename, off_t filesize);
+/* Open <filename> for writing as new file, other hard links of old file are left untouched */
+FILE * fopen_new(const char * filename);
+/* Forget cached directories and snapshots, they are not valid after working directory is changed */
+void fs_forget(void);
 /* Open temp file */
 FILE * fopen_temp(char * filename);
 /* Lock file */
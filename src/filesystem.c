@@ -49,6 +49,7 @@ int set_mtime(const char * filename, const time_t mtime)
 
     new_times.actime = f_stat.st_atime;
     new_times.modtime = mtime;
+    file_changed(filename);
 
     if(utime(filename, & new_times) < 0)
     {
@@ -85,31 +86,96 @@ int make_dir(const char * name)
     return EXIT_SUCCESS;
 }
 
-/* Recursive make directory <path> */
+/* Directories made or verified in this run */
+static avl_node * dir_tree;
+
+#if defined(AT_FDCWD) && defined(O_DIRECTORY) && !defined(NO_POSIX_API)
+/* Make directory <name> in directory <dir_fd> and return its descriptor if <open_dir> is set
+ * or AT_FDCWD otherwise, <path> is used for messages */
+static int make_dir_at(int dir_fd, const char * name, const char * path, int8_t open_dir)
+{
+    struct stat st;
+    int fd;
+    if(mkdirat(dir_fd, name, MODE_DIR) != 0 && errno != EEXIST)
+    {
+        fprintf(ERRFP, "Error %d with mkdir() on %s: %s\n", errno, path, strerror(errno));
+        return -1;
+    }
+    if(fstatat(dir_fd, name, & st, 0) != 0 || !S_ISDIR(st.st_mode)) /* Not directory */
+    {
+        errno = ENOTDIR;
+        fprintf(ERRFP, "Error %d with mkdir() on %s: %s\n", errno, path, strerror(errno));
+        return -1;
+    }
+    fchmodat(dir_fd, name, MODE_DIR, 0); /* Change access permissions */
+    if(!open_dir)
+        return AT_FDCWD;
+    fd = openat(dir_fd, name, O_RDONLY | O_DIRECTORY);
+    if(fd < 0)
+        fprintf(ERRFP, "Error %d with open() on %s: %s\n", errno, path, strerror(errno));
+    return fd;
+}
+#endif
+
+/* Recursive make directory <path>, only directories not seen before in this run touch filesystem */
 int make_path(const char * path)
 {
-    int8_t flag = 1;
-    int status = EXIT_SUCCESS;
     char tmppath[STRBUFSIZE];
-    char * curr = tmppath;
+    char * curr = tmppath, * next;
+    int status = EXIT_SUCCESS;
+#if defined(AT_FDCWD) && defined(O_DIRECTORY) && !defined(NO_POSIX_API)
+    int dir_fd = AT_FDCWD; /* Parent of current component if it is not known */
+#endif
+
     bsd_strlcpy(tmppath, path, sizeof(tmppath));
+    if(avl_hash(dir_tree, tmppath))
+        return EXIT_SUCCESS;
 
-    while(flag)
+    while(status == EXIT_SUCCESS && curr)
     {
-        curr = strchr(curr, '/');
-        if(curr)
+        next = strchr(curr, '/');
+        if(next)
+            * next = '\0';
+        if(* curr != '\0' && !avl_hash(dir_tree, tmppath))
         {
-            * curr = '\0';
+#if defined(AT_FDCWD) && defined(O_DIRECTORY) && !defined(NO_POSIX_API)
+            int fd;
+            if(dir_fd == AT_FDCWD && curr != tmppath) /* Open known parent */
+            {
+                * (curr - 1) = '\0';
+                dir_fd = open(curr - 1 == tmppath ? "/" : tmppath, O_RDONLY | O_DIRECTORY);
+                * (curr - 1) = '/';
+                if(dir_fd < 0)
+                {
+                    fprintf(ERRFP, "Error %d with open() on %s: %s\n", errno, tmppath, strerror(errno));
+                    status = EXIT_FAILURE;
+                    break;
+                }
+            }
+            fd = make_dir_at(dir_fd, curr, tmppath, next != NULL);
+            if(dir_fd != AT_FDCWD)
+                close(dir_fd);
+            dir_fd = fd;
+            if(fd < 0 && fd != AT_FDCWD)
+                status = EXIT_FAILURE;
+#else
             status = make_dir(tmppath);
-            * curr = '/';
-            curr = curr + 1;
+#endif
+            if(status == EXIT_SUCCESS)
+                dir_tree = avl_insert(dir_tree, tmppath, "");
         }
-        else if(status == EXIT_SUCCESS)
+        if(next)
         {
-            status = make_dir(tmppath);
-            flag = 0;
+            * next = '/';
+            curr = next + 1;
         }
+        else
+            curr = NULL;
     }
+#if defined(AT_FDCWD) && defined(O_DIRECTORY) && !defined(NO_POSIX_API)
+    if(dir_fd >= 0 && dir_fd != AT_FDCWD)
+        close(dir_fd);
+#endif
     return status;
 }
 
@@ -127,89 +193,224 @@ int make_path_for(char * filename)
     return status;
 }
 
-/* Delete files by mask <mask> in directory <directory> */
-int delete_files(const char * directory, const char * mask)
+/* Mask with wildcards, compared after literal prefix */
+typedef struct
 {
-#if !defined (NO_POSIX_API)
-    DIR * dfd = opendir(directory);
-    struct dirent * dp;
+    char * mask;    /* Mask */
+    size_t prefix;  /* Length of literal prefix */
+} delete_mask;
 
-    if(dfd == NULL)
+/* Deletions queued in one directory */
+typedef struct
+{
+    char * directory;       /* Directory */
+    avl_node * names;       /* Exact names */
+    delete_mask * masks;    /* Masks with wildcards */
+    size_t masks_count;     /* Number of masks */
+} delete_dir;
+
+/* Queued deletions */
+static delete_dir * delete_dirs;
+static size_t delete_dirs_count;
+/* Files written after matching names or masks were queued or referenced by list, they are kept */
+static avl_node * delete_kept;
+
+/* Compare name <name> with mask <mask>, '*' is any string and '?' is any character */
+static int mask_match(const char * name, const char * mask)
+{
+    const char * star = NULL, * star_name = NULL;
+    while(* name != '\0')
     {
-        fprintf(ERRFP, "Error: No such directory %s\n", directory);
-        return EXIT_FAILURE;
+        if(* mask == '*')
+        {
+            star = ++mask;
+            star_name = name;
+        }
+        else if(* mask == '?' || * mask == * name)
+        {
+            name++;
+            mask++;
+        }
+        else if(star)
+        {
+            mask = star;
+            name = ++star_name;
+        }
+        else
+            return 0;
     }
+    while(* mask == '*')
+        mask++;
+    return * mask == '\0';
+}
+
+/* Find queued deletions in directory <directory> */
+static delete_dir * delete_find(const char * directory)
+{
+    size_t i;
+    for(i = delete_dirs_count; i > 0; i--)
+        if(strcmp(delete_dirs[i - 1].directory, directory) == 0)
+            return delete_dirs + i - 1;
+    return NULL;
+}
 
-    while((dp = readdir(dfd)) != NULL)
+/* Queue deletion of files by mask <mask> in directory <directory>, it is done by delete_flush() */
+void delete_add(const char * directory, const char * mask)
+{
+    delete_dir * dd = delete_find(directory);
+    if(!dd)
     {
-        const char * curr_name = dp->d_name;
-        const char * curr_mask = mask;
-        int8_t flag = 1;
-        while(flag)
+        delete_dir * dirs = (delete_dir *)realloc(delete_dirs, (delete_dirs_count + 1) * sizeof(delete_dir));
+        if(!dirs)
         {
-            if(* curr_mask == '*')
-            {
-                while(* curr_mask == '*')
-                    curr_mask++;
-                if(* curr_mask == '\0')
-                    flag = 0;
-                else
-                {
-                    while(* curr_name != '\0' && * curr_name != * curr_mask)
-                        curr_name++;
-                    if(* curr_name == '\0')
-                        break;
-                    else
-                    {
-                        curr_name++;
-                        curr_mask++;
-                        if(* curr_name == '\0' && * curr_mask == '\0')
-                            flag = 0;
-                    }
-                }
-            }
-            else if(* curr_mask == '?' || * curr_name == * curr_mask)
-            {
-                curr_name++;
-                curr_mask++;
-                if(* curr_name == '\0' && * curr_mask == '\0')
-                    flag = 0;
-            }
-            else
-                break;
+            fprintf(ERRFP, "Error: Can't delete file %s/%s\n", directory, mask);
+            return;
         }
-        if(!flag)
+        delete_dirs = dirs;
+        dd = delete_dirs + delete_dirs_count++;
+        dd->directory = (char *)malloc(strlen(directory) + 1);
+        if(dd->directory)
+            strcpy(dd->directory, directory);
+        dd->names = NULL;
+        dd->masks = NULL;
+        dd->masks_count = 0;
+    }
+    if(!dd->directory)
+        return;
+
+    if(strpbrk(mask, "*?") == NULL) /* Exact name */
+    {
+        if(!avl_hash(dd->names, mask))
+            dd->names = avl_insert(dd->names, mask, "");
+    }
+    else
+    {
+        size_t i;
+        delete_mask * masks;
+        for(i = 0; i < dd->masks_count; i++)
+            if(strcmp(dd->masks[i].mask, mask) == 0)
+                return;
+        masks = (delete_mask *)realloc(dd->masks, (dd->masks_count + 1) * sizeof(delete_mask));
+        if(!masks)
         {
-            char buf[STRBUFSIZE];
-            sprintf(buf, "%s/%s", directory, dp->d_name);
-            if(remove(buf) != 0)
-                fprintf(ERRFP, "Error: Can't delete file %s/%s\n", directory, dp->d_name);
+            fprintf(ERRFP, "Error: Can't delete file %s/%s\n", directory, mask);
+            return;
         }
+        dd->masks = masks;
+        masks[dd->masks_count].mask = (char *)malloc(strlen(mask) + 1);
+        if(!masks[dd->masks_count].mask)
+            return;
+        strcpy(masks[dd->masks_count].mask, mask);
+        masks[dd->masks_count].prefix = strcspn(mask, "*?");
+        dd->masks_count++;
     }
+}
 
-    closedir(dfd);
-    return EXIT_SUCCESS;
+/* Keep file <filename> from queued deletions, it is referenced by list being applied */
+void delete_keep(const char * filename)
+{
+    if(!avl_hash(delete_kept, filename))
+        delete_kept = avl_insert(delete_kept, filename, "");
+}
+
+/* Delete file <name> from directory <directory> opened as <dir_fd> */
+static void delete_one(int dir_fd, const char * directory, const char * name)
+{
+    char buf[STRBUFSIZE];
+    int status;
+    sprintf(buf, "%s/%s", directory, name);
+    if(avl_hash(delete_kept, buf)) /* Downloaded again after queuing */
+        return;
+    file_changed(buf);
+#if defined(AT_FDCWD) && !defined(NO_POSIX_API)
+    status = dir_fd >= 0 ? unlinkat(dir_fd, name, 0) : remove(buf);
+#else
+    (void)dir_fd;
+    status = remove(buf);
+#endif
+    if(status != 0 && errno != ENOENT)
+        fprintf(ERRFP, "Error: Can't delete file %s/%s\n", directory, name);
+}
+
+/* Delete queued exact names from subtree <root> */
+static void delete_names(const avl_node * root, int dir_fd, const char * directory)
+{
+    char buf[STRBUFSIZE];
+    if(!root)
+        return;
+    delete_names(root->left, dir_fd, directory);
+    sprintf(buf, "%s/%s", directory, root->key.name);
+    if(exist(buf))
+        delete_one(dir_fd, directory, root->key.name);
+    delete_names(root->right, dir_fd, directory);
+}
+
+/* Check if name <name> is matched by any mask of <dd> */
+static int delete_matched(const delete_dir * dd, const char * name)
+{
+    size_t i;
+    for(i = 0; i < dd->masks_count; i++)
+        if(strncmp(name, dd->masks[i].mask, dd->masks[i].prefix) == 0 &&
+           mask_match(name + dd->masks[i].prefix, dd->masks[i].mask + dd->masks[i].prefix))
+            return 1;
+    return 0;
+}
+
+/* Do queued deletions of directory <dd>, directory is read once for all masks */
+static void delete_dir_flush(const delete_dir * dd)
+{
+#if !defined (NO_POSIX_API)
+    DIR * dfd = NULL;
+    struct dirent * dp;
+    int dir_fd = -1;
+
+    if(dd->masks_count > 0)
+    {
+        dfd = opendir(dd->directory);
+        if(dfd == NULL)
+        {
+            fprintf(ERRFP, "Error: No such directory %s\n", dd->directory);
+            return;
+        }
+#if defined(AT_FDCWD)
+        dir_fd = dirfd(dfd);
+#endif
+    }
+#if defined(AT_FDCWD) && defined(O_DIRECTORY)
+    else
+        dir_fd = open(dd->directory, O_RDONLY | O_DIRECTORY);
+#endif
+
+    delete_names(dd->names, dir_fd, dd->directory);
+    if(dfd)
+    {
+        while((dp = readdir(dfd)) != NULL)
+            if(strcmp(dp->d_name, ".") != 0 && strcmp(dp->d_name, "..") != 0 && delete_matched(dd, dp->d_name))
+                delete_one(dir_fd, dd->directory, dp->d_name);
+        closedir(dfd);
+    }
+    else if(dir_fd >= 0)
+        close(dir_fd);
 #else
     HANDLE hFind = INVALID_HANDLE_VALUE;
     WIN32_FIND_DATAA ffd;
     char szDir[MAX_PATH];
     DWORD dwError = 0;
-    size_t dir_len = bsd_strlcpy(szDir, directory, MAX_PATH);
-    char * curr = szDir + dir_len++;
-    *(curr++) = '/';
-    bsd_strlcpy(curr, mask, MAX_PATH - dir_len - 1);
+    size_t dir_len;
+
+    delete_names(dd->names, -1, dd->directory);
+    if(dd->masks_count == 0)
+        return;
+    dir_len = bsd_strlcpy(szDir, dd->directory, MAX_PATH);
+    if(dir_len < MAX_PATH)
+        bsd_strlcpy(szDir + dir_len, "/*", MAX_PATH - dir_len);
     hFind = FindFirstFileA(szDir, &ffd);
     if(hFind != INVALID_HANDLE_VALUE)
     {
         do
         {
-            if(!(ffd.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY))
-            {
-                char buf[STRBUFSIZE];
-                sprintf(buf, "%s/%s", directory, ffd.cFileName);
-                if(remove(buf) != 0)
-                    fprintf(ERRFP, "Error: Can't delete file %s/%s\n", directory, ffd.cFileName);
-            }
+            if(!(ffd.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) && delete_matched(dd, ffd.cFileName))
+                delete_one(-1, dd->directory, ffd.cFileName);
         }
         while(FindNextFileA(hFind, &ffd) != 0);
     }
@@ -226,33 +427,274 @@ int delete_files(const char * directory, const char * mask)
                     MAKELANGID(LANG_NEUTRAL, SUBLANG_DEFAULT),
                     (LPSTR) &lpMsgBuf,
                     0, NULL );
-        fprintf(ERRFP, "Error: Can't delete file %s/%s (%s)\n", directory, mask, lpMsgBuf);
+        fprintf(ERRFP, "Error: Can't delete files in %s (%s)\n", dd->directory, lpMsgBuf);
         LocalFree(lpMsgBuf);
     }
     FindClose(hFind);
-    return EXIT_SUCCESS;
 #endif
 }
 
-/* Check <filename> exist */
-int exist(const char * filename)
+/* Do all deletions queued by delete_add() */
+void delete_flush(void)
 {
+    size_t i, j;
+    for(i = 0; i < delete_dirs_count; i++)
+    {
+        delete_dir_flush(delete_dirs + i);
+        free(delete_dirs[i].directory);
+        avl_dealloc(delete_dirs[i].names);
+        for(j = 0; j < delete_dirs[i].masks_count; j++)
+            free(delete_dirs[i].masks[j].mask);
+        free(delete_dirs[i].masks);
+    }
+    free(delete_dirs);
+    delete_dirs = NULL;
+    delete_dirs_count = 0;
+    avl_dealloc(delete_kept);
+    delete_kept = NULL;
+}
+
+/* Snapshot of directory entry */
+typedef struct
+{
+    size_t name;    /* Offset of name in snap_dir.names */
+    off_t size;     /* Size */
+    time_t mtime;   /* Modification time */
+} snap_entry;
+
+/* Snapshot of directory, entries are sorted by name */
+typedef struct
+{
+    int8_t scanned;         /* Entries are valid, otherwise stat() is used */
+    size_t count;           /* Number of entries */
+    snap_entry * entries;   /* Entries */
+    char * names;           /* Names of entries */
+} snap_dir;
+
+/* Directories scanned in this run, hash is index in snap_dirs */
+static avl_node * snap_tree;
+/* Snapshots of directories */
+static snap_dir * snap_dirs;
+static size_t snap_dirs_count;
+/* Files changed after their directory was scanned */
+static avl_node * snap_changed;
+/* Names of snapshot being sorted */
+static const char * snap_names;
+
+/* Comparison of snapshot entries by name */
+static int snap_compare(const void * a, const void * b)
+{
+    return strcmp(snap_names + ((const snap_entry *)a)->name, snap_names + ((const snap_entry *)b)->name);
+}
+
+#if !defined(NO_POSIX_API)
+/* Read all entries of directory <directory> into snapshot <snap> */
+static void snap_scan(const char * directory, snap_dir * snap)
+{
+    DIR * dfd = opendir(directory);
+    struct dirent * dp;
     struct stat st;
+    size_t names_size = 0, names_max = 4096, entries_max = 64;
+
+    snap->scanned = 0;
+    snap->count = 0;
+    snap->entries = NULL;
+    snap->names = NULL;
+    if(dfd == NULL)
+    {
+        if(errno == ENOENT || errno == ENOTDIR) /* Nothing exist there */
+            snap->scanned = 1;
+        return;
+    }
+    snap->entries = (snap_entry *)malloc(entries_max * sizeof(snap_entry));
+    snap->names = (char *)malloc(names_max);
+
+    while(snap->entries && snap->names && (dp = readdir(dfd)) != NULL)
+    {
+        size_t len = strlen(dp->d_name) + 1;
+        if(strcmp(dp->d_name, ".") == 0 || strcmp(dp->d_name, "..") == 0)
+            continue;
+#if defined(AT_FDCWD)
+        if(fstatat(dirfd(dfd), dp->d_name, & st, 0) != 0)
+            continue;
+#else
+        {
+            char buf[STRBUFSIZE];
+            sprintf(buf, "%s/%s", directory, dp->d_name);
+            if(stat(buf, & st) != 0)
+                continue;
+        }
+#endif
+        if(snap->count == entries_max)
+        {
+            snap_entry * entries = (snap_entry *)realloc(snap->entries, (entries_max *= 2) * sizeof(snap_entry));
+            if(!entries)
+                free(snap->entries);
+            snap->entries = entries;
+        }
+        if(names_size + len > names_max)
+        {
+            char * names;
+            while(names_size + len > names_max)
+                names_max *= 2;
+            names = (char *)realloc(snap->names, names_max);
+            if(!names)
+                free(snap->names);
+            snap->names = names;
+        }
+        if(!snap->entries || !snap->names)
+            break;
+        memcpy(snap->names + names_size, dp->d_name, len);
+        snap->entries[snap->count].name = names_size;
+        snap->entries[snap->count].size = st.st_size;
+        snap->entries[snap->count].mtime = st.st_mtime;
+        snap->count++;
+        names_size += len;
+    }
+    closedir(dfd);
+
+    if(!snap->entries || !snap->names) /* Out of memory, use stat() */
+    {
+        free(snap->entries);
+        free(snap->names);
+        snap->entries = NULL;
+        snap->names = NULL;
+        snap->count = 0;
+        return;
+    }
+    snap_names = snap->names;
+    qsort(snap->entries, snap->count, sizeof(snap_entry), snap_compare);
+    snap->scanned = 1;
+    if(more_verbose)
+        printf("Scanned %lu entries in %s\n", (unsigned long)snap->count, directory);
+}
+#endif
+
+/* Find snapshot of directory <directory>, scan it if <scan> is set */
+static snap_dir * snap_find(const char * directory, int8_t scan)
+{
+#if !defined(NO_POSIX_API)
+    const char * index = avl_hash(snap_tree, directory);
+    char buf[24];
+    snap_dir * dirs;
+    if(index)
+        return snap_dirs + strtoul(index, NULL, 10);
+    if(!scan)
+        return NULL;
+    dirs = (snap_dir *)realloc(snap_dirs, (snap_dirs_count + 1) * sizeof(snap_dir));
+    if(!dirs)
+        return NULL;
+    snap_dirs = dirs;
+    snap_scan(directory, snap_dirs + snap_dirs_count);
+    sprintf(buf, "%lu", (unsigned long)snap_dirs_count);
+    snap_tree = avl_insert(snap_tree, directory, buf);
+    return snap_dirs + snap_dirs_count++;
+#else
+    (void)directory;
+    (void)scan;
+    return NULL;
+#endif
+}
+
+/* Split <filename> into directory <directory> and returns name in it, NULL if it can't be snapshotted */
+static const char * snap_split(const char * filename, char directory[STRBUFSIZE])
+{
+    const char * name = strrchr(filename, '/');
+    if(!name)
+    {
+        strcpy(directory, ".");
+        name = filename;
+    }
+    else
+    {
+        size_t len = (size_t)(name - filename);
+        if(len >= STRBUFSIZE)
+            return NULL;
+        if(len == 0)
+            len = 1; /* Root directory */
+        memcpy(directory, filename, len);
+        directory[len] = '\0';
+        name++;
+    }
+    if(name[0] == '\0' || strcmp(name, ".") == 0 || strcmp(name, "..") == 0)
+        return NULL;
+    return name;
+}
+
+/* Get size <size> and modification time <mtime> of <filename> from directory snapshot,
+ * return 0 if file not exist */
+int file_info(const char * filename, off_t * size, time_t * mtime)
+{
+    struct stat st;
+    char directory[STRBUFSIZE];
+    const char * name;
+    const snap_dir * snap;
+
+    if(!avl_hash(snap_changed, filename) && (name = snap_split(filename, directory)) != NULL &&
+       (snap = snap_find(directory, 1)) != NULL && snap->scanned)
+    {
+        size_t left = 0, right = snap->count;
+        while(left < right)
+        {
+            size_t middle = left + (right - left) / 2;
+            int cmp = strcmp(name, snap->names + snap->entries[middle].name);
+            if(cmp == 0)
+            {
+                if(size)
+                    * size = snap->entries[middle].size;
+                if(mtime)
+                    * mtime = snap->entries[middle].mtime;
+                return 1;
+            }
+            if(cmp < 0)
+                right = middle;
+            else
+                left = middle + 1;
+        }
+        errno = ENOENT;
+        return 0;
+    }
+
     if(stat(filename, & st) != 0)
         return 0;
+    if(size)
+        * size = st.st_size;
+    if(mtime)
+        * mtime = st.st_mtime;
     return 1;
 }
 
+/* Forget snapshot of <filename> before it is written or deleted */
+void file_changed(const char * filename)
+{
+    char directory[STRBUFSIZE];
+    const char * name = snap_split(filename, directory);
+    const delete_dir * dd;
+    if(!name)
+        return;
+    if(snap_find(directory, 0) && !avl_hash(snap_changed, filename))
+        snap_changed = avl_insert(snap_changed, filename, "");
+    if((dd = delete_find(directory)) != NULL && (avl_hash(dd->names, name) || delete_matched(dd, name)) &&
+       !avl_hash(delete_kept, filename)) /* Queued by name or mask before it was written */
+        delete_kept = avl_insert(delete_kept, filename, "");
+}
+
+/* Check <filename> exist */
+int exist(const char * filename)
+{
+    return file_info(filename, NULL, NULL);
+}
+
 /* Get <filename> size */
 off_t get_size(const char * filename)
 {
-    struct stat st;
-    if(stat(filename, & st) != 0)
+    off_t size;
+    if(!file_info(filename, & size, NULL))
     {
         fprintf(ERRFP, "Error %d with stat(): %s\n", errno, strerror(errno));
         return -1;
     }
-    return st.st_size;
+    return size;
 }
 
 /* Compare size of <filename> with <filesize> */
@@ -271,6 +713,34 @@ int check_size(const char * filename, off_t filesize)
     return 0;
 }
 
+/* Open <filename> for writing as new file, other hard links of old file are left untouched */
+FILE * fopen_new(const char * filename)
+{
+    file_changed(filename);
+    remove(filename);
+    return fopen(filename, "w");
+}
+
+/* Forget cached directories and snapshots, they are not valid after working directory is changed */
+void fs_forget(void)
+{
+    size_t i;
+    avl_dealloc(dir_tree);
+    dir_tree = NULL;
+    for(i = 0; i < snap_dirs_count; i++)
+    {
+        free(snap_dirs[i].entries);
+        free(snap_dirs[i].names);
+    }
+    free(snap_dirs);
+    snap_dirs = NULL;
+    snap_dirs_count = 0;
+    avl_dealloc(snap_tree);
+    snap_tree = NULL;
+    avl_dealloc(snap_changed);
+    snap_changed = NULL;
+}
+
 /* Open temp file */
 FILE * fopen_temp(char * filename)
 {
@@ -366,6 +836,7 @@ int do_lock(const char * directory)
             return EXIT_FAILURE;
         }
     }
+    file_changed(lockfile);
 
 /* Cygwin implementation of fcntl() can't work */
 #if !defined(__CYGWIN__) && !defined(_WIN32)
@@ -377,6 +848,7 @@ int do_lock(const char * directory)
         {
             fprintf(ERRFP, "Error: Error %d with fcntl(): %s\n", errno, strerror(errno));
             close(lockfd);
+            lockfd = -1;
             return EXIT_FAILURE;
         }
         else
@@ -413,11 +885,13 @@ int do_unlock(void)
     {
         fprintf(ERRFP, "Error: Error %d with fcntl(): %s\n", errno, strerror(errno));
         close(lockfd);
+        lockfd = -1;
         return EXIT_FAILURE;
     }
 #endif
 
     /* All OK */
     close(lockfd);
+    lockfd = -1;
     return EXIT_SUCCESS;
 }
@@ -0,0 +1,397 @@
+/*
+   Copyright (C) 2014-2020, Rudolf Sikorski <rudolf.sikorski@freenet.de>
+
+   This file is part of the `drwebmirror' program.
+
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "drwebmirror.h"
+
+/* States of HTTP response parser */
+#define HTTP_VERSION        0   /* HTTP-version of status line */
+#define HTTP_CODE           1   /* status-code */
+#define HTTP_REASON         2   /* reason-phrase up to LF */
+#define HTTP_LINE_BEGIN     3   /* begin of header line, field may be continued or head may end */
+#define HTTP_NAME           4   /* field-name */
+#define HTTP_VALUE          5   /* field-value up to LF */
+#define HTTP_HEAD_END       6   /* CR of empty line received, LF expected */
+#define HTTP_BODY           7   /* identity body */
+#define HTTP_CHUNK_SIZE     8   /* chunk-size */
+#define HTTP_CHUNK_EXT      9   /* chunk-ext up to LF */
+#define HTTP_CHUNK_DATA     10  /* chunk-data */
+#define HTTP_CHUNK_END      11  /* CRLF after chunk-data */
+#define HTTP_TRAILER        12  /* trailer-part up to empty line */
+/* HTTP_DONE and HTTP_ERROR are defined in drwebmirror.h */
+
+/* Parse HTTP-date <str> (RFC 2616, section 3.3.1), return 0 if failed */
+static time_t http_date(char * str)
+{
+    struct tm raw_time;
+    char month[4];
+    const int valid_sscanf_count = 6;
+    int current_sscanf_count = 0;
+    time_t result;
+
+    memset(&raw_time, 0, sizeof(struct tm));
+    raw_time.tm_wday = -1;
+    raw_time.tm_yday = -1;
+    raw_time.tm_isdst = -1;
+
+    /* Sun, 06 Nov 1994 08:49:37 GMT  ; RFC 822, updated by RFC 1123 */
+    if(current_sscanf_count != valid_sscanf_count)
+        current_sscanf_count = sscanf(str, "%*[^,], %d %3[^ ] %d %d:%d:%d",
+                                      & raw_time.tm_mday, month, & raw_time.tm_year,
+                                      & raw_time.tm_hour, & raw_time.tm_min, & raw_time.tm_sec);
+
+    /* Sunday, 06-Nov-94 08:49:37 GMT ; RFC 850, obsoleted by RFC 1036 */
+    if(current_sscanf_count != valid_sscanf_count)
+        current_sscanf_count = sscanf(str, "%*[^,], %d-%3[^-]-%d %d:%d:%d",
+                                      & raw_time.tm_mday, month, & raw_time.tm_year,
+                                      & raw_time.tm_hour, & raw_time.tm_min, & raw_time.tm_sec);
+
+    /* Sun Nov  6 08:49:37 1994       ; ANSI C's asctime() format */
+    if(current_sscanf_count != valid_sscanf_count)
+        current_sscanf_count = sscanf(str, "%*[^ ] %3[^ ] %d %d:%d:%d %d",
+                                      month, & raw_time.tm_mday, & raw_time.tm_hour,
+                                      & raw_time.tm_min, & raw_time.tm_sec, & raw_time.tm_year);
+
+    if(current_sscanf_count != valid_sscanf_count)
+        return 0;
+
+    month[3] = '\0';
+    to_lowercase(month);
+    if     (strcmp(month, "jan") == 0) raw_time.tm_mon = 0;
+    else if(strcmp(month, "feb") == 0) raw_time.tm_mon = 1;
+    else if(strcmp(month, "mar") == 0) raw_time.tm_mon = 2;
+    else if(strcmp(month, "apr") == 0) raw_time.tm_mon = 3;
+    else if(strcmp(month, "may") == 0) raw_time.tm_mon = 4;
+    else if(strcmp(month, "jun") == 0) raw_time.tm_mon = 5;
+    else if(strcmp(month, "jul") == 0) raw_time.tm_mon = 6;
+    else if(strcmp(month, "aug") == 0) raw_time.tm_mon = 7;
+    else if(strcmp(month, "sep") == 0) raw_time.tm_mon = 8;
+    else if(strcmp(month, "oct") == 0) raw_time.tm_mon = 9;
+    else if(strcmp(month, "nov") == 0) raw_time.tm_mon = 10;
+    else if(strcmp(month, "dec") == 0) raw_time.tm_mon = 11;
+    else return 0;
+    if(raw_time.tm_year >= 1900) raw_time.tm_year -= 1900;
+    else if(raw_time.tm_year < 70) raw_time.tm_year += 100;
+
+    result = mktime(& raw_time);
+    if(result > 0)
+        result += tzshift;
+    else
+        result = 0;
+    return result;
+}
+
+/* Apply complete header field from <hp> */
+static void http_field(http_parser * hp)
+{
+    char * name = hp->name, * value = hp->value;
+    hp->name[hp->name_len] = '\0';
+    while(hp->value_len > 0 && (value[hp->value_len - 1] == ' ' || value[hp->value_len - 1] == '\t'))
+        hp->value_len--;
+    value[hp->value_len] = '\0';
+    to_lowercase(name);
+
+    if(strcmp(name, "connection") == 0)
+    {
+        to_lowercase(value);
+        if(strcmp(value, "keep-alive") == 0)
+            hp->keep_alive = 1;
+        else if(strcmp(value, "close") == 0)
+            hp->keep_alive = 0;
+    }
+    else if(strcmp(name, "content-length") == 0)
+    {
+        if(sscanf(value, "%lu", & hp->length) == 1)
+            hp->has_length = 1;
+    }
+    else if(strcmp(name, "last-modified") == 0)
+    {
+        hp->last_modified = http_date(value);
+        if(hp->last_modified == 0)
+            fprintf(ERRFP, "Warning: Can't parse Last-Modified: %s\n", value);
+    }
+    else if(strcmp(name, "transfer-encoding") == 0)
+    {
+        char * last = strrchr(value, ',');
+        to_lowercase(value);
+        bsd_strlcpy(hp->transfer_encoding, value, sizeof(hp->transfer_encoding));
+        last = last ? last + 1 : value;
+        while(* last == ' ' || * last == '\t')
+            last++;
+        hp->is_chunked = strcmp(last, "chunked") == 0 ? 1 : 0;
+    }
+    else if(strcmp(name, "content-encoding") == 0)
+    {
+        to_lowercase(value);
+        bsd_strlcpy(hp->content_encoding, value, sizeof(hp->content_encoding));
+    }
+    else if(strcmp(name, "content-range") == 0)
+    {
+        unsigned long range_end;
+        to_lowercase(value);
+        if(sscanf(value, "bytes %lu-%lu/%lu", & hp->range_begin, & range_end, & hp->range_total) != 3)
+            hp->range_begin = hp->range_total = 0;
+    }
+    else if(strcmp(name, "location") == 0)
+    {
+        bsd_strlcpy(hp->location, value, sizeof(hp->location));
+    }
+    hp->name_len = hp->value_len = 0;
+}
+
+/* Switch <hp> from head to body after empty line */
+static void http_head_end(http_parser * hp)
+{
+    if(hp->status >= 100 && hp->status < 200 && hp->status != 101) /* Interim response, real one follows */
+    {
+        http_init(hp);
+        return;
+    }
+    if(hp->status == 204 || hp->status == 304)
+    {
+        hp->has_length = 1;
+        hp->length = 0;
+    }
+    if(hp->is_chunked)
+    {
+        hp->state = HTTP_CHUNK_SIZE;
+        hp->has_digits = 0;
+        hp->remain = 0;
+    }
+    else
+    {
+        hp->state = (hp->has_length && hp->length == 0) ? HTTP_DONE : HTTP_BODY;
+        hp->remain = hp->length;
+    }
+    hp->head_done = 1;
+}
+
+/* Prepare parser <hp> for new response */
+void http_init(http_parser * hp)
+{
+    hp->state = HTTP_VERSION;
+    hp->status = 0;
+    hp->head_done = 0;
+    hp->is_chunked = 0;
+    hp->has_length = 0;
+    hp->keep_alive = -1;
+    hp->has_digits = 0;
+    hp->length = 0;
+    hp->remain = 0;
+    hp->received = 0;
+    hp->range_begin = 0;
+    hp->range_total = 0;
+    hp->last_modified = 0;
+    hp->location[0] = '\0';
+    hp->transfer_encoding[0] = '\0';
+    hp->content_encoding[0] = '\0';
+    hp->name_len = hp->value_len = hp->line_len = 0;
+}
+
+/* Parse response head from <buf> of <size> bytes, return number of consumed bytes.
+ * Stops right after the empty line, HTTP_HEAD_DONE(hp) is true then */
+size_t http_parse_head(http_parser * hp, const char * buf, size_t size)
+{
+    const char * curr = buf, * end = buf + size;
+    while(curr < end && !hp->head_done && hp->state != HTTP_ERROR)
+    {
+        char c = * curr++;
+        switch(hp->state)
+        {
+        case HTTP_VERSION:
+            if(c == ' ')
+                hp->state = hp->line_len >= 5 ? HTTP_CODE : HTTP_ERROR;
+            else if(c == '\n' || (hp->line_len < 5 && c != "HTTP/"[hp->line_len]))
+                hp->state = HTTP_ERROR;
+            hp->line_len++;
+            break;
+        case HTTP_CODE:
+            if(c >= '0' && c <= '9' && hp->status < 1000)
+                hp->status = hp->status * 10 + (c - '0');
+            else if(hp->status < 100 || hp->status > 999)
+                hp->state = HTTP_ERROR;
+            else if(c == '\n')
+                hp->state = HTTP_LINE_BEGIN;
+            else
+                hp->state = HTTP_REASON;
+            break;
+        case HTTP_REASON:
+            if(c == '\n')
+                hp->state = HTTP_LINE_BEGIN;
+            break;
+        case HTTP_LINE_BEGIN:
+            if((c == ' ' || c == '\t') && hp->name_len > 0) /* obs-fold */
+            {
+                if(hp->value_len < sizeof(hp->value) - 1)
+                    hp->value[hp->value_len++] = ' ';
+                hp->state = HTTP_VALUE;
+                break;
+            }
+            if(hp->name_len > 0)
+                http_field(hp);
+            if(c == '\r')
+                hp->state = HTTP_HEAD_END;
+            else if(c == '\n')
+                http_head_end(hp);
+            else if(c == ':' || c == ' ' || c == '\t')
+                hp->state = HTTP_ERROR;
+            else
+            {
+                hp->name[hp->name_len++] = c;
+                hp->state = HTTP_NAME;
+            }
+            break;
+        case HTTP_NAME:
+            if(c == ':')
+                hp->state = HTTP_VALUE;
+            else if(c == '\n')
+                hp->state = HTTP_ERROR;
+            else if(hp->name_len < sizeof(hp->name) - 1)
+                hp->name[hp->name_len++] = c;
+            break;
+        case HTTP_VALUE:
+            if(c == '\n')
+            {
+                if(hp->value_len > 0 && hp->value[hp->value_len - 1] == '\r')
+                    hp->value_len--;
+                hp->state = HTTP_LINE_BEGIN;
+            }
+            else if((c != ' ' && c != '\t') || hp->value_len > 0) /* Skip leading whitespaces */
+            {
+                if(hp->value_len < sizeof(hp->value) - 1)
+                    hp->value[hp->value_len++] = c;
+            }
+            break;
+        case HTTP_HEAD_END:
+            if(c == '\n')
+                http_head_end(hp);
+            else
+                hp->state = HTTP_ERROR;
+            break;
+        }
+    }
+    return (size_t)(curr - buf);
+}
+
+/* Parse response body from <buf> of <size> bytes, return number of consumed bytes.
+ * Content found is returned in <data> and <data_size>, at most one piece per call */
+size_t http_parse_body(http_parser * hp, const char * buf, size_t size, const char ** data, size_t * data_size)
+{
+    const char * curr = buf, * end = buf + size;
+    * data_size = 0;
+    while(curr < end && * data_size == 0 && hp->state != HTTP_DONE && hp->state != HTTP_ERROR)
+    {
+        char c = * curr;
+        switch(hp->state)
+        {
+        case HTTP_BODY:
+        case HTTP_CHUNK_DATA:
+            * data = curr;
+            * data_size = (size_t)(end - curr);
+            if((hp->state == HTTP_CHUNK_DATA || hp->has_length) && * data_size > hp->remain)
+                * data_size = (size_t)hp->remain;
+            curr += * data_size;
+            hp->received += (unsigned long)(* data_size);
+            if(hp->state == HTTP_CHUNK_DATA || hp->has_length)
+            {
+                hp->remain -= (unsigned long)(* data_size);
+                if(hp->remain == 0)
+                    hp->state = hp->state == HTTP_CHUNK_DATA ? HTTP_CHUNK_END : HTTP_DONE;
+            }
+            break;
+        case HTTP_CHUNK_SIZE:
+            if(((c >= '0' && c <= '9') || (c >= 'a' && c <= 'f') || (c >= 'A' && c <= 'F')) &&
+               hp->remain > (ULONG_MAX >> 4)) /* Chunk size does not fit */
+                hp->state = HTTP_ERROR;
+            else if(c >= '0' && c <= '9')
+                hp->remain = (hp->remain << 4) | (unsigned long)(c - '0');
+            else if(c >= 'a' && c <= 'f')
+                hp->remain = (hp->remain << 4) | (unsigned long)(c - 'a' + 10);
+            else if(c >= 'A' && c <= 'F')
+                hp->remain = (hp->remain << 4) | (unsigned long)(c - 'A' + 10);
+            else if(hp->has_digits && (c == ';' || c == ' ' || c == '\t' || c == '\r'))
+                hp->state = HTTP_CHUNK_EXT;
+            else if(hp->has_digits && c == '\n')
+                hp->state = hp->remain ? HTTP_CHUNK_DATA : HTTP_TRAILER;
+            else
+                hp->state = HTTP_ERROR;
+            hp->has_digits = 1;
+            curr++;
+            break;
+        case HTTP_CHUNK_EXT:
+            if(c == '\n')
+            {
+                hp->state = hp->remain ? HTTP_CHUNK_DATA : HTTP_TRAILER;
+                hp->line_len = 0;
+            }
+            curr++;
+            break;
+        case HTTP_CHUNK_END:
+            if(c == '\n')
+            {
+                hp->state = HTTP_CHUNK_SIZE;
+                hp->has_digits = 0;
+            }
+            else if(c != '\r')
+                hp->state = HTTP_ERROR;
+            curr++;
+            break;
+        case HTTP_TRAILER:
+            if(c == '\n')
+            {
+                if(hp->line_len == 0)
+                    hp->state = HTTP_DONE;
+                hp->line_len = 0;
+            }
+            else if(c != '\r')
+                hp->line_len++;
+            curr++;
+            break;
+        }
+    }
+    return (size_t)(curr - buf);
+}
+
+/* Account <size> bytes of identity body that were received bypassing the parser */
+void http_skip_body(http_parser * hp, unsigned long size)
+{
+    if(hp->state != HTTP_BODY)
+        return;
+    if(hp->has_length)
+    {
+        if(size > hp->remain)
+            size = hp->remain;
+        hp->remain -= size;
+        if(hp->remain == 0)
+            hp->state = HTTP_DONE;
+    }
+    hp->received += size;
+}
+
+/* Connection was closed by server, return EXIT_SUCCESS if this completes the body */
+int http_parse_eof(http_parser * hp)
+{
+    if(hp->state == HTTP_BODY && !hp->has_length)
+    {
+        hp->state = HTTP_DONE;
+        return EXIT_SUCCESS;
+    }
+    if(hp->state == HTTP_DONE)
+        return EXIT_SUCCESS;
+    return EXIT_FAILURE;
+}
@@ -0,0 +1,637 @@
+/*
+ * File: inflate.c
+ * Description: Simple streaming decoder for deflate, zlib and gzip formats
+ * Author: Rudolf Sikorski <rudolf.sikorski@freenet.de>
+ * Revision: Sun, 18 Oct 2026 12:00:00 +0000
+ * License: Public Domain
+ */
+#include <string.h>
+#include "inflate.h"
+
+/* States of decoder */
+#define M_GZIP_ID       0   /* gzip magic number */
+#define M_GZIP_FLAGS    1   /* gzip compression method and flags */
+#define M_GZIP_SKIP     2   /* gzip mtime, xfl and os */
+#define M_GZIP_XLEN     3   /* gzip length of extra field */
+#define M_GZIP_EXTRA    4   /* gzip extra field */
+#define M_GZIP_NAME     5   /* gzip zero-terminated file name */
+#define M_GZIP_COMMENT  6   /* gzip zero-terminated comment */
+#define M_GZIP_HCRC     7   /* gzip header CRC16 */
+#define M_ZLIB_HEAD     8   /* zlib CMF and FLG */
+#define M_BLOCK         9   /* block header */
+#define M_STORED_LEN    10  /* stored block LEN */
+#define M_STORED_NLEN   11  /* stored block NLEN */
+#define M_STORED_COPY   12  /* stored block data */
+#define M_TABLE         13  /* dynamic block HLIT, HDIST and HCLEN */
+#define M_LENLENS       14  /* code lengths of code length code */
+#define M_CODELENS      15  /* code lengths of literal/length and distance codes */
+#define M_CODEREP       16  /* repeat count of code length */
+#define M_LEN           17  /* literal/length symbol */
+#define M_LENEXT        18  /* length extra bits */
+#define M_DIST          19  /* distance symbol */
+#define M_DISTEXT       20  /* distance extra bits */
+#define M_MATCH         21  /* copy of match */
+#define M_CHECK_LOW     22  /* first half of trailer check value */
+#define M_CHECK_HIGH    23  /* second half of trailer check value */
+#define M_SIZE_LOW      24  /* first half of gzip ISIZE */
+#define M_SIZE_HIGH     25  /* second half of gzip ISIZE */
+#define M_DONE          26  /* end of stream */
+#define M_BAD           27  /* error */
+
+/* Flags of gzip header */
+#define GZIP_FHCRC      0x02
+#define GZIP_FEXTRA     0x04
+#define GZIP_FNAME      0x08
+#define GZIP_FCOMMENT   0x10
+#define GZIP_RESERVED   0xe0
+
+/* Huffman decoding results other than symbol */
+#define CODE_NEED       (-1)
+#define CODE_BAD        (-2)
+
+static const short length_base[29] =
+{
+    3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31,
+    35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258
+};
+static const short length_extra[29] =
+{
+    0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2,
+    3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0
+};
+static const unsigned short dist_base[30] =
+{
+    1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193,
+    257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145, 8193, 12289, 16385, 24577
+};
+static const short dist_extra[30] =
+{
+    0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6,
+    7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13
+};
+static const short lens_order[19] =
+{
+    16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15
+};
+
+/* Update CRC32 <crc> with <size> bytes from <buf> */
+static unsigned long crc32_update(unsigned long crc, const unsigned char * buf, size_t size)
+{
+    static const unsigned long crc_tab[16] =
+    {
+        0x00000000UL, 0x1db71064UL, 0x3b6e20c8UL, 0x26d930acUL,
+        0x76dc4190UL, 0x6b6b51f4UL, 0x4db26158UL, 0x5005713cUL,
+        0xedb88320UL, 0xf00f9344UL, 0xd6d6a3e8UL, 0xcb61b38cUL,
+        0x9b64c2b0UL, 0x86d3d2d4UL, 0xa00ae278UL, 0xbdbdf21cUL
+    };
+    crc = crc ^ 0xffffffffUL;
+    while(size--)
+    {
+        crc ^= * buf++;
+        crc = crc_tab[crc & 0x0f] ^ (crc >> 4);
+        crc = crc_tab[crc & 0x0f] ^ (crc >> 4);
+    }
+    return crc ^ 0xffffffffUL;
+}
+
+/* Update Adler-32 <adler> with <size> bytes from <buf> */
+static unsigned long adler32_update(unsigned long adler, const unsigned char * buf, size_t size)
+{
+    unsigned long a = adler & 0xffff, b = (adler >> 16) & 0xffff;
+    while(size > 0)
+    {
+        size_t n = size > 5552 ? 5552 : size; /* Largest n without overflow of <b> */
+        size -= n;
+        while(n--)
+        {
+            a += * buf++;
+            b += a;
+        }
+        a %= 65521UL;
+        b %= 65521UL;
+    }
+    return (b << 16) | a;
+}
+
+/* Build Huffman code <h> from <n> code lengths <length>, return non-zero if it is over-subscribed */
+static int construct(inflate_huffman * h, const short * length, int n)
+{
+    int symbol, len, left;
+    short offs[16];
+
+    for(len = 0; len < 16; len++)
+        h->count[len] = 0;
+    for(symbol = 0; symbol < n; symbol++)
+        h->count[length[symbol]]++;
+
+    left = 1;
+    for(len = 1; len < 16; len++)
+    {
+        left <<= 1;
+        left -= h->count[len];
+        if(left < 0)
+            return 1;
+    }
+
+    offs[1] = 0;
+    for(len = 1; len < 15; len++)
+        offs[len + 1] = offs[len] + h->count[len];
+    for(symbol = 0; symbol < n; symbol++)
+        if(length[symbol] != 0)
+            h->symbol[offs[length[symbol]]++] = (short)symbol;
+    return 0;
+}
+
+/* Decode one symbol of code <h> from bit buffer, consume bits only if symbol is complete */
+static int decode(inflate_state * s, const inflate_huffman * h)
+{
+    int code = 0, first = 0, index = 0, count;
+    unsigned len;
+    unsigned long hold = s->hold;
+
+    for(len = 1; len < 16; len++)
+    {
+        if(len > s->bits)
+            return CODE_NEED;
+        code |= (int)(hold & 1);
+        hold >>= 1;
+        count = h->count[len];
+        if(code - count < first)
+        {
+            s->hold = hold;
+            s->bits -= len;
+            return h->symbol[index + (code - first)];
+        }
+        index += count;
+        first += count;
+        first <<= 1;
+        code <<= 1;
+    }
+    return CODE_BAD;
+}
+
+/* Take <n> bits from bit buffer */
+static unsigned bits_take(inflate_state * s, unsigned n)
+{
+    unsigned val = (unsigned)(s->hold & ((1UL << n) - 1));
+    s->hold >>= n;
+    s->bits -= n;
+    return val;
+}
+
+/* Add output not yet counted to check value */
+static void check_update(inflate_state * s)
+{
+    size_t size = s->wpos - s->wcheck;
+    if(size == 0)
+        return;
+    if(s->format == INFLATE_GZIP)
+        s->check = crc32_update(s->check, s->window + s->wcheck, size);
+    else if(s->format == INFLATE_ZLIB)
+        s->check = adler32_update(s->check, s->window + s->wcheck, size);
+    s->total += (unsigned long)size;
+    s->wcheck = s->wpos;
+}
+
+/* Prepare decoder <s> for stream of format <format> */
+void inflate_init(inflate_state * s, int format)
+{
+    s->format = format;
+    s->mode = (format == INFLATE_GZIP) ? M_GZIP_ID : ((format == INFLATE_RAW) ? M_BLOCK : M_ZLIB_HEAD);
+    s->msg = NULL;
+    s->hold = 0;
+    s->bits = 0;
+    s->last = 0;
+    s->flags = 0;
+    s->check = (format == INFLATE_GZIP) ? 0 : 1;
+    s->total = 0;
+    s->wpos = s->wflush = s->wcheck = 0;
+    s->wfull = 0;
+}
+
+/* Decode up to <in_size> bytes from <in>, number of consumed bytes is stored into <in_used>.
+ * Decoded data is returned in <out> and <out_size> and valid until next call. */
+int inflate_run(inflate_state * s, const unsigned char * in, size_t in_size, size_t * in_used,
+                const unsigned char ** out, size_t * out_size)
+{
+    const unsigned char * next = in;
+    size_t left = in_size;
+    int sym;
+
+/* Fill bit buffer up to <n> bits or leave if input is over */
+#define NEEDBITS(n) \
+    do { \
+        while(s->bits < (unsigned)(n)) \
+        { \
+            if(left == 0) goto leave; \
+            s->hold |= (unsigned long)(* next++) << s->bits; \
+            s->bits += 8; \
+            left--; \
+        } \
+    } while(0)
+/* Fill bit buffer with as many bits as one Huffman code may take */
+#define PULLBITS() \
+    do { \
+        while(s->bits < 15 && left > 0) \
+        { \
+            s->hold |= (unsigned long)(* next++) << s->bits; \
+            s->bits += 8; \
+            left--; \
+        } \
+    } while(0)
+/* Switch to error state with message <m> */
+#define BAD(m) \
+    do { \
+        s->msg = (m); \
+        s->mode = M_BAD; \
+        goto leave; \
+    } while(0)
+
+    if(s->wpos == INFLATE_WSIZE) /* Previous output returned, window may be reused */
+    {
+        s->wpos = s->wflush = s->wcheck = 0;
+        s->wfull = 1;
+    }
+
+    for(;;)
+    {
+        switch(s->mode)
+        {
+        case M_GZIP_ID:
+            NEEDBITS(16);
+            if(bits_take(s, 16) != 0x8b1f)
+                BAD("incorrect gzip header");
+            s->mode = M_GZIP_FLAGS;
+            /* Fall through */
+        case M_GZIP_FLAGS:
+            NEEDBITS(16);
+            if(bits_take(s, 8) != 8)
+                BAD("unknown compression method");
+            s->flags = (int)bits_take(s, 8);
+            if(s->flags & GZIP_RESERVED)
+                BAD("unknown gzip flags");
+            s->length = 6;
+            s->mode = M_GZIP_SKIP;
+            /* Fall through */
+        case M_GZIP_SKIP:
+            while(s->length > 0)
+            {
+                NEEDBITS(8);
+                bits_take(s, 8);
+                s->length--;
+            }
+            s->mode = M_GZIP_XLEN;
+            /* Fall through */
+        case M_GZIP_XLEN:
+            s->length = 0;
+            if(s->flags & GZIP_FEXTRA)
+            {
+                NEEDBITS(16);
+                s->length = bits_take(s, 16);
+            }
+            s->mode = M_GZIP_EXTRA;
+            /* Fall through */
+        case M_GZIP_EXTRA:
+            while(s->length > 0)
+            {
+                NEEDBITS(8);
+                bits_take(s, 8);
+                s->length--;
+            }
+            s->mode = M_GZIP_NAME;
+            /* Fall through */
+        case M_GZIP_NAME:
+            if(s->flags & GZIP_FNAME)
+            {
+                do
+                    NEEDBITS(8);
+                while(bits_take(s, 8) != 0);
+            }
+            s->mode = M_GZIP_COMMENT;
+            /* Fall through */
+        case M_GZIP_COMMENT:
+            if(s->flags & GZIP_FCOMMENT)
+            {
+                do
+                    NEEDBITS(8);
+                while(bits_take(s, 8) != 0);
+            }
+            s->mode = M_GZIP_HCRC;
+            /* Fall through */
+        case M_GZIP_HCRC:
+            if(s->flags & GZIP_FHCRC)
+            {
+                NEEDBITS(16);
+                bits_take(s, 16);
+            }
+            s->mode = M_BLOCK;
+            break;
+
+        case M_ZLIB_HEAD:
+            NEEDBITS(16);
+            {
+                unsigned cmf = (unsigned)(s->hold & 0xff), flg = (unsigned)((s->hold >> 8) & 0xff);
+                if((cmf & 0x0f) != 8 || (cmf >> 4) > 7 || ((cmf << 8) | flg) % 31 != 0)
+                {
+                    if(s->format == INFLATE_AUTO) /* Some servers send raw deflate */
+                    {
+                        s->format = INFLATE_RAW;
+                        s->mode = M_BLOCK;
+                        break;
+                    }
+                    BAD("incorrect zlib header");
+                }
+                if(flg & 0x20)
+                    BAD("preset dictionary is not supported");
+                bits_take(s, 16);
+                s->format = INFLATE_ZLIB;
+                s->mode = M_BLOCK;
+            }
+            break;
+
+        case M_BLOCK:
+            if(s->last)
+            {
+                check_update(s);
+                bits_take(s, s->bits & 7);
+                s->mode = (s->format == INFLATE_RAW) ? M_DONE : M_CHECK_LOW;
+                break;
+            }
+            NEEDBITS(3);
+            s->last = (int)bits_take(s, 1);
+            switch(bits_take(s, 2))
+            {
+            case 0:
+                bits_take(s, s->bits & 7);
+                s->mode = M_STORED_LEN;
+                break;
+            case 1:
+                for(sym = 0; sym < 144; sym++) s->lens[sym] = 8;
+                for(; sym < 256; sym++) s->lens[sym] = 9;
+                for(; sym < 280; sym++) s->lens[sym] = 7;
+                for(; sym < 288; sym++) s->lens[sym] = 8;
+                construct(& s->lencode, s->lens, 288);
+                for(sym = 0; sym < 30; sym++) s->lens[sym] = 5;
+                construct(& s->distcode, s->lens, 30);
+                s->mode = M_LEN;
+                break;
+            case 2:
+                s->mode = M_TABLE;
+                break;
+            default:
+                BAD("invalid block type");
+            }
+            break;
+
+        case M_STORED_LEN:
+            NEEDBITS(16);
+            s->length = bits_take(s, 16);
+            s->mode = M_STORED_NLEN;
+            /* Fall through */
+        case M_STORED_NLEN:
+            NEEDBITS(16);
+            if(bits_take(s, 16) != (~s->length & 0xffff))
+                BAD("invalid stored block lengths");
+            s->mode = M_STORED_COPY;
+            /* Fall through */
+        case M_STORED_COPY:
+            while(s->length > 0)
+            {
+                if(s->wpos == INFLATE_WSIZE)
+                    goto leave;
+                if(s->bits >= 8) /* Bytes pulled before alignment */
+                {
+                    s->window[s->wpos++] = (unsigned char)bits_take(s, 8);
+                    s->length--;
+                }
+                else
+                {
+                    size_t n = s->length;
+                    if(left == 0)
+                        goto leave;
+                    if(n > left) n = left;
+                    if(n > INFLATE_WSIZE - s->wpos) n = INFLATE_WSIZE - s->wpos;
+                    memcpy(s->window + s->wpos, next, n);
+                    s->wpos += (unsigned)n;
+                    next += n;
+                    left -= n;
+                    s->length -= (unsigned)n;
+                }
+            }
+            s->mode = M_BLOCK;
+            break;
+
+        case M_TABLE:
+            NEEDBITS(14);
+            s->nlen = bits_take(s, 5) + 257;
+            s->ndist = bits_take(s, 5) + 1;
+            s->ncode = bits_take(s, 4) + 4;
+            if(s->nlen > 286 || s->ndist > 30)
+                BAD("too many length or distance symbols");
+            s->have = 0;
+            s->mode = M_LENLENS;
+            /* Fall through */
+        case M_LENLENS:
+            while(s->have < s->ncode)
+            {
+                NEEDBITS(3);
+                s->lens[lens_order[s->have++]] = (short)bits_take(s, 3);
+            }
+            while(s->have < 19)
+                s->lens[lens_order[s->have++]] = 0;
+            if(construct(& s->lencode, s->lens, 19))
+                BAD("invalid code lengths set");
+            s->have = 0;
+            s->mode = M_CODELENS;
+            /* Fall through */
+        case M_CODELENS:
+            while(s->have < s->nlen + s->ndist)
+            {
+                PULLBITS();
+                sym = decode(s, & s->lencode);
+                if(sym == CODE_NEED)
+                    goto leave;
+                if(sym < 0)
+                    BAD("invalid code lengths set");
+                if(sym < 16)
+                {
+                    s->lens[s->have++] = (short)sym;
+                    continue;
+                }
+                if(sym == 16 && s->have == 0)
+                    BAD("invalid bit length repeat");
+                s->length = (unsigned)sym;
+                s->mode = M_CODEREP;
+                /* Fall through */
+        case M_CODEREP:
+                {
+                    short len = 0;
+                    unsigned rep;
+                    if(s->length == 16)
+                    {
+                        NEEDBITS(2);
+                        rep = 3 + bits_take(s, 2);
+                        len = s->lens[s->have - 1];
+                    }
+                    else if(s->length == 17)
+                    {
+                        NEEDBITS(3);
+                        rep = 3 + bits_take(s, 3);
+                    }
+                    else
+                    {
+                        NEEDBITS(7);
+                        rep = 11 + bits_take(s, 7);
+                    }
+                    if(s->have + rep > s->nlen + s->ndist)
+                        BAD("invalid bit length repeat");
+                    while(rep--)
+                        s->lens[s->have++] = len;
+                    s->mode = M_CODELENS;
+                }
+            }
+            if(s->lens[256] == 0)
+                BAD("invalid code -- missing end-of-block");
+            if(construct(& s->lencode, s->lens, (int)s->nlen))
+                BAD("invalid literal/lengths set");
+            if(construct(& s->distcode, s->lens + s->nlen, (int)s->ndist))
+                BAD("invalid distances set");
+            s->mode = M_LEN;
+            /* Fall through */
+        case M_LEN:
+            for(;;)
+            {
+                if(s->wpos == INFLATE_WSIZE)
+                    goto leave;
+                PULLBITS();
+                sym = decode(s, & s->lencode);
+                if(sym == CODE_NEED)
+                    goto leave;
+                if(sym < 0)
+                    BAD("invalid literal/length code");
+                if(sym < 256)
+                {
+                    s->window[s->wpos++] = (unsigned char)sym;
+                    continue;
+                }
+                break;
+            }
+            if(sym == 256)
+            {
+                s->mode = M_BLOCK;
+                break;
+            }
+            sym -= 257;
+            if(sym >= 29)
+                BAD("invalid literal/length code");
+            s->length = (unsigned)length_base[sym];
+            s->extra = (unsigned)length_extra[sym];
+            s->mode = M_LENEXT;
+            /* Fall through */
+        case M_LENEXT:
+            if(s->extra > 0)
+            {
+                NEEDBITS(s->extra);
+                s->length += bits_take(s, s->extra);
+            }
+            s->mode = M_DIST;
+            /* Fall through */
+        case M_DIST:
+            PULLBITS();
+            sym = decode(s, & s->distcode);
+            if(sym == CODE_NEED)
+                goto leave;
+            if(sym < 0 || sym >= 30)
+                BAD("invalid distance code");
+            s->dist = dist_base[sym];
+            s->extra = (unsigned)dist_extra[sym];
+            s->mode = M_DISTEXT;
+            /* Fall through */
+        case M_DISTEXT:
+            if(s->extra > 0)
+            {
+                NEEDBITS(s->extra);
+                s->dist += bits_take(s, s->extra);
+            }
+            if(s->dist > (s->wfull ? INFLATE_WSIZE : s->wpos))
+                BAD("invalid distance too far back");
+            s->mode = M_MATCH;
+            /* Fall through */
+        case M_MATCH:
+            {
+                unsigned from = (s->wpos >= s->dist) ? s->wpos - s->dist : s->wpos + INFLATE_WSIZE - s->dist;
+                while(s->length > 0)
+                {
+                    if(s->wpos == INFLATE_WSIZE)
+                        goto leave;
+                    s->window[s->wpos++] = s->window[from++];
+                    if(from == INFLATE_WSIZE)
+                        from = 0;
+                    s->length--;
+                }
+            }
+            s->mode = M_LEN;
+            break;
+
+        case M_CHECK_LOW:
+            NEEDBITS(16);
+            s->value = bits_take(s, 16);
+            s->mode = M_CHECK_HIGH;
+            /* Fall through */
+        case M_CHECK_HIGH:
+            NEEDBITS(16);
+            s->value |= (unsigned long)bits_take(s, 16) << 16;
+            if(s->format == INFLATE_ZLIB) /* Adler-32 is stored in big-endian order */
+                s->value = ((s->value & 0xff) << 24) | ((s->value & 0xff00) << 8) |
+                           ((s->value >> 8) & 0xff00) | ((s->value >> 24) & 0xff);
+            if(s->value != (s->check & 0xffffffffUL))
+                BAD("incorrect data check");
+            if(s->format == INFLATE_ZLIB)
+            {
+                s->mode = M_DONE;
+                break;
+            }
+            s->mode = M_SIZE_LOW;
+            /* Fall through */
+        case M_SIZE_LOW:
+            NEEDBITS(16);
+            s->value = bits_take(s, 16);
+            s->mode = M_SIZE_HIGH;
+            /* Fall through */
+        case M_SIZE_HIGH:
+            NEEDBITS(16);
+            s->value |= (unsigned long)bits_take(s, 16) << 16;
+            if(s->value != (s->total & 0xffffffffUL))
+                BAD("incorrect length check");
+            s->mode = M_DONE;
+            break;
+
+        case M_DONE:
+        case M_BAD:
+        default:
+            goto leave;
+        }
+    }
+
+leave:
+#undef NEEDBITS
+#undef PULLBITS
+#undef BAD
+    if(s->wpos == INFLATE_WSIZE)
+        check_update(s);
+    * in_used = (size_t)(next - in);
+    * out = s->window + s->wflush;
+    * out_size = s->wpos - s->wflush;
+    s->wflush = s->wpos;
+    if(s->mode == M_BAD)
+        return INFLATE_ERROR;
+    if(s->mode == M_DONE)
+        return INFLATE_END;
+    return INFLATE_OK;
+}
+
+/* Check if whole stream is decoded */
+int inflate_finished(const inflate_state * s)
+{
+    return s->mode == M_DONE && s->wflush == s->wpos;
+}
@@ -0,0 +1,72 @@
+/*
+ * File: inflate.h
+ * Description: Simple streaming decoder for deflate, zlib and gzip formats
+ * Author: Rudolf Sikorski <rudolf.sikorski@freenet.de>
+ * Revision: Sun, 18 Oct 2026 12:00:00 +0000
+ * License: Public Domain
+ */
+#ifndef INFLATE_H
+#define INFLATE_H
+
+#include <stddef.h>
+
+/* Formats of compressed stream */
+#define INFLATE_RAW     0   /* raw deflate (RFC 1951) */
+#define INFLATE_ZLIB    1   /* zlib wrapper (RFC 1950) */
+#define INFLATE_GZIP    2   /* gzip wrapper (RFC 1952) */
+#define INFLATE_AUTO    3   /* zlib wrapper or raw deflate, detected by header */
+
+/* Return values of inflate_run() */
+#define INFLATE_OK      0   /* more input expected */
+#define INFLATE_END     1   /* end of stream reached, check value is correct */
+#define INFLATE_ERROR   (-1)/* invalid stream, see <msg> */
+
+/* Size of sliding window, all output passes through it */
+#define INFLATE_WSIZE   32768U
+
+/* Canonical Huffman code */
+typedef struct
+{
+    short count[16];            /* Number of codes of each length */
+    short symbol[288];          /* Symbols ordered by code */
+} inflate_huffman;
+
+/* State of decoder, allocates nothing and may be fed by arbitrary pieces of input */
+typedef struct
+{
+    int format;                 /* Format of stream */
+    int mode;                   /* Current state */
+    const char * msg;           /* Error description */
+    unsigned long hold;         /* Bit buffer */
+    unsigned bits;              /* Number of bits in <hold> */
+    int last;                   /* Flag of last block */
+    int flags;                  /* Flags of gzip header */
+    unsigned long check;        /* CRC32 or Adler-32 of output */
+    unsigned long total;        /* Length of output modulo 2^32 */
+    unsigned long value;        /* First half of 32-bit value being read */
+    unsigned length;            /* Stored block length, match length or bytes to skip */
+    unsigned dist;              /* Match distance */
+    unsigned extra;             /* Number of extra bits */
+    unsigned nlen, ndist, ncode;/* Number of codes in dynamic block header */
+    unsigned have;              /* Number of code lengths read */
+    short lens[320];            /* Code lengths */
+    inflate_huffman lencode;    /* Literal/length code */
+    inflate_huffman distcode;   /* Distance code */
+    unsigned wpos;              /* Write position in window */
+    unsigned wflush;            /* Start of output not yet returned */
+    unsigned wcheck;            /* Start of output not yet added to <check> */
+    int wfull;                  /* Flag of window wrapped at least once */
+    unsigned char window[INFLATE_WSIZE];
+} inflate_state;
+
+/* Prepare decoder <s> for stream of format <format> */
+void inflate_init(inflate_state * s, int format);
+/* Decode up to <in_size> bytes from <in>, number of consumed bytes is stored into <in_used>.
+ * Decoded data is returned in <out> and <out_size> and valid until next call.
+ * Call it again with rest of input (possibly empty) while <out_size> is not zero. */
+int inflate_run(inflate_state * s, const unsigned char * in, size_t in_size, size_t * in_used,
+                const unsigned char ** out, size_t * out_size);
+/* Check if whole stream is decoded */
+int inflate_finished(const inflate_state * s);
+
+#endif /* INFLATE_H */
@@ -0,0 +1,148 @@
+/*
+   Copyright (C) 2014-2020, Rudolf Sikorski <rudolf.sikorski@freenet.de>
+
+   This file is part of the `drwebmirror' program.
+
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "drwebmirror.h"
+
+/*
+   Journal is a text file next to lock file:
+   first line is "manifest <sha256 of main list>",
+   every next line is "<size> <mtime> <checksum> <filename>" of verified file.
+   Lines are only appended, so incomplete last line after crash is just ignored.
+*/
+
+/* Opened journal, NULL if not used */
+static FILE * journal_fp;
+/* Entries of interrupted run with the same manifest */
+static avl_node * journal_tree;
+/* Path to journal */
+static char journal_file[STRBUFSIZE];
+
+/* Start journal of update with main list <list>, entries of interrupted run are kept if list is the same */
+int journal_open(const char * list)
+{
+    char manifest[65], line[STRBUFSIZE + 128];
+    char * delim;
+    FILE * fp;
+    int8_t same = 0;
+
+    journal_close(0);
+    delim = strrchr(lockfile, '/');
+    if(!delim || (size_t)(delim - lockfile) + sizeof(JOURNALFILENAME) >= sizeof(journal_file))
+        return EXIT_FAILURE;
+    memcpy(journal_file, lockfile, (size_t)(delim - lockfile) + 1);
+    strcpy(journal_file + (delim - lockfile) + 1, JOURNALFILENAME);
+    if(sha256sum(list, manifest) != EXIT_SUCCESS)
+        return EXIT_FAILURE;
+
+    fp = fopen(journal_file, "r");
+    if(fp)
+    {
+        if(fgets(line, sizeof(line), fp) && strncmp(line, "manifest ", 9) == 0 &&
+           strncmp(line + 9, manifest, 64) == 0)
+        {
+            same = 1;
+            while(fgets(line, sizeof(line), fp))
+            {
+                unsigned long size;
+                long mtime;
+                char checksum[65];
+                int name_pos = 0;
+                size_t len = strlen(line);
+                if(len == 0 || line[len - 1] != '\n') /* Torn write */
+                    break;
+                line[len - 1] = '\0';
+                if(sscanf(line, "%lu %ld %64s %n", & size, & mtime, checksum, & name_pos) == 3 &&
+                   name_pos > 0 && line[name_pos] != '\0')
+                {
+                    line[name_pos - 1] = '\0';
+                    journal_tree = avl_insert(journal_tree, line + name_pos, line);
+                }
+            }
+        }
+        fclose(fp);
+    }
+
+    if(same)
+    {
+        journal_fp = fopen(journal_file, "a");
+        if(verbose && journal_tree)
+            printf("Resuming interrupted update from journal\n");
+    }
+    else
+    {
+        journal_fp = fopen(journal_file, "w");
+        if(journal_fp)
+        {
+            fprintf(journal_fp, "manifest %s\n", manifest);
+            fflush(journal_fp);
+        }
+    }
+    if(!journal_fp)
+    {
+        fprintf(ERRFP, "Warning: Error %d with fopen() on %s: %s\n", errno, journal_file, strerror(errno));
+        return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}
+
+/* Check if file <filename> with checksum <checksum> was verified by interrupted run and was not changed since */
+int journal_check(const char * filename, const char * checksum)
+{
+    const char * entry;
+    unsigned long size;
+    long mtime;
+    char checksum_journal[65];
+    off_t file_size;
+    time_t file_mtime;
+
+    if(!journal_tree)
+        return 0;
+    entry = avl_hash(journal_tree, filename);
+    if(!entry || sscanf(entry, "%lu %ld %64s", & size, & mtime, checksum_journal) != 3)
+        return 0;
+    if(strcmp(checksum_journal, checksum) != 0 || !file_info(filename, & file_size, & file_mtime))
+        return 0;
+    return (unsigned long)file_size == size && (long)file_mtime == mtime;
+}
+
+/* Record file <filename> with verified checksum <checksum> */
+void journal_add(const char * filename, const char * checksum)
+{
+    off_t size;
+    time_t mtime;
+    if(!journal_fp || !file_info(filename, & size, & mtime))
+        return;
+    fprintf(journal_fp, "%lu %ld %s %s\n", (unsigned long)size, (long)mtime, checksum, filename);
+    fflush(journal_fp);
+}
+
+/* Finish journal, it is removed if update is <complete> */
+void journal_close(int8_t complete)
+{
+    if(journal_fp)
+    {
+        fclose(journal_fp);
+        journal_fp = NULL;
+        if(complete)
+            remove(journal_file);
+    }
+    if(journal_tree)
+        avl_dealloc(journal_tree);
+    journal_tree = NULL;
+}
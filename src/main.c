@@ -32,6 +32,7 @@ typedef enum
     OPT_AGENT,
     OPT_SERVER,
     OPT_SERVER_FB,
+    OPT_SERVERS,
     OPT_HTTP_USER,
     OPT_HTTP_PASS,
     OPT_HTTP_VER,
@@ -43,6 +44,16 @@ typedef enum
     OPT_PROXY_USER,
     OPT_PROXY_PASS,
     OPT_FAST,
+    OPT_TIMESTAMP,
+    OPT_COMPRESS,
+    OPT_PROBE,
+    OPT_PRUNE,
+    OPT_PRUNE_DRY_RUN,
+    OPT_STAGE,
+    OPT_STORE,
+    OPT_SEED,
+    OPT_LOW_SPEED,
+    OPT_LOW_SPEED_TIME,
     OPT_VERBOSE,
     OPT_MORE_VERBOSE,
     OPT_HELP
@@ -79,6 +90,9 @@ void show_help(void)
            "  -a,  --agent=STRING              set custom User Agent\n"
            "  -s,  --server=ADDRESS[:PORT]     set update server address and port\n"
            "  -S,  --server-fb=ADDRESS[:PORT]  set fallback update server address and port\n"
+           "       --servers=LIST              set comma-separated list of update servers to spread\n"
+           "                                   downloads across (ADDRESS[:PORT], `msk' or `all')\n"
+           "                                   or read such list from FILE given as @FILE\n"
            "       --http-user=USER            set username for HTTP connection\n"
            "       --http-password=PASS        set password for HTTP connection\n"
            "       --http-version=VER          set HTTP protocol version (1.0 or 1.1)\n"
@@ -89,6 +103,24 @@ void show_help(void)
            "       --proxy-user=USER           set username for HTTP proxy\n"
            "       --proxy-password=PASS       set password for HTTP proxy\n"
            "  -f,  --fast                      use fast checksums checking (dangerous)\n"
+           "  -t,  --timestamp                 skip update if remote timestamp is unchanged\n"
+           "                                   since last successful update (v4 and v5 only)\n"
+           "  -z,  --compress                  request gzip/deflate compression of text lists\n"
+           "       --low-speed=KB              abort and resume transfer slower than KB per second\n"
+           "                                   (default 1, 0 to disable)\n"
+           "       --low-speed-time=SEC        measure transfer speed during SEC seconds (default 30)\n"
+           "       --probe[=FILE]              measure update servers, show them ranked and save\n"
+           "                                   best ones to FILE for use with --servers=@FILE\n"
+           "       --prune[=N]                 delete files not referenced by manifests for more\n"
+           "                                   than N successful updates (default 3, v4, v5 and v7)\n"
+           "       --prune-dry-run             only show files which --prune would delete\n"
+           "       --stage                     update new generation of remote directory and switch\n"
+           "                                   to it at once when update is complete (not for A)\n"
+           "       --store=DIR                 share files with equal SHA256 sum between remotes\n"
+           "                                   through object store DIR (v5 and v7)\n"
+           "       --seed[=DIR]                copy files with equal SHA256 sum from other remotes\n"
+           "                                   under DIR instead of downloading (default is local\n"
+           "                                   directory, v5 and v7)\n"
            "  -v,  --verbose                   show verbose output\n"
            "  -V,  --verbose-full              show even more verbose output\n"
            "  -h,  --help                      show this help\n"
@@ -373,13 +405,28 @@ void detect_server(const char * dir)
     bsd_strlcpy(servername, "update.geo.drweb.com", sizeof(servername));
 }
 
+/* Unlock and remove lock file */
+static int remove_lock(void)
+{
+    if(do_unlock() != EXIT_SUCCESS)
+        return EXIT_FAILURE;
+    if(verbose) printf("Removing lock file\n");
+    file_changed(lockfile);
+    if(remove(lockfile) != 0)
+    {
+        fprintf(ERRFP, "Error: Error %d with remove() %s: %s\n", errno, lockfile, strerror(errno));
+        return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}
+
 /* Main function */
 int main(int argc, char * argv[])
 {
     int opt = 0, i;
     int8_t o_k = 0, o_a = 0, o_s = 0, o_p = 0, o_r = 0, o_l = 0, o_v = 0, o_h = 0;
     int8_t o_u = 0, o_m = 0, o_H = 0, o_P = 0, o_V = 0, o_f = 0, o_pr = 0, o_pru = 0, o_prp = 0;
-    int8_t o_htu = 0, o_htp = 0, o_htv = 0, o_sfb = 0;
+    int8_t o_t = 0, o_htu = 0, o_htp = 0, o_htv = 0, o_sfb = 0, o_z = 0, o_srv = 0, o_pb = 0, o_st = 0, o_sd = 0;
     char * optval = NULL;
     protocol_version proto = PROTO_INVALID;
     char * workdir = NULL;
@@ -395,7 +442,8 @@ int main(int argc, char * argv[])
     int status = EXIT_FAILURE;
     char * proxy_user = NULL, * proxy_pass = NULL;
     char * http_user = NULL, * http_pass = NULL, * http_ver = NULL;
-    char * servername_fb = NULL;
+    char * servername_fb = NULL, * servers = NULL, * probe_file = NULL, * store_file = NULL;
+    char * seed_file = NULL;
 
 #if !defined(_WIN32)
     memset(& sigact, 0, sizeof(struct sigaction));
@@ -429,6 +477,8 @@ int main(int argc, char * argv[])
                     opt = OPT_SERVER;
                 else if(strstr(argv[i] + 2, "server-fb=") == argv[i] + 2)
                     opt = OPT_SERVER_FB;
+                else if(strstr(argv[i] + 2, "servers=") == argv[i] + 2)
+                    opt = OPT_SERVERS;
                 else if(strstr(argv[i] + 2, "http-user=") == argv[i] + 2)
                     opt = OPT_HTTP_USER;
                 else if(strstr(argv[i] + 2, "http-password=") == argv[i] + 2)
@@ -451,6 +501,26 @@ int main(int argc, char * argv[])
                     opt = OPT_PROXY;
                 else if(strcmp(argv[i] + 2, "fast") == 0)
                     opt = OPT_FAST;
+                else if(strcmp(argv[i] + 2, "timestamp") == 0)
+                    opt = OPT_TIMESTAMP;
+                else if(strcmp(argv[i] + 2, "compress") == 0)
+                    opt = OPT_COMPRESS;
+                else if(strstr(argv[i] + 2, "low-speed=") == argv[i] + 2)
+                    opt = OPT_LOW_SPEED;
+                else if(strstr(argv[i] + 2, "low-speed-time=") == argv[i] + 2)
+                    opt = OPT_LOW_SPEED_TIME;
+                else if(strcmp(argv[i] + 2, "probe") == 0 || strstr(argv[i] + 2, "probe=") == argv[i] + 2)
+                    opt = OPT_PROBE;
+                else if(strcmp(argv[i] + 2, "prune") == 0 || strstr(argv[i] + 2, "prune=") == argv[i] + 2)
+                    opt = OPT_PRUNE;
+                else if(strcmp(argv[i] + 2, "prune-dry-run") == 0)
+                    opt = OPT_PRUNE_DRY_RUN;
+                else if(strcmp(argv[i] + 2, "stage") == 0)
+                    opt = OPT_STAGE;
+                else if(strstr(argv[i] + 2, "store=") == argv[i] + 2)
+                    opt = OPT_STORE;
+                else if(strcmp(argv[i] + 2, "seed") == 0 || strstr(argv[i] + 2, "seed=") == argv[i] + 2)
+                    opt = OPT_SEED;
                 else if(strcmp(argv[i] + 2, "verbose-full") == 0)
                     opt = OPT_MORE_VERBOSE;
                 else if(strcmp(argv[i] + 2, "verbose") == 0)
@@ -468,7 +538,8 @@ int main(int argc, char * argv[])
                    opt == OPT_AGENT || opt == OPT_SERVER || opt == OPT_PORT || opt == OPT_PROTO ||
                    opt == OPT_REMOTE || opt == OPT_LOCAL || opt == OPT_PROXY || opt == OPT_PROXY_USER ||
                    opt == OPT_PROXY_PASS || opt == OPT_HTTP_USER || opt == OPT_HTTP_PASS ||
-                   opt == OPT_HTTP_VER || opt == OPT_SERVER_FB)
+                   opt == OPT_HTTP_VER || opt == OPT_SERVER_FB || opt == OPT_SERVERS ||
+                   opt == OPT_LOW_SPEED || opt == OPT_LOW_SPEED_TIME || opt == OPT_STORE)
                 {
                     optval = strchr(argv[i], '=');
                     if(optval)
@@ -482,6 +553,12 @@ int main(int argc, char * argv[])
                         return EXIT_FAILURE;
                     }
                 }
+                else if(opt == OPT_PROBE || opt == OPT_PRUNE || opt == OPT_SEED) /* Value is optional */
+                {
+                    optval = strchr(argv[i], '=');
+                    if(optval)
+                        optval++;
+                }
                 else
                 {
                     optval = NULL;
@@ -513,6 +590,10 @@ int main(int argc, char * argv[])
                     opt = OPT_LOCAL;
                 else if(argv[i][1] == 'f')
                     opt = OPT_FAST;
+                else if(argv[i][1] == 't')
+                    opt = OPT_TIMESTAMP;
+                else if(argv[i][1] == 'z')
+                    opt = OPT_COMPRESS;
                 else if(argv[i][1] == 'V')
                     opt = OPT_MORE_VERBOSE;
                 else if(argv[i][1] == 'v')
@@ -579,6 +660,10 @@ int main(int argc, char * argv[])
             o_sfb++;
             servername_fb = optval;
             break;
+        case OPT_SERVERS:
+            o_srv++;
+            servers = optval;
+            break;
         case OPT_HTTP_USER:
             o_htu++;
             http_user = optval;
@@ -622,6 +707,42 @@ int main(int argc, char * argv[])
         case OPT_FAST:
             o_f++;
             break;
+        case OPT_TIMESTAMP:
+            o_t++;
+            break;
+        case OPT_COMPRESS:
+            o_z++;
+            break;
+        case OPT_LOW_SPEED:
+            low_speed_limit = strtoul(optval, NULL, 10);
+            break;
+        case OPT_LOW_SPEED_TIME:
+            low_speed_time = strtoul(optval, NULL, 10);
+            break;
+        case OPT_PROBE:
+            o_pb++;
+            probe_file = optval;
+            break;
+        case OPT_PRUNE:
+            if(use_prune != PRUNE_DRY_RUN)
+                use_prune = PRUNE_ON;
+            if(optval)
+                prune_grace = strtoul(optval, NULL, 10);
+            break;
+        case OPT_PRUNE_DRY_RUN:
+            use_prune = PRUNE_DRY_RUN;
+            break;
+        case OPT_STAGE:
+            use_stage = 1;
+            break;
+        case OPT_STORE:
+            o_st++;
+            store_file = optval;
+            break;
+        case OPT_SEED:
+            o_sd++;
+            seed_file = optval;
+            break;
         case OPT_VERBOSE:
             o_v++;
             break;
@@ -663,6 +784,37 @@ int main(int argc, char * argv[])
     else
         use_android = 0;
 
+    if(use_stage && use_android)
+    {
+        fprintf(ERRFP, "Error: Staged updates are not supported for Android protocol.\n\n");
+        show_hint();
+        return EXIT_FAILURE;
+    }
+
+    if(o_st) /* Relative to current directory, not to local one */
+    {
+        store_dir[0] = '\0';
+#if defined(_WIN32)
+        if(store_file[0] != '/' && store_file[0] != '\\' && store_file[1] != ':')
+#else
+        if(store_file[0] != '/')
+#endif
+        {
+            if(getcwd(store_dir, sizeof(store_dir)) == NULL)
+            {
+                fprintf(ERRFP, "Error: Can't get current working directory.\n\n");
+                return EXIT_FAILURE;
+            }
+            strcat(store_dir, "/");
+        }
+        if(strlen(store_dir) + strlen(store_file) + 72 >= sizeof(store_dir))
+        {
+            fprintf(ERRFP, "Error: Object store path is too long.\n\n");
+            return EXIT_FAILURE;
+        }
+        strcat(store_dir, store_file);
+    }
+
     if(o_l)
     {
         if(chdir(workdir) < 0)
@@ -673,7 +825,33 @@ int main(int argc, char * argv[])
         }
     }
 
-    if(!o_s)
+    if(o_sd) /* Relative to local directory, which is default */
+    {
+        seed_dir[0] = '\0';
+#if defined(_WIN32)
+        if(!seed_file || (seed_file[0] != '/' && seed_file[0] != '\\' && seed_file[1] != ':'))
+#else
+        if(!seed_file || seed_file[0] != '/')
+#endif
+        {
+            if(getcwd(seed_dir, sizeof(seed_dir)) == NULL)
+            {
+                fprintf(ERRFP, "Error: Can't get current working directory.\n\n");
+                return EXIT_FAILURE;
+            }
+            if(seed_file)
+                strcat(seed_dir, "/");
+        }
+        if(seed_file && strlen(seed_dir) + strlen(seed_file) >= sizeof(seed_dir))
+        {
+            fprintf(ERRFP, "Error: Seed directory path is too long.\n\n");
+            return EXIT_FAILURE;
+        }
+        if(seed_file)
+            strcat(seed_dir, seed_file);
+    }
+
+    if(!o_s && !o_srv)
         detect_server(remotedir);
     else
     {
@@ -804,6 +982,40 @@ int main(int argc, char * argv[])
     else
         serverport = 80;
 
+    mirrors_count = 0;
+    if(o_s || !o_srv)
+        mirror_add(servername, serverport, 0);
+    if(o_srv)
+    {
+        if(mirror_add_list(servers) != EXIT_SUCCESS)
+        {
+            show_hint();
+            return EXIT_FAILURE;
+        }
+        bsd_strlcpy(servername, mirrors[0].name, sizeof(servername));
+        serverport = mirrors[0].port;
+        srand((unsigned)time(NULL));
+    }
+    if(o_pb && !o_srv)
+        mirror_add_list("all");
+    if(o_sfb)
+    {
+        uint16_t serverport_fb = 80;
+        char * delim = strchr(servername_fb, ':');
+        if(delim)
+        {
+            * delim = '\0';
+            serverport_fb = (uint16_t)atoi(++delim);
+            if(serverport_fb == 0)
+            {
+                fprintf(ERRFP, "Incorrecr fallback update server port.\n\n");
+                show_hint();
+                return EXIT_FAILURE;
+            }
+        }
+        mirror_add(servername_fb, serverport_fb, 1); /* Used for single files when other servers fail */
+    }
+
     if(!o_pr)
     {
         char * http_proxy_env = getenv("http_proxy");
@@ -861,6 +1073,16 @@ int main(int argc, char * argv[])
         use_fast = 1;
     else
         use_fast = 0;
+
+    if(o_t)
+        use_timestamp = 1;
+    else
+        use_timestamp = 0;
+
+    if(o_z)
+        use_compress = 1;
+    else
+        use_compress = 0;
     tree = NULL;
 
     set_tzshift();
@@ -878,15 +1100,47 @@ int main(int argc, char * argv[])
         return EXIT_FAILURE;
     }
 
-update_begin:
-
     conn_startup();
 
+    if(o_pb)
+    {
+        /* Small file shows latency, list of bases shows throughput, only main list is guaranteed to exist */
+        char probe_small[STRBUFSIZE], probe_large[STRBUFSIZE];
+        switch(proto)
+        {
+        case PROTO_VER_4:
+            sprintf(probe_small, "%s/%s", remotedir, "drweb32.lst");
+            sprintf(probe_large, "%s/%s", remotedir, "drweb32.lst");
+            break;
+        case PROTO_VER_5:
+            sprintf(probe_small, "%s/%s", remotedir, "version.lst");
+            sprintf(probe_large, "%s/%s", remotedir, "version.lst");
+            break;
+        case PROTO_VER_5_2:
+            sprintf(probe_small, "%s/%s", remotedir, "version2.lst");
+            sprintf(probe_large, "%s/%s", remotedir, "version2.lst");
+            break;
+        case PROTO_VER_7:
+            sprintf(probe_small, "%s/%s", remotedir, "versions.xml");
+            sprintf(probe_large, "%s/%s", remotedir, "versions.xml");
+            break;
+        default:
+            bsd_strlcpy(probe_small, remotedir, sizeof(probe_small));
+            bsd_strlcpy(probe_large, remotedir, sizeof(probe_large));
+            break;
+        }
+        status = mirror_probe(probe_small, probe_large, probe_file);
+        conn_cleanup();
+        return status;
+    }
+
     printf(proto == PROTO_VER_5_2 ? "" : "-");
     printf("--------- Update bases (v%s) ---------", protocol_version_to_string(proto));
     printf(proto == PROTO_VER_5_2 ? "\n" : "-\n");
     printf("Date:  %s\n", time3);
     printf("From:  http://%s:%u/%s\n", servername, (unsigned)serverport, remotedir);
+    for(i = 1; (size_t)i < mirrors_count; i++)
+        printf("       http://%s:%u/%s\n", mirrors[i].name, (unsigned)mirrors[i].port, remotedir);
     if(getcwd(cwd, sizeof(cwd)) == NULL)
     {
         fprintf(ERRFP, "Error: Can't get current working directory.\n\n");
@@ -921,6 +1175,13 @@ update_begin:
     }
     printf("---------------------------------------\n");
 
+    if(use_stage && stage_begin(remotedir) != EXIT_SUCCESS)
+    {
+        conn_cleanup();
+        printf("FAILED.\n");
+        return EXIT_FAILURE;
+    }
+
     switch(proto)
     {
     case PROTO_VER_4:
@@ -948,32 +1209,26 @@ update_begin:
     if(tree) avl_dealloc(tree);
     tree = NULL;
 
+    if(use_stage)
+    {
+        /* Lock file of generation is not needed anymore, directory itself stays locked by stage_begin() */
+        if(status == EXIT_SUCCESS)
+            status = remove_lock();
+        if(status == EXIT_SUCCESS && update_unchanged) /* Current generation is still up to date */
+            stage_discard(remotedir);
+        else if(status == EXIT_SUCCESS)
+            status = stage_commit(remotedir);
+        else
+            stage_abort();
+    }
+
+    if(verbose)
+        mirror_stats();
+
     if(status != EXIT_SUCCESS)
     {
         printf("FAILED.\n");
         do_unlock();
-        if(o_sfb != 0)
-        {
-            char * delim = strchr(servername_fb, ':');
-            serverport = 80;
-            if(delim)
-            {
-                * delim = '\0';
-                serverport = atoi(++delim);
-                if(serverport == 0)
-                {
-                    fprintf(ERRFP, "Incorrecr fallback update server port.\n\n");
-                    show_hint();
-                    return EXIT_FAILURE;
-                }
-            }
-            bsd_strlcpy(servername, servername_fb, sizeof(servername));
-            o_sfb = 0;
-            fprintf(ERRFP, "Warning: Trying with fallback server...\n");
-            use_fast = 0;
-            fprintf(ERRFP, "Warning: Fast mode has been disabled\n");
-            goto update_begin;
-        }
         return status;
     }
 
@@ -998,13 +1253,7 @@ update_begin:
         printf("%u sec.\n", s);
     }
 
-    if(do_unlock() != EXIT_SUCCESS)
+    if(!use_stage && remove_lock() != EXIT_SUCCESS)
         return EXIT_FAILURE;
-    if(verbose) printf("Removing lock file\n");
-    if(remove(lockfile) != 0)
-    {
-        fprintf(ERRFP, "Error: Error %d with remove() %s: %s\n", errno, lockfile, strerror(errno));
-        return EXIT_FAILURE;
-    }
     return EXIT_SUCCESS;
 }
@@ -0,0 +1,457 @@
+/*
+   Copyright (C) 2014-2020, Rudolf Sikorski <rudolf.sikorski@freenet.de>
+
+   This file is part of the `drwebmirror' program.
+
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "drwebmirror.h"
+#include <sys/stat.h>
+#if !defined(_WIN32)
+#include <fcntl.h>
+#include <sys/mman.h>
+#endif
+
+/*
+   Manifest is mapped into memory as a whole and never copied, lines and
+   fields are returned as slices pointing into the mapping. Lines are split
+   the same way as fscanf(fp, "%[^\r\n]\r\n", buf) did: empty lines and
+   leading whitespace are skipped, but there is no limit of line length.
+   Parsed manifest is an array of entries, names of files are kept in one
+   pool, so whole manifest takes two allocations.
+   Manifest of last successful update is saved next to lock file, every line
+   is "<op> <algo> <lzma> <nested> <size> <lzma size> <digest> <lzma digest> <path>"
+   with "-" for empty digests. Entries of new manifest are looked up there by
+   path, so only new and changed files have to be checked.
+*/
+
+/* Map manifest <filename> into <mf> */
+int mf_open(mf_file * mf, const char * filename)
+{
+#if !defined(_WIN32)
+    struct stat st;
+    int fd = open(filename, O_RDONLY, 0);
+    void * data;
+
+    mf->data = "";
+    mf->size = mf->pos = 0;
+    mf->mapped = 0;
+    if(fd < 0)
+    {
+        fprintf(ERRFP, "Error %d with open() on %s: %s\n", errno, filename, strerror(errno));
+        return EXIT_FAILURE;
+    }
+    if(fstat(fd, & st) != 0 || (off_t)(size_t)st.st_size != st.st_size)
+    {
+        fprintf(ERRFP, "Error: Can't map file %s\n", filename);
+        close(fd);
+        return EXIT_FAILURE;
+    }
+    if(st.st_size == 0)
+    {
+        close(fd);
+        return EXIT_SUCCESS;
+    }
+    data = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if(data == MAP_FAILED)
+    {
+        fprintf(ERRFP, "Error %d with mmap() on %s: %s\n", errno, filename, strerror(errno));
+        return EXIT_FAILURE;
+    }
+#if defined(MADV_SEQUENTIAL)
+    madvise(data, (size_t)st.st_size, MADV_SEQUENTIAL);
+#endif
+    mf->data = (const char *)data;
+    mf->size = (size_t)st.st_size;
+    mf->mapped = 1;
+    return EXIT_SUCCESS;
+#else
+    FILE * fp = fopen(filename, "rb");
+    off_t size = get_size(filename);
+    char * data;
+
+    mf->data = "";
+    mf->size = mf->pos = 0;
+    mf->mapped = 0;
+    if(fp == NULL || size < 0)
+    {
+        fprintf(ERRFP, "Error with fopen() on %s\n", filename);
+        if(fp) fclose(fp);
+        return EXIT_FAILURE;
+    }
+    if(size == 0)
+    {
+        fclose(fp);
+        return EXIT_SUCCESS;
+    }
+    data = (char *)malloc((size_t)size);
+    if(data == NULL || fread(data, 1, (size_t)size, fp) != (size_t)size)
+    {
+        fprintf(ERRFP, "Error: Can't read file %s\n", filename);
+        free(data);
+        fclose(fp);
+        return EXIT_FAILURE;
+    }
+    fclose(fp);
+    mf->data = data;
+    mf->size = (size_t)size;
+    mf->mapped = 1;
+    return EXIT_SUCCESS;
+#endif
+}
+
+/* Get next non-empty line <line> of <mf> without line break, return 0 at end of file */
+int mf_line(mf_file * mf, mf_slice * line)
+{
+    const char * end;
+    while(mf->pos < mf->size && (mf->data[mf->pos] == ' ' || mf->data[mf->pos] == '\t' ||
+                                 mf->data[mf->pos] == '\r' || mf->data[mf->pos] == '\n'))
+        mf->pos++;
+    if(mf->pos >= mf->size)
+        return 0;
+    line->ptr = mf->data + mf->pos;
+    end = (const char *)memchr(line->ptr, '\n', mf->size - mf->pos);
+    line->len = end ? (size_t)(end - line->ptr) : mf->size - mf->pos;
+    mf->pos += line->len;
+    while(line->len > 0 && line->ptr[line->len - 1] == '\r')
+        line->len--;
+    return 1;
+}
+
+/* Restart reading <mf> from first line */
+void mf_rewind(mf_file * mf)
+{
+    mf->pos = 0;
+}
+
+/* Unmap manifest <mf> */
+void mf_close(mf_file * mf)
+{
+    if(mf->mapped)
+    {
+#if !defined(_WIN32)
+        munmap((void *)mf->data, mf->size);
+#else
+        free((void *)mf->data);
+#endif
+    }
+    mf->data = "";
+    mf->size = mf->pos = 0;
+    mf->mapped = 0;
+}
+
+/* Split <line> by <delim> into at most <max> fields <fields> with spaces trimmed, return number of fields */
+size_t mf_split(mf_slice line, char delim, mf_slice * fields, size_t max)
+{
+    size_t count = 0;
+    while(count < max)
+    {
+        const char * end = (const char *)memchr(line.ptr, delim, line.len);
+        mf_slice * f = fields + count++;
+        f->ptr = line.ptr;
+        f->len = end ? (size_t)(end - line.ptr) : line.len;
+        while(f->len > 0 && (f->ptr[0] == ' ' || f->ptr[0] == '\t'))
+        {
+            f->ptr++;
+            f->len--;
+        }
+        while(f->len > 0 && (f->ptr[f->len - 1] == ' ' || f->ptr[f->len - 1] == '\t'))
+            f->len--;
+        if(!end)
+            break;
+        line.len -= (size_t)(end - line.ptr) + 1;
+        line.ptr = end + 1;
+    }
+    return count;
+}
+
+/* Copy <s> into string <str> of <size> bytes, return EXIT_FAILURE if it was truncated */
+int mf_copy(mf_slice s, char * str, size_t size)
+{
+    size_t len = s.len < size ? s.len : size - 1;
+    memcpy(str, s.ptr, len);
+    str[len] = '\0';
+    return len == s.len ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+/* Make path <path> of file <name> in directory <directory>, return EXIT_FAILURE if it is too long */
+int mf_path(char path[STRBUFSIZE], const char * directory, mf_slice name)
+{
+    size_t dir_len = strlen(directory);
+    if(dir_len + name.len + 2 > STRBUFSIZE)
+    {
+        fprintf(ERRFP, "Error: Too long file name %.*s\n", (int)(name.len < 64 ? name.len : 64), name.ptr);
+        path[0] = '\0';
+        return EXIT_FAILURE;
+    }
+    memcpy(path, directory, dir_len);
+    path[dir_len] = '/';
+    memcpy(path + dir_len + 1, name.ptr, name.len);
+    path[dir_len + 1 + name.len] = '\0';
+    return EXIT_SUCCESS;
+}
+
+/* Split entry <line> of flat list into fields <fields> and get its target <filename> in <directory>,
+ * platform prefix and path are dropped, return number of fields or 0 if entry is bad */
+size_t mf_parse_entry(mf_slice line, const char * directory, char filename[STRBUFSIZE], mf_slice fields[5])
+{
+    mf_slice name;
+    const char * tmp;
+    size_t count;
+    line.ptr++;
+    line.len--;
+    count = mf_split(line, ',', fields, 5);
+    if(count < 2)
+        return 0;
+    name = fields[0];
+    while((tmp = (const char *)memchr(name.ptr, '>', name.len)) != NULL) /* if some as "=<w95>spider.vxd, ..." */
+    {
+        name.len -= (size_t)(tmp - name.ptr) + 1;
+        name.ptr = tmp + 1;
+    }
+    while((tmp = (const char *)memchr(name.ptr, '\\', name.len)) != NULL) /* if some as "=<wnt>%SYSDIR%\spider.cpl, ..." */
+    {
+        name.len -= (size_t)(tmp - name.ptr) + 1;
+        name.ptr = tmp + 1;
+    }
+    if((tmp = (const char *)memchr(name.ptr, '|', name.len)) != NULL) /* if some as "!drwreg.exe|-xi, ..." */
+        name.len = (size_t)(tmp - name.ptr);
+    if(mf_path(filename, directory, name) != EXIT_SUCCESS)
+        return 0;
+    return count;
+}
+
+/* Get number from <s> in base <base> */
+unsigned long mf_ulong(mf_slice s, int base)
+{
+    unsigned long result = 0;
+    size_t i;
+    for(i = 0; i < s.len; i++)
+    {
+        int digit;
+        char c = s.ptr[i];
+        if(c >= '0' && c <= '9')
+            digit = c - '0';
+        else if(c >= 'a' && c <= 'f')
+            digit = c - 'a' + 10;
+        else if(c >= 'A' && c <= 'F')
+            digit = c - 'A' + 10;
+        else
+            break;
+        if(digit >= base)
+            break;
+        result = result * (unsigned long)base + (unsigned long)digit;
+    }
+    return result;
+}
+
+/* Prepare empty manifest <m> */
+void manifest_init(manifest * m)
+{
+    m->entries = NULL;
+    m->count = m->alloc = 0;
+    m->names = NULL;
+    m->names_size = m->names_alloc = 0;
+    m->nested = NULL;
+    m->nested_sink = NULL;
+}
+
+/* Add entry with target file <path> and operation <op> to manifest <m>, return NULL if there is no memory */
+mf_entry * manifest_add(manifest * m, const char * path, int8_t op)
+{
+    size_t len = strlen(path) + 1;
+    mf_entry * e;
+    if(m->count == m->alloc)
+    {
+        size_t alloc = m->alloc ? m->alloc * 2 : 256;
+        mf_entry * entries = (mf_entry *)realloc(m->entries, alloc * sizeof(mf_entry));
+        if(!entries)
+        {
+            fprintf(ERRFP, "Error: Not enough memory for manifest\n");
+            return NULL;
+        }
+        m->entries = entries;
+        m->alloc = alloc;
+    }
+    if(m->names_size + len > m->names_alloc)
+    {
+        size_t alloc = m->names_alloc ? m->names_alloc : 16384;
+        char * names;
+        while(m->names_size + len > alloc)
+            alloc *= 2;
+        names = (char *)realloc(m->names, alloc);
+        if(!names)
+        {
+            fprintf(ERRFP, "Error: Not enough memory for manifest\n");
+            return NULL;
+        }
+        m->names = names;
+        m->names_alloc = alloc;
+    }
+    memcpy(m->names + m->names_size, path, len);
+    e = m->entries + m->count++;
+    e->path = m->names_size;
+    m->names_size += len;
+    e->op = op;
+    e->algo = MF_SHA256;
+    e->lzma = e->nested = e->matched = 0;
+    e->size = e->lzma_size = -1;
+    e->digest[0] = e->lzma_digest[0] = '\0';
+    return e;
+}
+
+/* Free manifest <m> */
+void manifest_free(manifest * m)
+{
+    free(m->entries);
+    free(m->names);
+    manifest_init(m);
+}
+
+/* Get path <path> of saved manifest, next to lock file */
+static int manifest_state(char path[STRBUFSIZE])
+{
+    char * delim = strrchr(lockfile, '/');
+    if(!delim || (size_t)(delim - lockfile) + sizeof(MANIFESTFILENAME) >= STRBUFSIZE)
+        return EXIT_FAILURE;
+    memcpy(path, lockfile, (size_t)(delim - lockfile) + 1);
+    strcpy(path + (delim - lockfile) + 1, MANIFESTFILENAME);
+    return EXIT_SUCCESS;
+}
+
+/* Names of manifest being sorted, qsort() has no context */
+static const char * manifest_sort_names;
+
+/* Compare entries <a> and <b> by path */
+static int manifest_cmp(const void * a, const void * b)
+{
+    return strcmp(manifest_sort_names + ((const mf_entry *)a)->path,
+                  manifest_sort_names + ((const mf_entry *)b)->path);
+}
+
+/* Load manifest <last> of last successful update of directory with lock file */
+int manifest_last(manifest * last)
+{
+    char path[STRBUFSIZE], filename[STRBUFSIZE];
+    mf_file mf;
+    mf_slice line, fields[8];
+    mf_entry * e;
+
+    manifest_init(last);
+    if(manifest_state(path) != EXIT_SUCCESS || !exist(path) || mf_open(& mf, path) != EXIT_SUCCESS)
+        return EXIT_FAILURE;
+    while(mf_line(& mf, & line))
+    {
+        mf_slice name;
+        if(mf_split(line, ' ', fields, 8) < 8 || fields[7].ptr + fields[7].len >= line.ptr + line.len)
+            continue;
+        name.ptr = fields[7].ptr + fields[7].len + 1;
+        name.len = (size_t)(line.ptr + line.len - name.ptr);
+        if(mf_copy(name, filename, sizeof(filename)) != EXIT_SUCCESS ||
+           (e = manifest_add(last, filename, (int8_t)mf_ulong(fields[0], 10))) == NULL)
+            continue;
+        e->algo = (int8_t)mf_ulong(fields[1], 10);
+        e->lzma = (int8_t)mf_ulong(fields[2], 10);
+        e->nested = (int8_t)mf_ulong(fields[3], 10);
+        e->size = fields[4].ptr[0] == '-' ? -1 : (off_t)mf_ulong(fields[4], 10);
+        e->lzma_size = fields[5].ptr[0] == '-' ? -1 : (off_t)mf_ulong(fields[5], 10);
+        if(fields[6].ptr[0] != '-')
+            mf_copy(fields[6], e->digest, sizeof(e->digest));
+        if(fields[7].ptr[0] != '-')
+            mf_copy(fields[7], e->lzma_digest, sizeof(e->lzma_digest));
+    }
+    mf_close(& mf);
+    if(last->count == 0)
+        return EXIT_FAILURE;
+    manifest_sort_names = last->names;
+    qsort(last->entries, last->count, sizeof(mf_entry), & manifest_cmp);
+    return EXIT_SUCCESS;
+}
+
+/* Compare entry <e> of manifest <m> with manifest <last>, return MF_ADD if it is new,
+ * MF_REPLACE if it was changed or MF_SAME */
+int manifest_diff(manifest * last, const manifest * m, const mf_entry * e)
+{
+    size_t lo = 0, hi = last->count;
+    const char * path = MF_PATH(m, e);
+    while(lo < hi)
+    {
+        size_t mid = lo + (hi - lo) / 2;
+        mf_entry * l = last->entries + mid;
+        int cmp = strcmp(path, MF_PATH(last, l));
+        if(cmp < 0)
+            hi = mid;
+        else if(cmp > 0)
+            lo = mid + 1;
+        else
+        {
+            l->matched = 1;
+            if(l->op == MF_DELETE || l->algo != e->algo || l->lzma != e->lzma || l->nested != e->nested ||
+               l->size != e->size || l->lzma_size != e->lzma_size ||
+               strcmp(l->digest, e->digest) != 0 || strcmp(l->lzma_digest, e->lzma_digest) != 0)
+                return MF_REPLACE;
+            return MF_SAME;
+        }
+    }
+    return MF_ADD;
+}
+
+/* Count entries of manifest <last> which were not found by manifest_diff() */
+unsigned long manifest_removed(const manifest * last)
+{
+    unsigned long count = 0;
+    size_t i;
+    for(i = 0; i < last->count; i++)
+        if(!last->entries[i].matched && last->entries[i].op != MF_DELETE)
+            count++;
+    return count;
+}
+
+/* Save manifest <m> of successful update of directory with lock file */
+void manifest_save(const manifest * m)
+{
+    char path[STRBUFSIZE];
+    FILE * fp;
+    size_t i;
+
+    if(manifest_state(path) != EXIT_SUCCESS)
+        return;
+    fp = fopen_new(path);
+    if(!fp)
+    {
+        fprintf(ERRFP, "Warning: Error %d with fopen() on %s: %s\n", errno, path, strerror(errno));
+        return;
+    }
+    for(i = 0; i < m->count; i++)
+    {
+        const mf_entry * e = m->entries + i;
+        fprintf(fp, "%d %d %d %d ", (int)e->op, (int)e->algo, (int)e->lzma, (int)e->nested);
+        if(e->size >= 0)
+            fprintf(fp, "%lu ", (unsigned long)e->size);
+        else
+            fprintf(fp, "- ");
+        if(e->lzma_size >= 0)
+            fprintf(fp, "%lu ", (unsigned long)e->lzma_size);
+        else
+            fprintf(fp, "- ");
+        fprintf(fp, "%s %s %s\n", e->digest[0] ? e->digest : "-", e->lzma_digest[0] ? e->lzma_digest : "-", MF_PATH(m, e));
+    }
+    if(fclose(fp) != 0)
+    {
+        fprintf(ERRFP, "Warning: Error %d with fclose() on %s: %s\n", errno, path, strerror(errno));
+        remove(path);
+    }
+}
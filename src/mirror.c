@@ -0,0 +1,359 @@
+/*
+   Copyright (C) 2014-2020, Rudolf Sikorski <rudolf.sikorski@freenet.de>
+
+   This file is part of the `drwebmirror' program.
+
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "drwebmirror.h"
+
+/* Update servers, first one is primary */
+mirror_server mirrors[MAX_MIRRORS];
+size_t mirrors_count;
+
+/* Known update servers */
+static const char * const known_mirrors[] =
+{
+    "update.drweb.com",         "update.msk.drweb.com",     "update.msk3.drweb.com",
+    "update.msk4.drweb.com",    "update.msk5.drweb.com",    "update.msk6.drweb.com",
+    "update.msk7.drweb.com",    "update.msk8.drweb.com",    "update.msk9.drweb.com",
+    "update.msk10.drweb.com",   "update.msk11.drweb.com",   "update.msk12.drweb.com",
+    "update.msk13.drweb.com",   "update.msk14.drweb.com",   "update.msk15.drweb.com",
+    "update.us.drweb.com",      "update.us1.drweb.com",     "update.fr1.drweb.com",
+    "update.kz.drweb.com",      "update.nsk1.drweb.com",    "update.geo.drweb.com"
+};
+
+/* Add update server <name>:<port>, <fallback> server is used only if others are down */
+int mirror_add(const char * name, uint16_t port, int8_t fallback)
+{
+    mirror_server * m;
+    size_t i;
+    for(i = 0; i < mirrors_count; i++)
+        if(mirrors[i].port == port && strcmp(mirrors[i].name, name) == 0)
+            return EXIT_SUCCESS;
+    if(mirrors_count >= MAX_MIRRORS)
+    {
+        fprintf(ERRFP, "Error: Too many update servers.\n");
+        return EXIT_FAILURE;
+    }
+    m = mirrors + mirrors_count++;
+    memset(m, 0, sizeof(mirror_server));
+    bsd_strlcpy(m->name, name, sizeof(m->name));
+    m->port = port;
+    m->fallback = fallback;
+    return EXIT_SUCCESS;
+}
+
+/* Add update servers from comma-separated list <list> of addresses or group names, or from file if <list> is "@FILE" */
+int mirror_add_list(const char * list)
+{
+    if(list[0] == '@') /* List saved by mirror_probe() */
+    {
+        char buf[MAX_MIRRORS * 264];
+        size_t len;
+        FILE * fp = fopen(list + 1, "r");
+        if(!fp)
+        {
+            fprintf(ERRFP, "Error %d with fopen() on %s: %s\n", errno, list + 1, strerror(errno));
+            return EXIT_FAILURE;
+        }
+        len = fread(buf, 1, sizeof(buf) - 1, fp);
+        fclose(fp);
+        while(len > 0 && (buf[len - 1] == '\n' || buf[len - 1] == '\r' || buf[len - 1] == ' ' || buf[len - 1] == '\t'))
+            len--;
+        buf[len] = '\0';
+        if(buf[0] == '@' || strpbrk(buf, "\r\n") != NULL)
+        {
+            fprintf(ERRFP, "Error: Incorrect update server list in %s.\n", list + 1);
+            return EXIT_FAILURE;
+        }
+        return mirror_add_list(buf);
+    }
+    while(* list != '\0')
+    {
+        char name[256];
+        size_t len = strcspn(list, ",");
+        char * delim;
+        uint16_t port = 80;
+
+        if(len == 0 || len >= sizeof(name))
+        {
+            fprintf(ERRFP, "Error: Incorrect update server list.\n");
+            return EXIT_FAILURE;
+        }
+        memcpy(name, list, len);
+        name[len] = '\0';
+        list += len;
+        if(* list == ',')
+            list++;
+
+        if(strcmp(name, "all") == 0 || strcmp(name, "msk") == 0) /* Group of known servers */
+        {
+            size_t i;
+            for(i = 0; i < sizeof(known_mirrors) / sizeof(known_mirrors[0]); i++)
+                if(name[0] == 'a' || strncmp(known_mirrors[i], "update.msk", 10) == 0)
+                    if(mirror_add(known_mirrors[i], 80, 0) != EXIT_SUCCESS)
+                        return EXIT_FAILURE;
+            continue;
+        }
+
+        delim = strchr(name, ':');
+        if(delim)
+        {
+            * delim = '\0';
+            port = (uint16_t)atoi(delim + 1);
+            if(port == 0)
+            {
+                fprintf(ERRFP, "Error: Incorrect port of update server %s.\n", name);
+                return EXIT_FAILURE;
+            }
+        }
+        if(mirror_add(name, port, 0) != EXIT_SUCCESS)
+            return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}
+
+/* Expected usefulness of server <m>, servers without throughput samples get <speed_max> to be tried */
+static double mirror_weight(const mirror_server * m, double speed_max)
+{
+    double speed = m->speed > 0.0 ? m->speed : speed_max;
+    return speed * (1.0 - m->error_rate) * (1.0 - m->error_rate) + 1.0;
+}
+
+/* Select update server for next request, other than <avoid> if possible.
+ * Servers which are up are chosen at random with probability proportional to their
+ * throughput and success rate, fallback servers only if no other server is up.
+ * Server which is down for MIRROR_RETRY seconds is probed again by this request. */
+mirror_server * mirror_select(const mirror_server * avoid)
+{
+    mirror_server * best = mirrors;
+    time_t now = time(NULL);
+    double speed_max = 1.0, total = 0.0, pick;
+    int8_t pass;
+    size_t i;
+
+    if(mirrors_count == 1)
+        return mirrors;
+
+    for(i = 0; i < mirrors_count; i++)
+        if(mirrors[i].speed > speed_max)
+            speed_max = mirrors[i].speed;
+
+    /* Pass 0: regular servers, pass 1: fallback servers, pass 2: <avoid> itself */
+    for(pass = 0; pass < 3; pass++)
+    {
+        total = 0.0;
+        for(i = 0; i < mirrors_count; i++)
+        {
+            mirror_server * m = mirrors + i;
+            if(m->down_until <= now && (pass == 2 ? m == avoid : (m != avoid && m->fallback == pass)))
+                total += mirror_weight(m, speed_max);
+        }
+        if(total > 0.0)
+            break;
+    }
+    if(total <= 0.0) /* All servers are down, use one which will be up soonest */
+    {
+        for(i = 1; i < mirrors_count; i++)
+            if(mirrors[i].down_until < best->down_until)
+                best = mirrors + i;
+        return best;
+    }
+
+    pick = total * ((double)rand() / ((double)RAND_MAX + 1.0));
+    for(i = 0; i < mirrors_count; i++)
+    {
+        mirror_server * m = mirrors + i;
+        if(m->down_until <= now && (pass == 2 ? m == avoid : (m != avoid && m->fallback == pass)))
+        {
+            best = m;
+            pick -= mirror_weight(m, speed_max);
+            if(pick < 0.0)
+                break;
+        }
+    }
+    return best;
+}
+
+/* Account result of request to update server <m>, <size> bytes were received in <seconds> */
+void mirror_report(mirror_server * m, int8_t success, double size, double seconds)
+{
+    m->requests++;
+    if(success)
+    {
+        if(m->down_until != 0)
+            printf("Update server %s:%u is available again\n", m->name, (unsigned)m->port);
+        m->failures = 0;
+        m->down_until = 0;
+        m->error_rate *= 0.8;
+        m->bytes += size;
+        if(m->rate > 0.0) /* Additive increase */
+        {
+            m->rate += PACE_STEP;
+            if(m->rate >= PACE_MAX)
+            {
+                m->rate = 0.0;
+                if(verbose)
+                    printf("Request rate to %s:%u is not limited anymore\n", m->name, (unsigned)m->port);
+            }
+        }
+        if(size >= MIRROR_SAMPLE && seconds > 0.0)
+        {
+            if(m->speed > 0.0)
+                m->speed = 0.7 * m->speed + 0.3 * (size / seconds);
+            else
+                m->speed = size / seconds;
+        }
+        return;
+    }
+
+    m->errors++;
+    m->error_rate = 0.8 * m->error_rate + 0.2;
+    m->failures++;
+    if(m->failures >= MIRROR_FAILS && mirrors_count > 1)
+    {
+        if(m->down_until == 0)
+            fprintf(ERRFP, "Warning: Update server %s:%u is not responding, switching to next one\n",
+                    m->name, (unsigned)m->port);
+        m->down_until = time(NULL) + MIRROR_RETRY;
+    }
+}
+
+/* Wait until request to update server <m> is allowed by its rate limit */
+void mirror_pace(mirror_server * m)
+{
+    double now;
+    if(m->rate <= 0.0)
+        return;
+    now = get_seconds();
+    if(m->next_time > now)
+    {
+        sleep_seconds(m->next_time - now);
+        now = m->next_time;
+    }
+    m->next_time = now + 1.0 / m->rate;
+}
+
+/* Update server <m> is overloaded, halve its allowed request rate, next request waits at least REPEAT_SLEEP */
+void mirror_backoff(mirror_server * m)
+{
+    if(m->rate <= 0.0)
+        m->rate = PACE_START;
+    else /* Multiplicative decrease */
+        m->rate /= 2.0;
+    if(m->rate < PACE_MIN)
+        m->rate = PACE_MIN;
+    m->next_time = get_seconds() + (1.0 / m->rate > REPEAT_SLEEP ? 1.0 / m->rate : REPEAT_SLEEP);
+    if(verbose)
+        printf("Request rate to %s:%u is limited to %.2f/s\n", m->name, (unsigned)m->port, m->rate);
+}
+
+/* Show statistics of update servers */
+void mirror_stats(void)
+{
+    size_t i;
+    if(mirrors_count < 2 && mirrors[0].rate <= 0.0)
+        return;
+    printf("Update servers:\n");
+    for(i = 0; i < mirrors_count; i++)
+        if(mirrors[i].requests > 0)
+        {
+            printf(" * %s:%u: %lu requests, %lu errors, %.0f KB, %.1f KB/s",
+                   mirrors[i].name, (unsigned)mirrors[i].port, mirrors[i].requests, mirrors[i].errors,
+                   mirrors[i].bytes / 1024.0, mirrors[i].speed / 1024.0);
+            if(mirrors[i].rate > 0.0)
+                printf(", limited to %.2f requests/s", mirrors[i].rate);
+            printf("\n");
+        }
+}
+
+/* Measure update servers by downloading files <small> and <large>, which are fetched once if they are the same,
+ * show them ranked and save best ones to file <save> if it is not NULL */
+int mirror_probe(const char * small, const char * large, const char * save)
+{
+    conn_timing ts[MAX_MIRRORS], tl[MAX_MIRRORS];
+    double total[MAX_MIRRORS];
+    size_t rank[MAX_MIRRORS];
+    size_t i, j, good = 0;
+    int8_t single = strcmp(small, large) == 0;
+
+    for(i = 0; i < mirrors_count; i++)
+    {
+        printf("Probing %s:%u\n", mirrors[i].name, (unsigned)mirrors[i].port);
+        total[i] = -1.0;
+        memset(& tl[i], 0, sizeof(conn_timing));
+        if(conn_probe(small, mirrors[i].name, mirrors[i].port, & ts[i]) == EXIT_SUCCESS && ts[i].status == 200 &&
+           (single || (conn_probe(large, mirrors[i].name, mirrors[i].port, & tl[i]) == EXIT_SUCCESS && tl[i].status == 200)))
+        {
+            if(single) /* The same file shows both */
+                tl[i] = ts[i];
+            total[i] = ts[i].dns + ts[i].connect + ts[i].ttfb + ts[i].transfer;
+            if(!single)
+                total[i] += tl[i].dns + tl[i].connect + tl[i].ttfb + tl[i].transfer;
+            good++;
+        }
+        else if(ts[i].status != 0 && ts[i].status != 200)
+            fprintf(ERRFP, "Warning: Update server %s:%u returned %d\n",
+                    mirrors[i].name, (unsigned)mirrors[i].port, ts[i].status);
+        else if(tl[i].status != 0 && tl[i].status != 200)
+            fprintf(ERRFP, "Warning: Update server %s:%u returned %d\n",
+                    mirrors[i].name, (unsigned)mirrors[i].port, tl[i].status);
+
+        /* Insertion sort by total time, failed servers go last */
+        for(j = i; j > 0 && total[i] >= 0.0 &&
+                (total[rank[j - 1]] < 0.0 || total[rank[j - 1]] > total[i]); j--)
+            rank[j] = rank[j - 1];
+        rank[j] = i;
+    }
+
+    printf("\n%-3s %-32s %8s %8s %8s %10s %10s\n", "#", "Server", "DNS ms", "Conn ms", "TTFB ms", "KB/s", "Total ms");
+    for(i = 0; i < mirrors_count; i++)
+    {
+        char address[300];
+        j = rank[i];
+        sprintf(address, "%s:%u", mirrors[j].name, (unsigned)mirrors[j].port);
+        if(total[j] < 0.0)
+            printf("%-3s %-32s %8s %8s %8s %10s %10s\n", "-", address, "-", "-", "-", "-", "failed");
+        else
+            printf("%-3u %-32s %8.0f %8.0f %8.0f %10.1f %10.0f\n", (unsigned)(i + 1), address,
+                   ts[j].dns * 1000.0, ts[j].connect * 1000.0, ts[j].ttfb * 1000.0,
+                   tl[j].transfer > 0.0 ? (double)tl[j].size / tl[j].transfer / 1024.0 : 0.0,
+                   total[j] * 1000.0);
+    }
+
+    if(good == 0)
+    {
+        fprintf(ERRFP, "Error: No update server is available\n");
+        return EXIT_FAILURE;
+    }
+
+    if(save)
+    {
+        /* Best servers as a list for --servers option, winner becomes primary */
+        FILE * fp = fopen(save, "w");
+        if(!fp)
+        {
+            fprintf(ERRFP, "Error %d with fopen(): %s\n", errno, strerror(errno));
+            return EXIT_FAILURE;
+        }
+        for(i = 0; i < good && i < MIRROR_BEST; i++)
+            fprintf(fp, "%s%s:%u", i > 0 ? "," : "", mirrors[rank[i]].name, (unsigned)mirrors[rank[i]].port);
+        fprintf(fp, "\n");
+        fclose(fp);
+        printf("\nBest update servers saved to %s\n", save);
+    }
+    return EXIT_SUCCESS;
+}
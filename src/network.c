@@ -17,7 +17,12 @@
    along with this program.  If not, see <http://www.gnu.org/licenses/>.
 */
 
+#if defined(__linux__) && !defined(_GNU_SOURCE)
+#define _GNU_SOURCE /* splice() */
+#endif
+
 #include "drwebmirror.h"
+#include "inflate/inflate.h"
 #include <sys/types.h>
 #include <limits.h>
 #include <sys/stat.h>
@@ -38,6 +43,7 @@ typedef int socklen_t;
 typedef SOCKET sockfd_t;
 #else
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <netdb.h>
 #include <arpa/inet.h>
 #include <netinet/in.h>
@@ -45,6 +51,10 @@ typedef SOCKET sockfd_t;
 typedef int sockfd_t;
 #endif
 
+#if !defined(O_BINARY)
+#define O_BINARY 0
+#endif
+
 extern char * strptime(const char * buf, const char * format, struct tm * tm);
 extern const char * hstrerror(int err);
 
@@ -72,8 +82,48 @@ int8_t use_proxy_auth;
 char proxy_address[256];
 uint16_t proxy_port;
 char proxy_auth[77];
+/* Compression of text lists */
+int8_t use_compress;
+/* Transfer slower than <low_speed_limit> KB/s during <low_speed_time> seconds is aborted, 0 = never */
+unsigned long low_speed_limit = LOW_SPEED_LIMIT;
+unsigned long low_speed_time = LOW_SPEED_TIME;
 /* Keep-Alive connection descriptor */
 static sockfd_t sock_fd_ka;
+/* Address of host connected by <sock_fd_ka> */
+static char server_ka[256];
+static uint16_t port_ka;
+/* Decoder of compressed response body */
+static inflate_state body_inflate;
+/* Receiver of downloaded content and name of file being received */
+static content_sink body_sink;
+static const char * body_name;
+/* Size of following downloads known from list, -1 if not known */
+static off_t body_expected = -1;
+/* Update server used by last download() */
+static mirror_server * mirror_last;
+/* Time spent on name lookup and TCP handshake by last conn_open() */
+static double conn_dns_time, conn_connect_time;
+
+/* Watchdog of body transfer */
+typedef struct
+{
+    int8_t active;
+    int8_t low_speed;           /* Low-speed window is checked */
+    double deadline;            /* Transfer is aborted after this time, 0 if not set */
+    double window_begin;        /* Start of current low-speed window */
+    unsigned long window_bytes; /* Bytes received in current window */
+} transfer_guard;
+static transfer_guard guard;
+
+/* Partially downloaded file, which can be resumed with Range request */
+typedef struct
+{
+    char name[STRBUFSIZE];
+    unsigned long size;         /* Bytes already in file, 0 if nothing to resume */
+    unsigned long length;       /* Complete length of file */
+    time_t mtime;               /* Last-Modified of file */
+} resume_info;
+static resume_info resume;
 
 /* Check socket status */
 static int socket_good(sockfd_t * sock_fd)
@@ -97,6 +147,206 @@ static void conn_close(sockfd_t * sock_fd)
     sock_fd_ka = SOCKET_BAD_VALUE;
 }
 
+/* Cached redirect: <from_prefix> on <from_server> is rewritten to <to_prefix> on <to_server> */
+typedef struct
+{
+    char from_server[256];
+    uint16_t from_port;
+    char from_prefix[STRBUFSIZE];
+    char to_server[256];
+    uint16_t to_port;
+    char to_prefix[STRBUFSIZE];
+    time_t expires;     /* 0 for permanent redirect */
+} redirect_rule;
+static redirect_rule redirect_cache[REDIRECT_CACHE];
+
+/* Find cached redirect for <filename> on <server>:<port>, the longest prefix wins */
+static redirect_rule * redirect_find(const char * server, uint16_t port, const char * filename)
+{
+    redirect_rule * found = NULL;
+    time_t now = time(NULL);
+    size_t i, found_len = 0;
+    for(i = 0; i < REDIRECT_CACHE; i++)
+    {
+        redirect_rule * rule = redirect_cache + i;
+        size_t len = strlen(rule->from_prefix);
+        if(rule->from_server[0] == '\0' || (rule->expires != 0 && rule->expires < now))
+            continue;
+        if(rule->from_port == port && strcmp(rule->from_server, server) == 0 &&
+           strncmp(rule->from_prefix, filename, len) == 0 && (found == NULL || len > found_len))
+        {
+            found = rule;
+            found_len = len;
+        }
+    }
+    return found;
+}
+
+/* Remember that <from> on <from_server>:<from_port> was redirected to <to> on <to_server>:<to_port>.
+ * Only common path prefix is stored, so other files in the same directory are rewritten too. */
+static void redirect_store(const char * from_server, uint16_t from_port, const char * from,
+                           const char * to_server, uint16_t to_port, const char * to, int8_t permanent)
+{
+    redirect_rule * rule = NULL;
+    size_t i, from_len = strlen(from), to_len = strlen(to), common = 0;
+
+    if(strchr(to, '?') != NULL) /* Signed or session URL, valid only for this file */
+        return;
+    while(common < from_len && common < to_len && from[from_len - common - 1] == to[to_len - common - 1])
+        common++;
+    /* Common suffix must consist of whole path components */
+    while(common > 0 && !((common == from_len || from[from_len - common - 1] == '/') &&
+                          (common == to_len || to[to_len - common - 1] == '/')))
+        common--;
+    if(common == 0)
+        return;
+
+    for(i = 0; i < REDIRECT_CACHE && rule == NULL; i++)
+        if(redirect_cache[i].from_port == from_port && strcmp(redirect_cache[i].from_server, from_server) == 0 &&
+           strlen(redirect_cache[i].from_prefix) == from_len - common &&
+           strncmp(redirect_cache[i].from_prefix, from, from_len - common) == 0)
+            rule = redirect_cache + i;
+    for(i = 0; i < REDIRECT_CACHE && rule == NULL; i++)
+        if(redirect_cache[i].from_server[0] == '\0' ||
+           (redirect_cache[i].expires != 0 && redirect_cache[i].expires < time(NULL)))
+            rule = redirect_cache + i;
+    if(rule == NULL) /* Cache is full, replace oldest temporary rule */
+    {
+        for(i = 0; i < REDIRECT_CACHE; i++)
+            if(redirect_cache[i].expires != 0 && (rule == NULL || redirect_cache[i].expires < rule->expires))
+                rule = redirect_cache + i;
+        if(rule == NULL)
+            return;
+    }
+
+    bsd_strlcpy(rule->from_server, from_server, sizeof(rule->from_server));
+    rule->from_port = from_port;
+    memcpy(rule->from_prefix, from, from_len - common);
+    rule->from_prefix[from_len - common] = '\0';
+    bsd_strlcpy(rule->to_server, to_server, sizeof(rule->to_server));
+    rule->to_port = to_port;
+    memcpy(rule->to_prefix, to, to_len - common);
+    rule->to_prefix[to_len - common] = '\0';
+    rule->expires = permanent ? 0 : time(NULL) + REDIRECT_TTL;
+}
+
+/* Negative cache: optional file which was not found on server */
+typedef struct
+{
+    char * name;
+    time_t expires;     /* File is requested again after this time */
+    unsigned misses;    /* Number of "404 Not Found" in a row */
+} missing_entry;
+static missing_entry * missing;
+static size_t missing_count, missing_alloc;
+static int8_t missing_loaded, missing_dirty;
+static char missing_file[STRBUFSIZE];
+
+/* Find file <filename> in negative cache */
+static missing_entry * missing_find(const char * filename)
+{
+    size_t i;
+    for(i = 0; i < missing_count; i++)
+        if(strcmp(missing[i].name, filename) == 0)
+            return missing + i;
+    return NULL;
+}
+
+/* Add file <filename> to negative cache */
+static missing_entry * missing_add(const char * filename, time_t expires, unsigned misses)
+{
+    missing_entry * entry;
+    if(missing_count == missing_alloc)
+    {
+        size_t new_alloc = missing_alloc ? missing_alloc * 2 : 64;
+        missing_entry * new_missing = (missing_entry *)realloc(missing, new_alloc * sizeof(missing_entry));
+        if(!new_missing)
+            return NULL;
+        missing = new_missing;
+        missing_alloc = new_alloc;
+    }
+    entry = missing + missing_count;
+    entry->name = (char *)malloc((strlen(filename) + 1) * sizeof(char));
+    if(!entry->name)
+        return NULL;
+    strcpy(entry->name, filename);
+    entry->expires = expires;
+    entry->misses = misses;
+    missing_count++;
+    return entry;
+}
+
+/* Load negative cache, it is stored next to lock file */
+static void missing_load(void)
+{
+    FILE * fp;
+    char * delim;
+    char line[STRBUFSIZE + 64];
+
+    if(missing_loaded)
+        return;
+    missing_loaded = 1;
+    missing_file[0] = '\0';
+    delim = strrchr(lockfile, '/');
+    if(!delim || (size_t)(delim - lockfile) + sizeof(MISSINGFILENAME) >= sizeof(missing_file))
+        return;
+    memcpy(missing_file, lockfile, (size_t)(delim - lockfile) + 1);
+    strcpy(missing_file + (delim - lockfile) + 1, MISSINGFILENAME);
+
+    stage_need(missing_file);
+    fp = fopen(missing_file, "r");
+    if(!fp)
+        return;
+    while(fgets(line, sizeof(line), fp))
+    {
+        long expires;
+        unsigned misses;
+        int name_pos = 0;
+        line[strcspn(line, "\r\n")] = '\0';
+        if(sscanf(line, "%ld %u %n", & expires, & misses, & name_pos) == 2 && name_pos > 0 &&
+           line[name_pos] != '\0' && !missing_find(line + name_pos))
+            missing_add(line + name_pos, (time_t)expires, misses);
+    }
+    fclose(fp);
+}
+
+/* Save negative cache and free it */
+static void missing_save(void)
+{
+    size_t i;
+    if(missing_dirty && missing_file[0] != '\0')
+    {
+        FILE * fp = fopen_new(missing_file);
+        if(fp)
+        {
+            time_t now = time(NULL);
+            for(i = 0; i < missing_count; i++)
+                if(missing[i].expires + MISSING_TTL_MAX > now) /* Forget files not asked for long time */
+                    fprintf(fp, "%ld %u %s\n", (long)missing[i].expires, missing[i].misses, missing[i].name);
+            fclose(fp);
+        }
+        else
+            fprintf(ERRFP, "Warning: Error %d with fopen() on %s: %s\n", errno, missing_file, strerror(errno));
+    }
+    for(i = 0; i < missing_count; i++)
+        free(missing[i].name);
+    free(missing);
+    missing = NULL;
+    missing_count = missing_alloc = 0;
+    missing_loaded = missing_dirty = 0;
+}
+
+/* Request template: header fields which are the same for every file requested from one server */
+typedef struct
+{
+    char server[256];
+    uint16_t port;
+    char conn_ka[11];
+    size_t len;
+    char text[STRBUFSIZE * 2];
+} request_template;
+static request_template req_tmpl;
+
 /* Startup network */
 void conn_startup(void)
 {
@@ -107,11 +357,14 @@ void conn_startup(void)
     WSAStartup(wsa_ver, & wsa_data);
 #endif
     sock_fd_ka = SOCKET_BAD_VALUE;
+    req_tmpl.len = 0;
+    memset(redirect_cache, 0, sizeof(redirect_cache));
 }
 
 /* Cleanup network */
 void conn_cleanup(void)
 {
+    missing_save();
     if(socket_good(&sock_fd_ka))
         conn_close(&sock_fd_ka);
 #if defined(_WIN32)
@@ -126,7 +379,7 @@ static int conn_open(sockfd_t * sock_fd, const char * server, uint16_t port)
     /* nginx/1.6.2: 85.10.234.30 */
     /* openresty/1.13.6.1: 46.46.160.202 */
     struct sockaddr_in sock_addr;
-    struct hostent * host_info = gethostbyname(server);
+    struct hostent * host_info;
     struct timeval tv;
     fd_set fdset;
 #if defined(_WIN32)
@@ -135,7 +388,10 @@ static int conn_open(sockfd_t * sock_fd, const char * server, uint16_t port)
 #else
     int sock_opts;
 #endif
+    double time_begin = get_seconds();
 
+    host_info = gethostbyname(server);
+    conn_dns_time = get_seconds() - time_begin;
     if(host_info == NULL)
     {
 #if defined(_WIN32)
@@ -246,6 +502,7 @@ static int conn_open(sockfd_t * sock_fd, const char * server, uint16_t port)
         conn_close(sock_fd);
         return EXIT_FAILURE;
     }
+    conn_connect_time = get_seconds() - time_begin - conn_dns_time;
 
 #if defined(_WIN32)
     /* Change to blocking mode */
@@ -275,166 +532,381 @@ static int conn_open(sockfd_t * sock_fd, const char * server, uint16_t port)
     return EXIT_SUCCESS;
 }
 
-/* Get file <filename> from server */
-static int conn_get(const char * filename)
+/* Write <size> bytes from <buf> to file descriptor <fd> */
+static int write_all(int fd, const char * buf, size_t size)
 {
-    sockfd_t sock_fd;
-
-    char * buffer, * bufpos, * bufend;
-    unsigned long msgsize = 0;
-    int status;
-    int8_t msgbegin;
-    unsigned long msgcurr = 0;
-    size_t redirect_num = 0;
-    size_t send_count, request_len;
-    int8_t is_chunked = 0;
-
-    time_t lastmod = 0;
-    FILE * fp;
-    char filename_dl[STRBUFSIZE];
-    char servername_dl[256];
-    uint16_t serverport_dl = serverport;
-    char conn_ka[11];
-
-    buffer = (char *)calloc(NETBUFSIZE + 4, sizeof(char));
-
-    bsd_strlcpy(filename_dl, filename, sizeof(filename_dl));
-    bsd_strlcpy(servername_dl, servername, sizeof(servername_dl));
-    bsd_strlcpy(conn_ka, "Keep-Alive", sizeof(conn_ka));
-
-    printf("Downloading %s\n", filename);
+    while(size > 0)
+    {
+        ssize_t written = write(fd, buf, size);
+        if(written <= 0)
+            return EXIT_FAILURE;
+        buf += written;
+        size -= (size_t)written;
+    }
+    return EXIT_SUCCESS;
+}
 
-redirect: /* Goto here if 30x received */
-    msgsize = 0;
-    status = -1;
-    msgbegin = 0;
-    is_chunked = 0;
-    lastmod = 0;
+/* Start watching transfer of body, <expected> bytes are expected from server with <speed> bytes per second,
+ * 0 if speed is not measured yet */
+static void guard_start(unsigned long expected, double speed)
+{
+    guard.active = 1;
+    guard.low_speed = low_speed_limit > 0 && low_speed_time > 0;
+    guard.window_begin = get_seconds();
+    guard.window_bytes = 0;
+    guard.deadline = 0.0;
+    if(expected > 0) /* Server with unknown speed is expected to be slow */
+        guard.deadline = guard.window_begin + DEADLINE_MIN +
+                         (speed > 0.0 ? DEADLINE_SCALE * (double)expected / speed : (double)expected / DEADLINE_RATE);
+}
 
-    if(strcmp(servername, servername_dl) != 0 || serverport != serverport_dl)
-        bsd_strlcpy(conn_ka, "close", sizeof(conn_ka));
+/* Account <size> received bytes of body, return EXIT_FAILURE if transfer is stalled */
+static int guard_check(size_t size)
+{
+    double now, elapsed;
+    if(!guard.active)
+        return EXIT_SUCCESS;
+    now = get_seconds();
+    guard.window_bytes += (unsigned long)size;
+    if(guard.deadline > 0.0 && now > guard.deadline)
+    {
+        if(more_verbose) printf("\n\n");
+        fprintf(ERRFP, "Error: Transfer takes too long, aborting\n");
+        return EXIT_FAILURE;
+    }
+    if(!guard.low_speed)
+        return EXIT_SUCCESS;
+    elapsed = now - guard.window_begin;
+    if(elapsed >= (double)low_speed_time)
+    {
+        if((double)guard.window_bytes < (double)low_speed_limit * 1024.0 * elapsed)
+        {
+            if(more_verbose) printf("\n\n");
+            fprintf(ERRFP, "Error: Transfer is too slow (%.2f KB/s during %.0f sec), aborting\n",
+                    (double)guard.window_bytes / 1024.0 / elapsed, elapsed);
+            return EXIT_FAILURE;
+        }
+        guard.window_begin = now;
+        guard.window_bytes = 0;
+    }
+    return EXIT_SUCCESS;
+}
 
-    if(use_proxy == 1)
+#if defined(__linux__)
+/* Move <size> bytes from socket <sock_fd> to file <fd> through a pipe, without copying to user space.
+ * Return -1 if splice() is not usable here, caller should fall back to recv() */
+static int conn_splice(sockfd_t sock_fd, int fd, unsigned long size)
+{
+    int pipe_fd[2];
+    unsigned long moved = 0;
+    if(pipe(pipe_fd) != 0)
+        return -1;
+    while(moved < size)
     {
-        if(!socket_good(&sock_fd_ka))
+        size_t chunk_len = size - moved > NETBUFSIZE ? NETBUFSIZE : (size_t)(size - moved);
+        ssize_t in_pipe = splice(sock_fd, NULL, pipe_fd[1], NULL, chunk_len, SPLICE_F_MOVE | SPLICE_F_MORE);
+        if(in_pipe < 0 && moved == 0 && (errno == EINVAL || errno == ENOSYS))
         {
-            if(conn_open(&sock_fd, proxy_address, proxy_port) != EXIT_SUCCESS) /* Open connection */
-            {
-                free(buffer);
-                return EXIT_FAILURE;
-            }
+            close(pipe_fd[0]);
+            close(pipe_fd[1]);
+            return -1;
         }
-        else
+        if(in_pipe <= 0)
+        {
+            fprintf(ERRFP, "Error %d with splice(): %s\n", errno, in_pipe < 0 ? strerror(errno) : "Connection closed");
+            close(pipe_fd[0]);
+            close(pipe_fd[1]);
+            return EXIT_FAILURE;
+        }
+        if(more_verbose)
         {
-            sock_fd = sock_fd_ka;
+            printf("R");
+            fflush(stdout);
         }
-
-        sprintf(buffer,
-                "GET http://%s:%u/%s HTTP/%s\r\n"
-                "Proxy-Connection: %s\r\n",
-                servername_dl, (unsigned)serverport_dl, filename_dl, http_version, conn_ka);
-        if(use_proxy_auth == 1)
-            sprintf(buffer + strlen(buffer),
-                    "Proxy-Authorization: Basic %s\r\n",
-                    proxy_auth);
-
-    }
-    else
-    {
-        if(!socket_good(&sock_fd_ka))
+        if(guard_check((size_t)in_pipe) != EXIT_SUCCESS)
+        {
+            close(pipe_fd[0]);
+            close(pipe_fd[1]);
+            return EXIT_FAILURE;
+        }
+        while(in_pipe > 0)
         {
-            if(conn_open(&sock_fd, servername_dl, serverport_dl) != EXIT_SUCCESS) /* Open connection */
+            ssize_t out_pipe = splice(pipe_fd[0], NULL, fd, NULL, (size_t)in_pipe, SPLICE_F_MOVE | SPLICE_F_MORE);
+            if(out_pipe < 0 && errno == EINVAL) /* Filesystem can't splice, data already left socket */
             {
-                free(buffer);
+                char tmp[4096];
+                out_pipe = read(pipe_fd[0], tmp, (size_t)in_pipe > sizeof(tmp) ? sizeof(tmp) : (size_t)in_pipe);
+                if(out_pipe > 0 && write_all(fd, tmp, (size_t)out_pipe) != EXIT_SUCCESS)
+                    out_pipe = -1;
+            }
+            if(out_pipe <= 0)
+            {
+                fprintf(ERRFP, "Error %d with splice(): %s\n", errno, strerror(errno));
+                close(pipe_fd[0]);
+                close(pipe_fd[1]);
                 return EXIT_FAILURE;
             }
+            in_pipe -= out_pipe;
+            moved += (unsigned long)out_pipe;
         }
-        else
+        if(more_verbose)
         {
-            sock_fd = sock_fd_ka;
+            printf("W");
+            fflush(stdout);
         }
-
-        sprintf(buffer, "GET /%s HTTP/%s\r\n", filename_dl, http_version);
     }
+    close(pipe_fd[0]);
+    close(pipe_fd[1]);
+    return EXIT_SUCCESS;
+}
+#endif
+
+/* Prepare template of request to <server>:<port> with Connection: <conn_ka>, if not prepared yet */
+static void request_fill(const char * server, uint16_t port, const char * conn_ka)
+{
+    char * curr = req_tmpl.text;
+    if(req_tmpl.len > 0 && req_tmpl.port == port &&
+       strcmp(req_tmpl.server, server) == 0 && strcmp(req_tmpl.conn_ka, conn_ka) == 0)
+        return;
+
+    bsd_strlcpy(req_tmpl.server, server, sizeof(req_tmpl.server));
+    bsd_strlcpy(req_tmpl.conn_ka, conn_ka, sizeof(req_tmpl.conn_ka));
+    req_tmpl.port = port;
 
-    sprintf(buffer + strlen(buffer),
-            "Accept: */*\r\n"
-            "Accept-Encoding: identity\r\n"
-            "Accept-Ranges: bytes\r\n"
-            "Host: %s:%u\r\n",
-            servername_dl, (unsigned)serverport_dl);
+    if(use_proxy == 1)
+    {
+        curr += sprintf(curr,
+                        "Proxy-Connection: %s\r\n",
+                        conn_ka);
+        if(use_proxy_auth == 1)
+            curr += sprintf(curr,
+                            "Proxy-Authorization: Basic %s\r\n",
+                            proxy_auth);
+    }
+    curr += sprintf(curr,
+                    "Accept: */*\r\n"
+                    "Accept-Ranges: bytes\r\n"
+                    "Host: %s:%u\r\n",
+                    server, (unsigned)port);
     if(use_http_auth == 1)
-        sprintf(buffer + strlen(buffer),
-                "Authorization: Basic %s\r\n",
-                http_auth);
+        curr += sprintf(curr,
+                        "Authorization: Basic %s\r\n",
+                        http_auth);
     if(use_android == 0)
-        sprintf(buffer + strlen(buffer),
-                "X-DrWeb-Validate: %s\r\n"
-                "X-DrWeb-KeyNumber: %s\r\n",
-                key_md5sum, key_userid);
+        curr += sprintf(curr,
+                        "X-DrWeb-Validate: %s\r\n"
+                        "X-DrWeb-KeyNumber: %s\r\n",
+                        key_md5sum, key_userid);
     if(use_syshash == 1)
-        sprintf(buffer + strlen(buffer),
-                "X-DrWeb-SysHash: %s\r\n",
-                syshash);
+        curr += sprintf(curr,
+                        "X-DrWeb-SysHash: %s\r\n",
+                        syshash);
     if(useragent[0] != '\0')
-        sprintf(buffer + strlen(buffer),
-                "User-Agent: %s\r\n",
-                useragent);
-    sprintf(buffer + strlen(buffer),
-            "Connection: %s\r\n"
-            "Cache-Control: no-cache\r\n\r\n",
-            conn_ka);
-
-    request_len = strlen(buffer);
-    if(more_verbose)
-    {
-        size_t i;
-        printf("\n");
-        for(i = 0; i < request_len; i++)
-            if(buffer[i] != '\r')
-                printf("%c", buffer[i]);
-    }
+        curr += sprintf(curr,
+                        "User-Agent: %s\r\n",
+                        useragent);
+    curr += sprintf(curr,
+                    "Connection: %s\r\n"
+                    "Cache-Control: no-cache\r\n\r\n",
+                    conn_ka);
+    req_tmpl.len = (size_t)(curr - req_tmpl.text);
+}
 
+/* Send request line <line> followed by template <tmpl> with one gather write,
+ * <buffer> is scratch space for systems without writev() */
+static int conn_send(sockfd_t sock_fd, const char * line, size_t line_len,
+                     const char * tmpl, size_t tmpl_len, char * buffer)
+{
     /* Number of bytes actually sent out might be less than the number you told it to send */
     /* See http://beej.us/guide/bgnet/output/html/multipage/syscalls.html#sendrecv for details */
-    bufpos = bufend = buffer;
-    send_count = 0;
+#if !defined(_WIN32)
+    struct iovec iov[2];
+    int iov_first = 0;
+    (void)buffer;
+    iov[0].iov_base = (void *)line;
+    iov[0].iov_len = line_len;
+    iov[1].iov_base = (void *)tmpl;
+    iov[1].iov_len = tmpl_len;
+    while(iov_first < 2)
+    {
+        ssize_t bytes_sent = writev(sock_fd, iov + iov_first, 2 - iov_first); /* Send request */
+        if(bytes_sent < 0)
+        {
+            fprintf(ERRFP, "Error %d with writev(): %s\n", errno, strerror(errno));
+            return EXIT_FAILURE;
+        }
+        while(iov_first < 2 && (size_t)bytes_sent >= iov[iov_first].iov_len)
+        {
+            bytes_sent -= (ssize_t)iov[iov_first].iov_len;
+            iov_first++;
+        }
+        if(iov_first < 2)
+        {
+            iov[iov_first].iov_base = (char *)iov[iov_first].iov_base + bytes_sent;
+            iov[iov_first].iov_len -= (size_t)bytes_sent;
+        }
+    }
+#else
+    size_t send_count = 0, request_len = line_len + tmpl_len;
+    memcpy(buffer, line, line_len);
+    memcpy(buffer + line_len, tmpl, tmpl_len);
     while(send_count < request_len)
     {
-        ssize_t bytes_sent = send(sock_fd, bufpos, strlen(bufpos), 0); /* Send request */
+        ssize_t bytes_sent = send(sock_fd, buffer + send_count, request_len - send_count, 0); /* Send request */
         if(bytes_sent < 0)
         {
-#if defined(_WIN32)
             char * wsa_error_str = NULL;
             FormatMessageA(FORMAT_MESSAGE_ALLOCATE_BUFFER | FORMAT_MESSAGE_FROM_SYSTEM,
                            NULL, WSAGetLastError(), 0, (LPSTR)(& wsa_error_str), 0, NULL);
             fprintf(ERRFP, "Error %d with send(): %s", WSAGetLastError(), wsa_error_str);
             LocalFree(wsa_error_str);
-#else
-            fprintf(ERRFP, "Error %d with send(): %s\n", errno, strerror(errno));
-#endif
-            conn_close(&sock_fd);
-            free(buffer);
             return EXIT_FAILURE;
         }
         send_count += bytes_sent;
-        bufpos += bytes_sent;
     }
+#endif
+    return EXIT_SUCCESS;
+}
+
+/* Content codings which are not handled by inflate */
+#define CODING_IDENTITY (-1)
+#define CODING_UNKNOWN  (-2)
 
-    bufpos = buffer;
-    buffer[0] = '\0';
-    while(!msgbegin) /* Parse header of response */
+/* Get inflate format for list of codings <list>, only one of gzip or deflate is supported */
+static int coding_format(const char * list)
+{
+    int format = CODING_IDENTITY;
+    while(* list != '\0')
+    {
+        size_t len;
+        while(* list == ' ' || * list == '\t' || * list == ',')
+            list++;
+        len = strcspn(list, " \t,;");
+        if(len == 0)
+            break;
+        if((len == 4 && strncmp(list, "gzip", 4) == 0) || (len == 6 && strncmp(list, "x-gzip", 6) == 0))
+            format = format == CODING_IDENTITY ? INFLATE_GZIP : CODING_UNKNOWN;
+        else if(len == 7 && strncmp(list, "deflate", 7) == 0)
+            format = format == CODING_IDENTITY ? INFLATE_AUTO : CODING_UNKNOWN;
+        else if(!(len == 8 && strncmp(list, "identity", 8) == 0) && !(len == 7 && strncmp(list, "chunked", 7) == 0))
+            format = CODING_UNKNOWN;
+        list += strcspn(list, ",");
+    }
+    return format;
+}
+
+/* Check if <filename> is text list which is worth compressing */
+static int is_text_list(const char * filename)
+{
+    size_t len = strlen(filename);
+    return len > 4 && (strcmp(filename + len - 4, ".lst") == 0 || strcmp(filename + len - 4, ".xml") == 0);
+}
+
+/* Write piece of body <data> of <size> bytes to <fd>, decoding it by <zs> if not NULL */
+static int body_write(int fd, inflate_state * zs, const char * data, size_t size)
+{
+    int status;
+    size_t used, out_size;
+    const unsigned char * out;
+
+    if(zs == NULL)
+    {
+        if(write_all(fd, data, size) != EXIT_SUCCESS)
+        {
+            if(more_verbose) printf("\n\n");
+            fprintf(ERRFP, "Error %d with write(): %s\n", errno, strerror(errno));
+            return EXIT_FAILURE;
+        }
+        if(body_sink)
+            body_sink(body_name, data, size);
+        return EXIT_SUCCESS;
+    }
+
+    do
+    {
+        status = inflate_run(zs, (const unsigned char *)data, size, & used, & out, & out_size);
+        data += used;
+        size -= used;
+        if(status == INFLATE_ERROR)
+        {
+            if(more_verbose) printf("\n\n");
+            fprintf(ERRFP, "Error with inflate(): %s\n", zs->msg);
+            return EXIT_FAILURE;
+        }
+        if(out_size > 0 && write_all(fd, (const char *)out, out_size) != EXIT_SUCCESS)
+        {
+            if(more_verbose) printf("\n\n");
+            fprintf(ERRFP, "Error %d with write(): %s\n", errno, strerror(errno));
+            return EXIT_FAILURE;
+        }
+        if(out_size > 0 && body_sink)
+            body_sink(body_name, (const char *)out, out_size);
+    }
+    while(status == INFLATE_OK && (size > 0 || out_size > 0));
+    return EXIT_SUCCESS;
+}
+
+/* Receive body of response parsed by <hp> from <sock_fd> and write it to <fd>, or discard it if <fd> < 0.
+ * Bytes of body already received with the head are in [<bufpos>, <bufend>) */
+static int conn_body(sockfd_t sock_fd, http_parser * hp, char * buffer, char * bufpos, char * bufend,
+                     int fd, inflate_state * zs)
+{
+    /* Every received byte is written straight from the receive buffer, the buffer is never shifted */
+    while(1)
     {
-        char * tmp;
-        char field_name[255];
-        char field_content[STRBUFSIZE];
-        size_t old_buf = (size_t)bufend - (size_t)buffer;
         ssize_t recv_count;
 
-        bufpos = bufend;
-        recv_count = recv(sock_fd, bufpos, NETBUFSIZE - old_buf, 0);
-        bufend = bufpos + recv_count;
-        * bufend = '\0';
+        while(bufpos < bufend && !HTTP_BODY_DONE(hp)) /* Write content */
+        {
+            const char * data;
+            size_t data_size;
+            bufpos += http_parse_body(hp, bufpos, (size_t)(bufend - bufpos), & data, & data_size);
+            if(HTTP_FAILED(hp))
+            {
+                if(more_verbose) printf("\n\n");
+                fprintf(ERRFP, "Error with recv(): Can't parse response body\n");
+                return EXIT_FAILURE;
+            }
+            if(data_size > 0 && fd >= 0)
+            {
+                if(body_write(fd, zs, data, data_size) != EXIT_SUCCESS)
+                    return EXIT_FAILURE;
+                if(more_verbose)
+                {
+                    printf("W");
+                    fflush(stdout);
+                }
+            }
+        }
+        if(HTTP_BODY_DONE(hp))
+        {
+            if(fd >= 0 && zs != NULL && !inflate_finished(zs))
+            {
+                if(more_verbose) printf("\n\n");
+                fprintf(ERRFP, "Error with inflate(): Unexpected end of compressed data\n");
+                return EXIT_FAILURE;
+            }
+            return EXIT_SUCCESS;
+        }
+
+#if defined(__linux__)
+        /* Rest of identity body can go from socket to file without passing through user space, unless it is also parsed */
+        if(fd >= 0 && zs == NULL && !hp->is_chunked && hp->has_length && !body_sink)
+        {
+            int splice_status = conn_splice(sock_fd, fd, hp->remain);
+            if(splice_status == EXIT_SUCCESS)
+            {
+                http_skip_body(hp, hp->remain);
+                return EXIT_SUCCESS;
+            }
+            if(splice_status == EXIT_FAILURE)
+                return EXIT_FAILURE;
+        }
+#endif
+
+        recv_count = recv(sock_fd, buffer, NETBUFSIZE, 0);
+        if(recv_count == 0 && http_parse_eof(hp) == EXIT_SUCCESS) /* Body delimited by connection close */
+            continue;
         if(recv_count <= 0)
         {
 #if defined(_WIN32)
@@ -444,263 +916,356 @@ redirect: /* Goto here if 30x received */
             fprintf(ERRFP, "Error %d with recv(): %s", WSAGetLastError(), wsa_error_str);
             LocalFree(wsa_error_str);
 #else
-            fprintf(ERRFP, "Error %d with recv(): %s\n", errno, strerror(errno));
+            fprintf(ERRFP, "Error %d with recv(): %s\n", errno, recv_count == 0 ? "Connection closed" : strerror(errno));
 #endif
-            conn_close(&sock_fd);
-            free(buffer);
             return EXIT_FAILURE;
         }
+        if(more_verbose)
+        {
+            printf("R");
+            fflush(stdout);
+        }
+        if(guard_check((size_t)recv_count) != EXIT_SUCCESS)
+            return EXIT_FAILURE;
+        bufpos = buffer;
+        bufend = buffer + recv_count;
+    }
+}
+
+/* Finish response parsed by <hp> without saving its body, keep connection <sock_fd> alive if possible */
+static void conn_skip(sockfd_t * sock_fd, http_parser * hp, char * buffer, char * bufpos, char * bufend)
+{
+    /* Small bodies (error pages) are read out, otherwise it is cheaper to reconnect */
+    if(!socket_good(&sock_fd_ka) || (!hp->is_chunked && !hp->has_length) ||
+       (hp->has_length && hp->length > NETBUFSIZE) ||
+       conn_body(* sock_fd, hp, buffer, bufpos, bufend, -1, NULL) != EXIT_SUCCESS)
+        conn_close(sock_fd);
+}
+
+/* Send request of <filename> from <server>:<port> with Connection: <conn_ka> to <sock_fd>,
+ * starting from byte <offset>, <buffer> is scratch space */
+static int conn_request(sockfd_t sock_fd, const char * server, uint16_t port, const char * filename,
+                        const char * conn_ka, unsigned long offset, char * buffer)
+{
+    char request_line[STRBUFSIZE + 360];
+
+    if(use_proxy == 1)
+        sprintf(request_line, "GET http://%s:%u/%s HTTP/%s\r\n",
+                server, (unsigned)port, filename, http_version);
+    else
+        sprintf(request_line, "GET /%s HTTP/%s\r\n", filename, http_version);
+    /* Only text lists are worth compressing, so Accept-Encoding is not a part of template */
+    sprintf(request_line + strlen(request_line), "Accept-Encoding: %s\r\n",
+            (use_compress && is_text_list(filename) && offset == 0) ? "gzip, deflate" : "identity");
+    if(offset > 0)
+        sprintf(request_line + strlen(request_line), "Range: bytes=%lu-\r\n", offset);
+    request_fill(server, port, conn_ka);
+
+    if(more_verbose)
+    {
+        size_t i;
+        printf("\n");
+        for(i = 0; request_line[i] != '\0'; i++)
+            if(request_line[i] != '\r')
+                printf("%c", request_line[i]);
+        for(i = 0; i < req_tmpl.len; i++)
+            if(req_tmpl.text[i] != '\r')
+                printf("%c", req_tmpl.text[i]);
+    }
+
+    return conn_send(sock_fd, request_line, strlen(request_line), req_tmpl.text, req_tmpl.len, buffer);
+}
+
+/* Receive head of response from <sock_fd> into <hp>, it may be split across any number of recv() calls.
+ * Part of <buffer> after the head is returned in <bufpos> and <bufend> */
+static int conn_head(sockfd_t sock_fd, http_parser * hp, char * buffer, char ** bufpos, char ** bufend)
+{
+    http_init(hp);
+    * bufpos = * bufend = buffer;
+    while(!HTTP_HEAD_DONE(hp))
+    {
+        ssize_t recv_count = recv(sock_fd, buffer, NETBUFSIZE, 0);
+        if(recv_count <= 0)
+        {
+#if defined(_WIN32)
+            char * wsa_error_str = NULL;
+            FormatMessageA(FORMAT_MESSAGE_ALLOCATE_BUFFER | FORMAT_MESSAGE_FROM_SYSTEM,
+                           NULL, WSAGetLastError(), 0, (LPSTR)(& wsa_error_str), 0, NULL);
+            fprintf(ERRFP, "Error %d with recv(): %s", WSAGetLastError(), wsa_error_str);
+            LocalFree(wsa_error_str);
+#else
+            fprintf(ERRFP, "Error %d with recv(): %s\n", errno, recv_count == 0 ? "Connection closed" : strerror(errno));
+#endif
+            return EXIT_FAILURE;
+        }
+        * bufend = buffer + recv_count;
+        * bufpos = buffer + http_parse_head(hp, buffer, (size_t)recv_count);
 
         if(more_verbose)
         {
             char * smth;
-            for(smth = bufpos; smth < bufend; smth++)
+            for(smth = buffer; smth < * bufpos; smth++)
                 if(* smth != '\r')
                     printf("%c", * smth);
-                else if(smth + 2 < bufend && * (smth + 2) == '\r')
-                {
-                    printf("\n\n");
-                    break;
-                }
         }
 
-        if(status < 0)
+        if(HTTP_FAILED(hp))
         {
-            bufpos = strchr(buffer, ' ');
-            if(bufpos != NULL)
-            {
-                bufpos++;
-                sscanf(bufpos, "%d", & status);
-                bufpos = strchr(bufpos, '\n');
-                if(bufpos != NULL)
-                    bufpos++;
-                else
-                    status = EXIT_FAILURE;
-            }
-            else
-                status = EXIT_FAILURE;
-            if(status == EXIT_FAILURE)
-            {
-                fprintf(ERRFP, "Error with recv(): Can't parse response\n");
-                if(!socket_good(&sock_fd_ka))
-                    conn_close(&sock_fd);
-                free(buffer);
-                return status;
-            }
+            fprintf(ERRFP, "Error with recv(): Can't parse response\n");
+            return EXIT_FAILURE;
+        }
+    }
+    return EXIT_SUCCESS;
+}
 
-            /* Redirect */
-            /* Warning: 300 work only if server set Location field */
-            if(((status >= 300 && status <= 303) || status == 307) && redirect_num < MAX_REDIRECT)
-            {
-                redirect_num++;
-                while((tmp = strchr(bufpos, '\r')) != NULL && tmp - 2 != strstr(bufpos - 2, "\r\n\r\n"))
-                {
-                    sscanf(bufpos, "%[^:]", field_name);
-                    bufpos += strlen(field_name) + 2;
-                    sscanf(bufpos, "%[^\r]", field_content);
-                    bufpos += strlen(field_content) + 2;
-                    if(strcmp(field_name, "Location") == 0) /* Parse new location */
-                    {
-                        char * servername_beg, * serverport_beg, * filename_beg;
-                        servername_beg = strstr(field_content, "://");
-                        if(servername_beg)
-                        {
-                            servername_beg += 3;
-                            serverport_beg = strchr(servername_beg, ':');
-                            filename_beg = strchr(servername_beg, '/');
-
-                            if(* (filename_beg + 1) != '\0')
-                                bsd_strlcpy(filename_dl, filename_beg + 1, sizeof(filename_dl));
-                            else
-                                strcpy(filename_dl, "/");
-                            * filename_beg = '\0';
-                            if(serverport_beg && serverport_beg < filename_beg) /* Non-default port */
-                            {
-                                serverport_dl = atoi(serverport_beg + 1);
-                                * serverport_beg = '\0';
-                            }
-                            else
-                                serverport_dl = 80;
-                            bsd_strlcpy(servername_dl, servername_beg, sizeof(servername_dl));
-                        }
-                    }
-                }
-                if(verbose)
-                    printf("Redirected (%d) to http://%s:%u/%s\n", status, servername_dl, (unsigned)serverport_dl, filename_dl);
+/* Get file <filename> from server <server>:<port> */
+static int conn_get(const char * filename, const char * server, uint16_t port)
+{
+    sockfd_t sock_fd;
 
-                if(strcmp(servername, servername_dl) != 0 || serverport != serverport_dl)
-                    conn_close(&sock_fd);
+    char * buffer, * bufpos, * bufend;
+    http_parser hp;
+    int status;
+    size_t redirect_num = 0;
+    int format;
+    inflate_state * zs = NULL;
 
-                goto redirect;
-            }
+    int fd;
+    char filename_dl[STRBUFSIZE];
+    char servername_dl[256];
+    uint16_t serverport_dl = port;
+    char conn_ka[11];
+    const char * conn_server;
+    uint16_t conn_port;
+    redirect_rule * rule;
+    int8_t redirect_permanent = 1;
+    unsigned long offset = 0;
 
-            /*
-            Message in DrWebUpW:
-            Your license key file has not been found in the database! Please contact technical support: http://support.drweb.com.
-            */
-            if(status == 451)
-                fprintf(ERRFP, "Error: License key file has not been found in the database.\n");
-
-            /*
-            Message in DrWebUpW:
-            License key file is blocked!
-            */
-            if(status == 452)
-                fprintf(ERRFP, "Error: License key file is blocked or incorrect UserID/MD5.\n");
-
-            /*
-            Message in DrWebUpW:
-            You are using an unregistered version of Dr.Web. To receive updates, please register.
-            */
-            if(status == 600)
-                fprintf(ERRFP, "Error: License key file is key from an unregistered version.\n");
-        }
+    buffer = (char *)malloc((NETBUFSIZE + 4) * sizeof(char));
 
-        while((tmp = strchr(bufpos, '\r')) != NULL && tmp - 2 != strstr(bufpos - 2, "\r\n\r\n"))
-        {
-            sscanf(bufpos, "%[^:]", field_name);
-            bufpos += strlen(field_name) + 2;
-            sscanf(bufpos, "%[^\r]", field_content);
-            bufpos += strlen(field_content) + 2;
+    bsd_strlcpy(filename_dl, filename, sizeof(filename_dl));
+    bsd_strlcpy(servername_dl, server, sizeof(servername_dl));
+    bsd_strlcpy(conn_ka, "Keep-Alive", sizeof(conn_ka));
 
-            if(strcmp(field_name, "Connection") == 0)
-            {
-                to_lowercase(field_content);
-                if(strcmp(field_content, "keep-alive") == 0 && strcmp(servername, servername_dl) == 0)
-                    sock_fd_ka = sock_fd; /* Server supports keep-alive */
-                else
-                    sock_fd_ka = SOCKET_BAD_VALUE;
-            }
-            else if(strcmp(field_name, "Content-Length") == 0)
-            {
-                sscanf(field_content, "%lu", & msgsize);
-            }
-            else if(strcmp(field_name, "Last-Modified") == 0)
-            {
-                /* https://tools.ietf.org/html/rfc2616#section-3.3.1 */
-
-                struct tm raw_time;
-                char month[4];
-                const int valid_sscanf_count = 6;
-                int current_sscanf_count = 0;
-
-                memset(&raw_time, 0, sizeof(struct tm));
-                raw_time.tm_wday = -1;
-                raw_time.tm_yday = -1;
-                raw_time.tm_isdst = -1;
-
-                /* Sun, 06 Nov 1994 08:49:37 GMT  ; RFC 822, updated by RFC 1123 */
-                if(current_sscanf_count != valid_sscanf_count)
-                    current_sscanf_count = sscanf(field_content, "%*[^,], %d %[^ ] %d %d:%d:%d",
-                                                  & raw_time.tm_mday, month, & raw_time.tm_year,
-                                                  & raw_time.tm_hour, & raw_time.tm_min, & raw_time.tm_sec);
-
-                /* Sunday, 06-Nov-94 08:49:37 GMT ; RFC 850, obsoleted by RFC 1036 */
-                if(current_sscanf_count != valid_sscanf_count)
-                    current_sscanf_count = sscanf(field_content, "%*[^,], %d-%[^-]-%d %d:%d:%d",
-                                                  & raw_time.tm_mday, month, & raw_time.tm_year,
-                                                  & raw_time.tm_hour, & raw_time.tm_min, & raw_time.tm_sec);
-
-                /* Sun Nov  6 08:49:37 1994       ; ANSI C's asctime() format */
-                if(current_sscanf_count != valid_sscanf_count)
-                    current_sscanf_count = sscanf(field_content, "%*[^ ] %[^ ] %d %d:%d:%d %d",
-                                                  month, & raw_time.tm_mday, & raw_time.tm_hour,
-                                                  & raw_time.tm_min, & raw_time.tm_sec, & raw_time.tm_year);
-
-                if(current_sscanf_count == valid_sscanf_count)
-                {
-                    month[3] = '\0';
-                    to_lowercase(month);
-                    if     (strcmp(month, "jan") == 0) raw_time.tm_mon = 0;
-                    else if(strcmp(month, "feb") == 0) raw_time.tm_mon = 1;
-                    else if(strcmp(month, "mar") == 0) raw_time.tm_mon = 2;
-                    else if(strcmp(month, "apr") == 0) raw_time.tm_mon = 3;
-                    else if(strcmp(month, "may") == 0) raw_time.tm_mon = 4;
-                    else if(strcmp(month, "jun") == 0) raw_time.tm_mon = 5;
-                    else if(strcmp(month, "jul") == 0) raw_time.tm_mon = 6;
-                    else if(strcmp(month, "aug") == 0) raw_time.tm_mon = 7;
-                    else if(strcmp(month, "sep") == 0) raw_time.tm_mon = 8;
-                    else if(strcmp(month, "oct") == 0) raw_time.tm_mon = 9;
-                    else if(strcmp(month, "nov") == 0) raw_time.tm_mon = 10;
-                    else if(strcmp(month, "dec") == 0) raw_time.tm_mon = 11;
-                    else assert(0);
-                    if(raw_time.tm_year >= 1900) raw_time.tm_year -= 1900;
-
-                    lastmod = mktime(& raw_time);
-                    if(lastmod > 0)
-                        lastmod += tzshift;
-                }
-                else
-                {
-                    lastmod = 0;
-                    fprintf(ERRFP, "Warning: Can't parse Last-Modified: %s\n", field_content);
-                }
-            }
-            else if(strcmp(field_name, "Transfer-Encoding") == 0)
-            {
-                to_lowercase(field_content);
-                if(strcmp(field_content, "chunked") == 0)
-                {
-                    is_chunked = 1;
-                }
-                else if(strcmp(field_content, "identity") == 0)
-                {
-                    is_chunked = 0;
-                }
-                /* TODO: Transfer-Encoding: compress/deflate/gzip/mixed is not supported */
-                else
-                {
-                    fprintf(ERRFP, "Error: Unsupported HTTP 1.1 header \"%s: %s\".\n", field_name, field_content);
-                    fprintf(ERRFP, "Please consider using the --http-version=1.0 option if problem persists.\n");
-                    conn_close(&sock_fd);
-                    sock_fd_ka = SOCKET_BAD_VALUE;
-                    free(buffer);
-                    return EXIT_FAILURE;
-                }
-            }
+    printf("Downloading %s\n", filename);
+
+    /* Continue transfer that was aborted before */
+    if(resume.size > 0 && strcmp(resume.name, filename) == 0)
+    {
+        offset = resume.size;
+        if(verbose)
+            printf("Resuming from byte %lu of %lu\n", resume.size, resume.length);
+    }
+    else
+        resume.size = 0;
+
+    /* Go straight to the place where this directory was redirected before */
+    rule = redirect_find(server, port, filename);
+    if(rule)
+    {
+        bsd_strlcpy(servername_dl, rule->to_server, sizeof(servername_dl));
+        serverport_dl = rule->to_port;
+        bsd_strlcpy(filename_dl, rule->to_prefix, sizeof(filename_dl));
+        bsd_strlcpy(filename_dl + strlen(filename_dl), filename + strlen(rule->from_prefix),
+                    sizeof(filename_dl) - strlen(filename_dl));
+        redirect_permanent = rule->expires == 0;
+        if(verbose)
+            printf("Redirected (cached) to http://%s:%u/%s\n", servername_dl, (unsigned)serverport_dl, filename_dl);
+    }
+
+redirect: /* Goto here if 30x received */
+    conn_server = use_proxy == 1 ? proxy_address : servername_dl;
+    conn_port = use_proxy == 1 ? proxy_port : serverport_dl;
+    if(socket_good(&sock_fd_ka) && strcmp(server_ka, conn_server) == 0 && port_ka == conn_port)
+    {
+        sock_fd = sock_fd_ka;
+    }
+    else
+    {
+        if(socket_good(&sock_fd_ka)) /* Connected to other host */
+            conn_close(&sock_fd_ka);
+        if(conn_open(&sock_fd, conn_server, conn_port) != EXIT_SUCCESS) /* Open connection */
+        {
+            if(rule) rule->from_server[0] = '\0';
+            free(buffer);
+            return EXIT_FAILURE;
         }
+    }
+
+    if(conn_request(sock_fd, servername_dl, serverport_dl, filename_dl, conn_ka, offset, buffer) != EXIT_SUCCESS)
+    {
+        conn_close(&sock_fd);
+        free(buffer);
+        return EXIT_FAILURE;
+    }
+
+    if(conn_head(sock_fd, & hp, buffer, & bufpos, & bufend) != EXIT_SUCCESS)
+    {
+        conn_close(&sock_fd);
+        free(buffer);
+        return EXIT_FAILURE;
+    }
+    status = hp.status;
+
+    if(hp.keep_alive == 1) /* Server supports keep-alive */
+    {
+        sock_fd_ka = sock_fd;
+        bsd_strlcpy(server_ka, conn_server, sizeof(server_ka));
+        port_ka = conn_port;
+    }
+    else if(hp.keep_alive == 0)
+    {
+        sock_fd_ka = SOCKET_BAD_VALUE;
+    }
+
+    if(coding_format(hp.transfer_encoding) == CODING_UNKNOWN)
+    {
+        /* Transfer-Encoding: compress (LZW) is intentionally not supported */
+        fprintf(ERRFP, "Error: Unsupported HTTP 1.1 header \"Transfer-Encoding: %s\".\n", hp.transfer_encoding);
+        fprintf(ERRFP, "Please consider using the --http-version=1.0 option if problem persists.\n");
+        conn_close(&sock_fd);
+        free(buffer);
+        return EXIT_FAILURE;
+    }
 
-        if(tmp != NULL && tmp - 2 == strstr(bufpos - 2, "\r\n\r\n"))
+    /* Redirect */
+    /* Warning: 300 work only if server set Location field */
+    if(((status >= 300 && status <= 303) || status == 307 || status == 308) &&
+       redirect_num < MAX_REDIRECT && hp.location[0] != '\0')
+    {
+        char * servername_beg, * serverport_beg, * filename_beg;
+        redirect_num++;
+        if(status != 301 && status != 308)
+            redirect_permanent = 0;
+        servername_beg = strstr(hp.location, "://");
+        if(servername_beg)
         {
-            msgbegin = 1;
-            if((ssize_t)(bufend - buffer) - (ssize_t)(tmp + 2 - buffer) > 0)
-                bufpos = tmp + 2;
+            servername_beg += 3;
+            serverport_beg = strchr(servername_beg, ':');
+            filename_beg = strchr(servername_beg, '/');
+            if(filename_beg == NULL)
+                filename_beg = servername_beg + strlen(servername_beg);
+
+            if(* filename_beg != '\0' && * (filename_beg + 1) != '\0')
+                bsd_strlcpy(filename_dl, filename_beg + 1, sizeof(filename_dl));
             else
+                strcpy(filename_dl, "/");
+            * filename_beg = '\0';
+            if(serverport_beg && serverport_beg < filename_beg) /* Non-default port */
             {
-                bufpos = buffer;
-                bufend = buffer;
+                serverport_dl = atoi(serverport_beg + 1);
+                * serverport_beg = '\0';
             }
+            else
+                serverport_dl = 80;
+            bsd_strlcpy(servername_dl, servername_beg, sizeof(servername_dl));
         }
+        if(verbose)
+            printf("Redirected (%d) to http://%s:%u/%s\n", status, servername_dl, (unsigned)serverport_dl, filename_dl);
+
+        if(use_proxy == 1 || (strcmp(conn_server, servername_dl) == 0 && conn_port == serverport_dl))
+            conn_skip(&sock_fd, & hp, buffer, bufpos, bufend);
         else
-        {
-            memmove(buffer, bufpos, (size_t)(bufend - bufpos));
-            bufend -= (bufpos - buffer);
-            bufpos = buffer;
-            * bufend = '\0';
-        }
+            conn_close(&sock_fd);
+
+        goto redirect;
+    }
+
+    /*
+    Message in DrWebUpW:
+    Your license key file has not been found in the database! Please contact technical support: http://support.drweb.com.
+    */
+    if(status == 451)
+        fprintf(ERRFP, "Error: License key file has not been found in the database.\n");
+
+    /*
+    Message in DrWebUpW:
+    License key file is blocked!
+    */
+    if(status == 452)
+        fprintf(ERRFP, "Error: License key file is blocked or incorrect UserID/MD5.\n");
+
+    /*
+    Message in DrWebUpW:
+    You are using an unregistered version of Dr.Web. To receive updates, please register.
+    */
+    if(status == 600)
+        fprintf(ERRFP, "Error: License key file is key from an unregistered version.\n");
+
+    /* Partial content is accepted only if it continues the same file */
+    if(status == 206 && (offset == 0 || hp.range_begin != offset || hp.range_total != resume.length ||
+                         (hp.last_modified != 0 && resume.mtime != 0 && hp.last_modified != resume.mtime)))
+    {
+        fprintf(ERRFP, "Warning: File %s has changed, downloading it again\n", filename);
+        resume.size = 0;
+        conn_close(&sock_fd);
+        free(buffer);
+        return EXIT_FAILURE;
+    }
+    if(status == 416 && offset > 0)
+    {
+        resume.size = 0;
+        conn_skip(&sock_fd, & hp, buffer, bufpos, bufend);
+        free(buffer);
+        return EXIT_FAILURE;
     }
 
     /* Something wrong */
-    if(status != 200 && status != 203)
+    if(status != 200 && status != 203 && status != 206)
     {
-        if(!socket_good(&sock_fd_ka))
-            conn_close(&sock_fd);
+        if(rule && status >= 500) rule->from_server[0] = '\0'; /* Next attempt asks original server again */
+        conn_skip(&sock_fd, & hp, buffer, bufpos, bufend);
         free(buffer);
         return status;
     }
 
+    /* Compressed body is decoded inline, so checksums are calculated on original data */
+    format = coding_format(hp.transfer_encoding);
+    if(format == CODING_IDENTITY)
+        format = coding_format(hp.content_encoding);
+    else if(coding_format(hp.content_encoding) != CODING_IDENTITY)
+        format = CODING_UNKNOWN;
+    if(format == CODING_UNKNOWN)
+    {
+        fprintf(ERRFP, "Error: Unsupported HTTP header \"Content-Encoding: %s\".\n", hp.content_encoding);
+        conn_close(&sock_fd);
+        free(buffer);
+        return EXIT_FAILURE;
+    }
+    if(format != CODING_IDENTITY)
+    {
+        inflate_init(& body_inflate, format);
+        zs = & body_inflate;
+    }
+
     if(more_verbose)
     {
         printf("[");
         fflush(stdout);
     }
-    fp = fopen(filename, "wb"); /* Open result file */
-    if(!fp)
+    file_changed(filename);
+    if(status == 206) /* Append to part received before */
+    {
+        fd = open(filename, O_WRONLY | O_BINARY, MODE_FILE);
+        if(fd >= 0 && lseek(fd, (off_t)offset, SEEK_SET) != (off_t)offset)
+        {
+            close(fd);
+            fd = -1;
+        }
+    }
+    else
+    {
+        offset = 0;
+        remove(filename); /* New file, hard links of old one are left untouched */
+        fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC | O_BINARY, MODE_FILE); /* Open result file */
+        if(body_sink)
+            body_sink(filename, NULL, 0);
+    }
+    if(fd < 0)
     {
         if(more_verbose) printf("\n\n");
-        fprintf(ERRFP, "Error with fopen() on %s\n", filename);
-        if(!socket_good(&sock_fd_ka))
-            conn_close(&sock_fd);
+        fprintf(ERRFP, "Error %d with open() on %s: %s\n", errno, filename, strerror(errno));
+        conn_close(&sock_fd);
         free(buffer);
         return EXIT_FAILURE;
     }
@@ -710,155 +1275,158 @@ redirect: /* Goto here if 30x received */
         fflush(stdout);
     }
 
-    if(is_chunked)
-        msgsize = 0;
-    msgcurr = 0;
-
-    while(1)
+    guard_start(hp.has_length ? hp.length : (body_expected > 0 ? (unsigned long)body_expected : 0),
+                mirror_last ? mirror_last->speed : 0.0);
+    body_name = filename;
+    status = conn_body(sock_fd, & hp, buffer, bufpos, bufend, fd, zs);
+    guard.active = 0;
+    /* Unread part of message makes connection useless, as well as body delimited by close */
+    if(status != EXIT_SUCCESS || !socket_good(&sock_fd_ka) || (!hp.is_chunked && !hp.has_length))
+        conn_close(&sock_fd); /* Close connection */
+    close(fd);
+    free(buffer);
+    if(more_verbose)
     {
-        unsigned long chunk_size = 0, chunk_curr = 0;
-        if(is_chunked)
-        {
-            while(bufpos < bufend && (* bufpos == '\r' || * bufpos == '\n'))
-                bufpos++;
-
-            if(bufpos != bufend)
-            {
-                char * tmp = strchr(bufpos, '\r');
-                if(tmp)
-                {
-                    sscanf(bufpos, "%lx", & chunk_size);
-                    bufpos = tmp + 2;
-                    if(chunk_size == 0)
-                        break;
-                }
-            }
-        }
-        else
+        printf("]\n\n");
+        fflush(stdout);
+    }
+    if(status != EXIT_SUCCESS)
+    {
+        if(rule) rule->from_server[0] = '\0';
+        /* Identity body of known length can be continued by next attempt, maybe from other server */
+        if(zs == NULL && (hp.status == 206 || hp.has_length) && get_size(filename) > (off_t)offset)
         {
-            if(msgcurr != 0)
-                break;
-            chunk_size = msgsize;
+            bsd_strlcpy(resume.name, filename, sizeof(resume.name));
+            resume.size = (unsigned long)get_size(filename);
+            resume.length = hp.status == 206 ? hp.range_total : hp.length;
+            resume.mtime = hp.last_modified;
         }
+        return status;
+    }
+    resume.size = 0;
 
-        if(bufpos != bufend) /* Write content */
-        {
-            chunk_curr = (unsigned long)(bufend - bufpos);
-            if((is_chunked == 1 || chunk_size > 0) && chunk_curr > chunk_size)
-                chunk_curr = chunk_size;
-            if(chunk_curr > 0)
-            {
-                msgcurr += chunk_curr;
-                if(fwrite(bufpos, sizeof(char), chunk_curr, fp) != (size_t)chunk_curr)
-                {
-                    if(more_verbose) printf("\n\n");
-                    fprintf(ERRFP, "Warning: Not all bytes was written\n");
-                }
-                if(more_verbose)
-                {
-                    printf("W");
-                    fflush(stdout);
-                }
-                bufpos += chunk_curr;
-                if(is_chunked && bufpos != bufend)
-                    continue;
-            }
-        }
+    if(redirect_num > 0)
+        redirect_store(server, port, filename, servername_dl, serverport_dl, filename_dl, redirect_permanent);
 
-        while(chunk_size == 0 || chunk_curr < chunk_size)
-        {
-            ssize_t recv_count;
-            size_t write_count;
+    if(hp.last_modified && set_mtime(filename, hp.last_modified) != EXIT_SUCCESS) /* Set last modification time */
+        return EXIT_FAILURE;
+    chmod(filename, MODE_FILE); /* Change access permissions */
 
-            if(bufpos != bufend)
-            {
-                memmove(buffer, bufpos, (size_t)(bufend - bufpos));
-                bufend -= (bufpos - buffer);
-                bufpos = buffer;
-            }
-            else
-            {
-                bufend = bufpos = buffer;
-            }
+    return EXIT_SUCCESS;
+}
 
-            assert(is_chunked != 0 || chunk_curr == msgcurr);
+/* Request file <filename> from server <server>:<port> over fresh connection, discard it and measure timings <t> */
+int conn_probe(const char * filename, const char * server, uint16_t port, conn_timing * t)
+{
+    sockfd_t sock_fd;
+    char * buffer, * bufpos, * bufend;
+    http_parser hp;
+    double time_begin;
+    int result = EXIT_FAILURE;
 
-            recv_count = recv(sock_fd, bufend, (NETBUFSIZE - (size_t)(bufend - bufpos)), 0);
-            if(is_chunked == 0 && recv_count == 0 && chunk_size == 0)
-            {
-                break;
-            }
-            if(recv_count <= 0)
-            {
-#if defined(_WIN32)
-                char * wsa_error_str = NULL;
-                FormatMessageA(FORMAT_MESSAGE_ALLOCATE_BUFFER | FORMAT_MESSAGE_FROM_SYSTEM,
-                               NULL, WSAGetLastError(), 0, (LPSTR)(& wsa_error_str), 0, NULL);
-                fprintf(ERRFP, "Error %d with recv(): %s", WSAGetLastError(), wsa_error_str);
-                LocalFree(wsa_error_str);
-#else
-                fprintf(ERRFP, "Error %d with recv(): %s\n", errno, strerror(errno));
-#endif
-                conn_close(&sock_fd);
-                free(buffer);
-                return EXIT_FAILURE;
-            }
-            if(more_verbose)
-            {
-                printf("R");
-                fflush(stdout);
-            }
+    memset(t, 0, sizeof(conn_timing));
+    if(conn_open(&sock_fd, use_proxy == 1 ? proxy_address : server, use_proxy == 1 ? proxy_port : port) != EXIT_SUCCESS)
+        return EXIT_FAILURE;
+    t->dns = conn_dns_time;
+    t->connect = conn_connect_time;
 
-            bufend += recv_count;
-            * bufend = '\0';
+    buffer = (char *)malloc((NETBUFSIZE + 4) * sizeof(char));
+    time_begin = get_seconds();
+    if(conn_request(sock_fd, server, port, filename, "close", 0, buffer) == EXIT_SUCCESS &&
+       conn_head(sock_fd, & hp, buffer, & bufpos, & bufend) == EXIT_SUCCESS)
+    {
+        t->ttfb = get_seconds() - time_begin;
+        t->status = hp.status;
+        time_begin = get_seconds();
+        result = conn_body(sock_fd, & hp, buffer, bufpos, bufend, -1, NULL);
+        t->transfer = get_seconds() - time_begin;
+        t->size = hp.received;
+    }
 
-            if(is_chunked && chunk_size == 0)
-                break;
+    conn_close(&sock_fd);
+    free(buffer);
+    return result;
+}
 
-            write_count = (size_t)(chunk_size - chunk_curr);
-            if(write_count >= (size_t)recv_count)
-                write_count = (size_t)recv_count;
+/* Check if optional file <filename> was not found on server recently */
+int missing_known(const char * filename)
+{
+    missing_entry * entry;
+    missing_load();
+    entry = missing_find(filename);
+    if(!entry || entry->expires <= time(NULL))
+        return 0;
+    if(verbose)
+        printf("Skipping %s, it was not found on server before\n", filename);
+    return 1;
+}
 
-            if(fwrite(bufpos, sizeof(char), write_count, fp) != write_count)
-            {
-                if(more_verbose) printf("\n\n");
-                fprintf(ERRFP, "Warning: Not all bytes was written\n");
-            }
-            if(more_verbose)
-            {
-                printf("W");
-                fflush(stdout);
-            }
-            bufpos += write_count;
-            chunk_curr += (unsigned long)write_count;
-            msgcurr += (unsigned long)write_count;
-        }
+/* Account result <status> of download() of optional file <filename> in negative cache */
+void missing_report(const char * filename, int status)
+{
+    missing_entry * entry;
+    missing_load();
+    entry = missing_find(filename);
+    if(status == DL_NOT_FOUND)
+    {
+        /* Time before next request is doubled after every miss */
+        time_t ttl = MISSING_TTL;
+        if(!entry)
+            entry = missing_add(filename, 0, 0);
+        if(!entry)
+            return;
+        if(entry->misses < 16)
+            entry->misses++;
+        ttl <<= entry->misses - 1;
+        if(ttl > MISSING_TTL_MAX)
+            ttl = MISSING_TTL_MAX;
+        entry->expires = time(NULL) + ttl;
+        missing_dirty = 1;
     }
-
-    if(!socket_good(&sock_fd_ka))
-        conn_close(&sock_fd); /* Close connection */
-    fclose(fp);
-    free(buffer);
-    if(more_verbose)
+    else if(entry && (status == DL_EXIST || status == DL_DOWNLOADED))
     {
-        printf("]\n\n");
-        fflush(stdout);
+        free(entry->name);
+        * entry = missing[--missing_count];
+        missing_dirty = 1;
     }
+}
 
-    if(lastmod && set_mtime(filename, lastmod) != EXIT_SUCCESS) /* Set last modification time */
-        return EXIT_FAILURE;
-    chmod(filename, MODE_FILE); /* Change access permissions */
+/* Download optional file <filename>, it is not requested again for a while if not found */
+int download_optional(const char * filename)
+{
+    int status;
+    if(missing_known(filename))
+        return DL_NOT_FOUND;
+    status = download(filename);
+    missing_report(filename, status);
+    return status;
+}
 
-    return EXIT_SUCCESS;
+/* Pass content of following downloads also to <sink> while it is written, NULL to stop */
+void download_sink(content_sink sink)
+{
+    body_sink = sink;
+}
+
+/* Expect <size> bytes in following downloads if server doesn't tell it, -1 to stop */
+void download_expect(off_t size)
+{
+    body_expected = size;
 }
 
 /* Download file <filename> */
 int download(const char * filename)
 {
     int counter = 0, status;
+    mirror_server * m = mirror_select(NULL);
+    prune_keep(filename);
     do
     {
-        status = conn_get(filename);
+        double time_begin;
+        mirror_pace(m);
+        time_begin = get_seconds();
+        mirror_last = m;
+        status = conn_get(filename, m->name, m->port);
         switch(status)
         {
         /* Correctable error */
@@ -869,11 +1437,21 @@ int download(const char * filename)
         case 502:
         case 503:
         case 504:
-            sleep(REPEAT_SLEEP);
+            mirror_report(m, 0, 0.0, 0.0);
+            mirror_backoff(m); /* Retry of the same server waits for its lowered rate */
+            m = mirror_select(m);
             counter++;
             break;
-        /* No error or fatal error */
+        /* No error */
+        case EXIT_SUCCESS:
+            mirror_report(m, 1, (double)get_size(filename), get_seconds() - time_begin);
+            break;
+        /* Not found, says nothing about health of server */
+        case 404:
+            break;
+        /* Fatal error, server is refusing the request */
         default:
+            mirror_report(m, 0, 0.0, 0.0);
             counter += MAX_REPEAT;
             break;
         }
@@ -1023,6 +1601,15 @@ int download_check(const char * filename, const char * checksum_base, char * che
 {
     int status;
 
+    prune_keep(filename);
+    if(journal_check(filename, checksum_base)) /* Verified by interrupted run */
+    {
+        strcpy(checksum_real, checksum_base);
+        if(verbose)
+            printf("%s exist, verified before %s [OK]\n", filename, checksum_desc);
+        return DL_EXIST;
+    }
+
     if(use_fast && tree && exist(filename)) /* Using fast check */
     {
         const char * checksum_tree = avl_hash(tree, filename);
@@ -1057,10 +1644,45 @@ int download_check(const char * filename, const char * checksum_base, char * che
         {
             if(verbose)
                 printf("[OK]\n");
+            if(checksum_func == & sha256sum)
+                store_add(filename, checksum_real);
+            journal_add(filename, checksum_real);
             return DL_EXIST;
         }
     }
 
+    if(checksum_func == & sha256sum && store_fetch(filename, checksum_base) == EXIT_SUCCESS) /* Same file of other remote */
+    {
+        if(verbose)
+            printf("%s taken from object store, checking %s ", filename, checksum_desc);
+        if(checksum_func(filename, checksum_real) == EXIT_SUCCESS && strcmp(checksum_base, checksum_real) == 0)
+        {
+            if(verbose)
+                printf("[OK]\n");
+            journal_add(filename, checksum_real);
+            return DL_DOWNLOADED;
+        }
+        if(verbose)
+            printf("[NOT OK]\n");
+        store_drop(checksum_base);
+    }
+
+    if(checksum_func == & sha256sum && seed_fetch(filename, checksum_base) == EXIT_SUCCESS) /* Same file of other local remote */
+    {
+        if(verbose)
+            printf("%s copied from other remote, checking %s ", filename, checksum_desc);
+        if(checksum_func(filename, checksum_real) == EXIT_SUCCESS && strcmp(checksum_base, checksum_real) == 0)
+        {
+            if(verbose)
+                printf("[OK]\n");
+            store_add(filename, checksum_real);
+            journal_add(filename, checksum_real);
+            return DL_DOWNLOADED;
+        }
+        if(verbose)
+            printf("[NOT OK]\n");
+    }
+
     status = download(filename);
     if(status != DL_DOWNLOADED)
         return status;
@@ -1074,9 +1696,14 @@ int download_check(const char * filename, const char * checksum_base, char * che
         if(verbose)
             printf("[NOT OK]\n");
         fprintf(ERRFP, "Warning: %s mismatch (real=\"%s\", base=\"%s\")\n", checksum_desc, checksum_real, checksum_base);
+        if(mirror_last)
+            mirror_report(mirror_last, 0, 0.0, 0.0); /* Try again with other server if this one is broken */
         return DL_TRY_AGAIN;
     }
     else if(verbose)
         printf("[OK]\n");
+    if(checksum_func == & sha256sum)
+        store_add(filename, checksum_real);
+    journal_add(filename, checksum_real);
     return DL_DOWNLOADED;
 }
@@ -0,0 +1,242 @@
+/*
+   Copyright (C) 2014-2020, Rudolf Sikorski <rudolf.sikorski@freenet.de>
+
+   This file is part of the `drwebmirror' program.
+
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "drwebmirror.h"
+#include <sys/stat.h>
+#if !defined (NO_POSIX_API)
+#include <dirent.h>
+#endif
+
+/*
+   Prune state is a text file next to lock file, every line is
+   "<generations> <filename>" of file not referenced by last <generations> updates.
+*/
+
+/* Pruning mode */
+int8_t use_prune = PRUNE_OFF;
+/* Number of updates file may stay unreferenced before it is deleted */
+unsigned long prune_grace = PRUNE_GRACE;
+
+/* Files referenced by manifests of current update */
+static avl_node * prune_tree;
+/* Unreferenced files from previous updates, hash is number of generations */
+static avl_node * prune_old;
+/* Unreferenced files of this update */
+static FILE * prune_fp;
+/* Statistics */
+static unsigned long prune_count, prune_kept;
+static double prune_bytes;
+
+/* Remember file <filename> as referenced by manifest */
+void prune_keep(const char * filename)
+{
+    if(use_prune != PRUNE_OFF && !avl_hash(prune_tree, filename))
+        prune_tree = avl_insert(prune_tree, filename, "");
+}
+
+/* Check if <name> is a service file of this program or directory of staged generations */
+static int prune_service(const char * name)
+{
+    size_t len = strlen(name);
+    return strcmp(name, LOCKFILENAME) == 0 || strcmp(name, STAMPFILENAME) == 0 ||
+           strcmp(name, MISSINGFILENAME) == 0 || strcmp(name, JOURNALFILENAME) == 0 ||
+           strcmp(name, PRUNEFILENAME) == 0 || strcmp(name, MANIFESTFILENAME) == 0 ||
+           (len > 6 && strcmp(name + len - 6, ".stage") == 0);
+}
+
+/* Account unreferenced file <filename> of size <size> */
+static void prune_file(const char * filename, off_t size)
+{
+    const char * old = avl_hash(prune_old, filename);
+    unsigned long generations = (old ? strtoul(old, NULL, 10) : 0) + 1;
+
+    if(generations <= prune_grace)
+    {
+        prune_kept++;
+        if(use_prune == PRUNE_DRY_RUN || verbose)
+            printf("Unreferenced %s (%lu of %lu updates), keeping\n", filename, generations, prune_grace + 1);
+        if(prune_fp)
+            fprintf(prune_fp, "%lu %s\n", generations, filename);
+        return;
+    }
+
+    prune_count++;
+    prune_bytes += (double)size;
+    if(use_prune == PRUNE_DRY_RUN)
+    {
+        printf("Unreferenced %s (%lu updates), would be deleted\n", filename, generations);
+        return;
+    }
+    printf("Pruning %s\n", filename);
+    file_changed(filename);
+    if(remove(filename) != 0)
+    {
+        fprintf(ERRFP, "Error: Can't delete file %s\n", filename);
+        if(prune_fp)
+            fprintf(prune_fp, "%lu %s\n", generations, filename);
+    }
+}
+
+/* Walk directory <directory> and account files not referenced by manifests, also subdirectories if <recursive> */
+static void prune_walk(const char * directory, int8_t recursive)
+{
+    char buf[STRBUFSIZE];
+#if !defined (NO_POSIX_API)
+    DIR * dfd = opendir(directory);
+    struct dirent * dp;
+    struct stat st;
+
+    if(dfd == NULL)
+    {
+        fprintf(ERRFP, "Error: No such directory %s\n", directory);
+        return;
+    }
+    while((dp = readdir(dfd)) != NULL)
+    {
+        if(strcmp(dp->d_name, ".") == 0 || strcmp(dp->d_name, "..") == 0 || prune_service(dp->d_name))
+            continue;
+        if(strlen(directory) + strlen(dp->d_name) + 2 > sizeof(buf))
+            continue;
+        sprintf(buf, "%s/%s", directory, dp->d_name);
+#if defined(_WIN32)
+        if(stat(buf, & st) != 0)
+#else
+        if(lstat(buf, & st) != 0 || S_ISLNK(st.st_mode)) /* Symbolic links are neither followed nor deleted */
+#endif
+            continue;
+        if(S_ISDIR(st.st_mode))
+        {
+            if(recursive)
+            {
+                prune_walk(buf, recursive);
+                if(use_prune == PRUNE_ON)
+                    rmdir(buf); /* Only succeeds if nothing is left there */
+            }
+        }
+        else if(!avl_hash(prune_tree, buf))
+            prune_file(buf, st.st_size);
+    }
+    closedir(dfd);
+#else
+    HANDLE hFind = INVALID_HANDLE_VALUE;
+    WIN32_FIND_DATAA ffd;
+    char szDir[MAX_PATH];
+    size_t dir_len = bsd_strlcpy(szDir, directory, MAX_PATH);
+
+    if(dir_len >= MAX_PATH - 2)
+        return;
+    bsd_strlcpy(szDir + dir_len, "/*", MAX_PATH - dir_len);
+    hFind = FindFirstFileA(szDir, &ffd);
+    if(hFind == INVALID_HANDLE_VALUE)
+    {
+        fprintf(ERRFP, "Error: No such directory %s\n", directory);
+        return;
+    }
+    do
+    {
+        if(strcmp(ffd.cFileName, ".") == 0 || strcmp(ffd.cFileName, "..") == 0 || prune_service(ffd.cFileName))
+            continue;
+        if(strlen(directory) + strlen(ffd.cFileName) + 2 > sizeof(buf))
+            continue;
+        sprintf(buf, "%s/%s", directory, ffd.cFileName);
+#if defined(FILE_ATTRIBUTE_REPARSE_POINT)
+        if(ffd.dwFileAttributes & FILE_ATTRIBUTE_REPARSE_POINT) /* Symbolic links are neither followed nor deleted */
+            continue;
+#endif
+        if(ffd.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY)
+        {
+            if(recursive)
+            {
+                prune_walk(buf, recursive);
+                if(use_prune == PRUNE_ON)
+                    rmdir(buf); /* Only succeeds if nothing is left there */
+            }
+        }
+        else if(!avl_hash(prune_tree, buf))
+            prune_file(buf, (off_t)ffd.nFileSizeLow);
+    }
+    while(FindNextFileA(hFind, &ffd) != 0);
+    FindClose(hFind);
+#endif
+}
+
+/* Delete files in <directory> which were not referenced by manifests for more than prune_grace updates,
+ * also in subdirectories if <recursive> */
+void prune_run(const char * directory, int8_t recursive)
+{
+    char prune_file_name[STRBUFSIZE], line[STRBUFSIZE + 32];
+    char * delim;
+    FILE * fp;
+
+    if(use_prune == PRUNE_OFF)
+        return;
+    delim = strrchr(lockfile, '/');
+    if(!delim || (size_t)(delim - lockfile) + sizeof(PRUNEFILENAME) >= sizeof(prune_file_name))
+        return;
+    memcpy(prune_file_name, lockfile, (size_t)(delim - lockfile) + 1);
+    strcpy(prune_file_name + (delim - lockfile) + 1, PRUNEFILENAME);
+
+    fp = fopen(prune_file_name, "r");
+    if(fp)
+    {
+        while(fgets(line, sizeof(line), fp))
+        {
+            unsigned long generations;
+            int name_pos = 0;
+            size_t len = strlen(line);
+            if(len == 0 || line[len - 1] != '\n')
+                continue;
+            line[len - 1] = '\0';
+            if(sscanf(line, "%lu %n", & generations, & name_pos) == 1 && name_pos > 0 && line[name_pos] != '\0')
+            {
+                line[name_pos - 1] = '\0';
+                prune_old = avl_insert(prune_old, line + name_pos, line);
+            }
+        }
+        fclose(fp);
+    }
+
+    if(use_prune == PRUNE_ON)
+    {
+        prune_fp = fopen_new(prune_file_name);
+        if(!prune_fp)
+            fprintf(ERRFP, "Warning: Error %d with fopen() on %s: %s\n", errno, prune_file_name, strerror(errno));
+    }
+    prune_count = prune_kept = 0;
+    prune_bytes = 0.0;
+    if(verbose)
+        printf("Looking for unreferenced files in %s\n", directory);
+    prune_walk(directory, recursive);
+
+    if(prune_fp)
+    {
+        fclose(prune_fp);
+        prune_fp = NULL;
+        if(prune_kept == 0)
+            remove(prune_file_name);
+    }
+    if(prune_count > 0 || prune_kept > 0)
+        printf("%s %lu unreferenced files (%.0f bytes), %lu kept for next updates\n",
+               use_prune == PRUNE_DRY_RUN ? "Would prune" : "Pruned", prune_count, prune_bytes, prune_kept);
+
+    avl_dealloc(prune_old);
+    prune_old = NULL;
+    avl_dealloc(prune_tree);
+    prune_tree = NULL;
+}
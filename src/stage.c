@@ -0,0 +1,412 @@
+/*
+   Copyright (C) 2014-2020, Rudolf Sikorski <rudolf.sikorski@freenet.de>
+
+   This file is part of the `drwebmirror' program.
+
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#if defined(__linux__) && !defined(_GNU_SOURCE)
+#define _GNU_SOURCE /* renameat2() */
+#endif
+#include "drwebmirror.h"
+#include <sys/stat.h>
+#if !defined(_WIN32)
+#include <fcntl.h>
+#include <dirent.h>
+#endif
+
+/*
+   Staged update of directory <dir> is made in generation <dir>.stage/<N>/<dir>,
+   update runs with <dir>.stage/<N> as working directory, so all relative paths
+   point into generation. Unchanged files are hard links to files of current
+   generation. After successful update <dir> is replaced by symbolic link
+   to new generation, so readers always see complete set of files.
+   Generation is filled by stage_prepare() only when something has to change,
+   checks before it link just files they need with stage_need().
+*/
+
+/* Flag of staged updates */
+int8_t use_stage = 0;
+
+#if !defined(_WIN32)
+
+/* Working directory before update */
+static char stage_cwd[STRBUFSIZE];
+/* Staged directory and directory of its generations, relative to stage_cwd */
+static char stage_dir[STRBUFSIZE];
+static char stage_root[STRBUFSIZE];
+/* Number of generation being made */
+static unsigned long stage_gen;
+/* Flag of generation filled with all files of current generation */
+static int8_t stage_prepared;
+/* Lock file in directory of generations, it excludes other updates of the directory */
+static char stage_lockfile[STRBUFSIZE];
+static int stage_lockfd = -1;
+
+/* Lock staged directory, lock file stays in the same place for all generations */
+static int stage_lock(void)
+{
+#if !defined(__CYGWIN__)
+    struct flock fl;
+    memset(& fl, 0, sizeof(struct flock));
+    fl.l_whence = SEEK_SET;
+    fl.l_type = F_WRLCK;
+#endif
+
+    if(make_path(stage_root) != EXIT_SUCCESS ||
+       strlen(stage_cwd) + strlen(stage_root) + sizeof(LOCKFILENAME) + 2 > sizeof(stage_lockfile))
+    {
+        fprintf(ERRFP, "Error: Can't lock directory %s\n", stage_dir);
+        return EXIT_FAILURE;
+    }
+    sprintf(stage_lockfile, "%s/%s/%s", stage_cwd, stage_root, LOCKFILENAME);
+    if(verbose) printf("Locking %s\n", stage_lockfile);
+    if((stage_lockfd = open(stage_lockfile, O_RDWR | O_CREAT, MODE_LOCKFILE)) < 0)
+    {
+        fprintf(ERRFP, "Error: Error %d with open() on %s: %s\n", errno, stage_lockfile, strerror(errno));
+        return EXIT_FAILURE;
+    }
+/* Cygwin implementation of fcntl() can't work */
+#if !defined(__CYGWIN__)
+    if(fcntl(stage_lockfd, F_SETLK, & fl) < 0)
+    {
+        if(errno == EAGAIN || errno == EACCES)
+        {
+            fprintf(ERRFP, "Error: Error %d with fcntl(): %s\n", errno, strerror(errno));
+            close(stage_lockfd);
+            stage_lockfd = -1;
+            return EXIT_FAILURE;
+        }
+        fprintf(ERRFP, "Warning: Error %d with fcntl(): %s\n", errno, strerror(errno));
+    }
+#endif
+    return EXIT_SUCCESS;
+}
+
+/* Unlock directory locked by stage_lock(), lock file is kept, so every update locks the same file */
+static void stage_unlock(void)
+{
+    if(stage_lockfd < 0)
+        return;
+    close(stage_lockfd);
+    stage_lockfd = -1;
+}
+
+/* Return to working directory before update */
+static void stage_return(void)
+{
+    if(chdir(stage_cwd) < 0)
+        fprintf(ERRFP, "Error %d with chdir() on %s: %s\n", errno, stage_cwd, strerror(errno));
+    fs_forget();
+}
+
+/* Remove directory <path> with all its content */
+static void stage_remove_tree(const char * path)
+{
+    char buf[STRBUFSIZE];
+    DIR * dfd = opendir(path);
+    struct dirent * dp;
+    struct stat st;
+
+    if(dfd == NULL)
+        return;
+    while((dp = readdir(dfd)) != NULL)
+    {
+        if(strcmp(dp->d_name, ".") == 0 || strcmp(dp->d_name, "..") == 0)
+            continue;
+        if(strlen(path) + strlen(dp->d_name) + 2 > sizeof(buf))
+            continue;
+        sprintf(buf, "%s/%s", path, dp->d_name);
+        if(lstat(buf, & st) == 0 && S_ISDIR(st.st_mode))
+            stage_remove_tree(buf);
+        else
+            remove(buf);
+    }
+    closedir(dfd);
+    rmdir(path);
+}
+
+/* Link all files of directory <src> into directory <dst>, recursive */
+static int stage_link(const char * src, const char * dst)
+{
+    char src_buf[STRBUFSIZE], dst_buf[STRBUFSIZE];
+    DIR * dfd;
+    struct dirent * dp;
+    struct stat st;
+    size_t len;
+    int status = EXIT_SUCCESS;
+
+    if(make_path(dst) != EXIT_SUCCESS)
+        return EXIT_FAILURE;
+    dfd = opendir(src);
+    if(dfd == NULL)
+        return errno == ENOENT ? EXIT_SUCCESS : EXIT_FAILURE;
+    while(status == EXIT_SUCCESS && (dp = readdir(dfd)) != NULL)
+    {
+        len = strlen(dp->d_name);
+        if(strcmp(dp->d_name, ".") == 0 || strcmp(dp->d_name, "..") == 0 ||
+           strcmp(dp->d_name, LOCKFILENAME) == 0 || strcmp(dp->d_name, JOURNALFILENAME) == 0 ||
+           (len > 6 && strcmp(dp->d_name + len - 6, ".stage") == 0))
+            continue;
+        if(strlen(src) + len + 2 > sizeof(src_buf) || strlen(dst) + len + 2 > sizeof(dst_buf))
+            continue;
+        sprintf(src_buf, "%s/%s", src, dp->d_name);
+        sprintf(dst_buf, "%s/%s", dst, dp->d_name);
+        if(lstat(src_buf, & st) != 0)
+            continue;
+        if(S_ISDIR(st.st_mode))
+            status = stage_link(src_buf, dst_buf);
+        else if(S_ISREG(st.st_mode) && link(src_buf, dst_buf) != 0 && errno != EEXIST)
+        {
+            fprintf(ERRFP, "Error %d with link() on %s: %s\n", errno, src_buf, strerror(errno));
+            status = EXIT_FAILURE;
+        }
+    }
+    closedir(dfd);
+    return status;
+}
+
+/* Get number of generation <directory> points to, 0 if it is not staged */
+static unsigned long stage_current(const char * directory, const char * base)
+{
+    char target[STRBUFSIZE];
+    ssize_t len = readlink(directory, target, sizeof(target) - 1);
+    size_t base_len = strlen(base);
+    if(len <= 0)
+        return 0;
+    target[len] = '\0';
+    if(strncmp(target, base, base_len) != 0 || strncmp(target + base_len, ".stage/", 7) != 0)
+        return 0;
+    return strtoul(target + base_len + 7, NULL, 10);
+}
+
+/* Lock directory <directory>, make its new generation working directory, it is filled by stage_prepare() */
+int stage_begin(const char * directory)
+{
+    char gen_dir[STRBUFSIZE], buf[STRBUFSIZE];
+    const char * base = strrchr(directory, '/');
+    base = base ? base + 1 : directory;
+
+    if(getcwd(stage_cwd, sizeof(stage_cwd)) == NULL)
+    {
+        fprintf(ERRFP, "Error %d with getcwd(): %s\n", errno, strerror(errno));
+        return EXIT_FAILURE;
+    }
+    if(* base == '\0' || strlen(directory) * 2 + 32 > sizeof(buf))
+    {
+        fprintf(ERRFP, "Error: Can't stage directory %s\n", directory);
+        return EXIT_FAILURE;
+    }
+    strcpy(stage_dir, directory);
+    sprintf(stage_root, "%s.stage", directory);
+    stage_prepared = 0;
+    if(stage_lock() != EXIT_SUCCESS)
+        return EXIT_FAILURE;
+    stage_gen = stage_current(directory, base) + 1;
+    sprintf(gen_dir, "%s/%lu", stage_root, stage_gen);
+    sprintf(buf, "%s/%s", gen_dir, directory);
+
+    if(make_path(buf) != EXIT_SUCCESS)
+    {
+        fprintf(ERRFP, "Error: Can't prepare generation %s\n", gen_dir);
+        return EXIT_FAILURE;
+    }
+    if(chdir(gen_dir) < 0)
+    {
+        fprintf(ERRFP, "Error %d with chdir() on %s: %s\n", errno, gen_dir, strerror(errno));
+        return EXIT_FAILURE;
+    }
+    fs_forget();
+    return EXIT_SUCCESS;
+}
+
+/* Link file <filename> of current generation into new generation before it is prepared */
+void stage_need(const char * filename)
+{
+    char buf[STRBUFSIZE], path[STRBUFSIZE];
+    if(stage_lockfd < 0 || stage_prepared || strlen(stage_cwd) + strlen(filename) + 2 > sizeof(buf))
+        return;
+    sprintf(buf, "%s/%s", stage_cwd, filename);
+    strcpy(path, filename);
+    file_changed(filename);
+    if(make_path_for(path) != EXIT_SUCCESS || (link(buf, filename) != 0 && errno != EEXIST && errno != ENOENT))
+        fprintf(ERRFP, "Warning: Error %d with link() on %s: %s\n", errno, buf, strerror(errno));
+}
+
+/* Fill new generation with all files of current generation, files which are already there are kept */
+int stage_prepare(void)
+{
+    char buf[STRBUFSIZE];
+    if(stage_lockfd < 0 || stage_prepared)
+        return EXIT_SUCCESS;
+    if(verbose)
+        printf("Preparing generation %lu in %s/%lu\n", stage_gen, stage_root, stage_gen);
+    sprintf(buf, "%s/%s", stage_cwd, stage_dir);
+    if(strlen(stage_cwd) + strlen(stage_dir) + 2 > sizeof(buf) || stage_link(buf, stage_dir) != EXIT_SUCCESS)
+    {
+        fprintf(ERRFP, "Error: Can't prepare generation %s/%lu\n", stage_root, stage_gen);
+        return EXIT_FAILURE;
+    }
+    stage_prepared = 1;
+    fs_forget();
+    return EXIT_SUCCESS;
+}
+
+/* Return to working directory before update, generation is kept for next try */
+void stage_abort(void)
+{
+    stage_return();
+    stage_unlock();
+}
+
+/* Return to working directory before update and remove new generation of directory <directory>,
+ * nothing was changed on server, only remote timestamp is kept */
+void stage_discard(const char * directory)
+{
+    char gen_dir[STRBUFSIZE], buf[STRBUFSIZE], stamp[STRBUFSIZE];
+
+    stage_return();
+    sprintf(gen_dir, "%s/%lu", stage_root, stage_gen);
+    if(strlen(gen_dir) + strlen(directory) + sizeof(STAMPFILENAME) + 2 <= sizeof(buf))
+    {
+        sprintf(buf, "%s/%s/%s", gen_dir, directory, STAMPFILENAME);
+        sprintf(stamp, "%s/%s", directory, STAMPFILENAME);
+        if(rename(buf, stamp) != 0 && errno != ENOENT)
+            fprintf(ERRFP, "Warning: Error %d with rename() on %s: %s\n", errno, buf, strerror(errno));
+    }
+    if(verbose)
+        printf("Removing unchanged generation %s\n", gen_dir);
+    stage_remove_tree(gen_dir);
+    stage_unlock();
+}
+
+/* Switch directory <directory> to new generation and remove generations older than STAGE_KEEP */
+static int stage_switch(const char * directory)
+{
+    char target[STRBUFSIZE], tmp[STRBUFSIZE], buf[STRBUFSIZE];
+    const char * base = strrchr(directory, '/');
+    struct stat st;
+    DIR * dfd;
+    struct dirent * dp;
+
+    stage_return();
+    base = base ? base + 1 : directory;
+    sprintf(target, "%s.stage/%lu/%s", base, stage_gen, directory);
+    sprintf(tmp, "%s.new", directory);
+    remove(tmp);
+    if(symlink(target, tmp) != 0)
+    {
+        fprintf(ERRFP, "Error %d with symlink() on %s: %s\n", errno, tmp, strerror(errno));
+        return EXIT_FAILURE;
+    }
+
+    if(lstat(directory, & st) == 0 && S_ISDIR(st.st_mode)) /* First staged update, keep old directory as generation 0 */
+    {
+        sprintf(buf, "%s/0/%s", stage_root, directory);
+        make_path_for(buf);
+#if defined(RENAME_EXCHANGE)
+        if(renameat2(AT_FDCWD, tmp, AT_FDCWD, directory, RENAME_EXCHANGE) == 0)
+        {
+            if(rename(tmp, buf) != 0)
+                fprintf(ERRFP, "Warning: Error %d with rename() on %s: %s\n", errno, tmp, strerror(errno));
+            tmp[0] = '\0';
+        }
+        else
+#endif
+        if(rename(directory, buf) != 0)
+        {
+            fprintf(ERRFP, "Error %d with rename() on %s: %s\n", errno, directory, strerror(errno));
+            remove(tmp);
+            return EXIT_FAILURE;
+        }
+    }
+    if(tmp[0] != '\0' && rename(tmp, directory) != 0) /* Atomic replace of symbolic link */
+    {
+        fprintf(ERRFP, "Error %d with rename() on %s: %s\n", errno, tmp, strerror(errno));
+        remove(tmp);
+        return EXIT_FAILURE;
+    }
+    if(verbose)
+        printf("Switched %s to generation %lu\n", directory, stage_gen);
+
+    dfd = opendir(stage_root);
+    if(dfd == NULL)
+        return EXIT_SUCCESS;
+    while((dp = readdir(dfd)) != NULL)
+    {
+        char * end;
+        unsigned long gen = strtoul(dp->d_name, & end, 10);
+        if(dp->d_name[0] >= '0' && dp->d_name[0] <= '9' && * end == '\0' && gen + STAGE_KEEP <= stage_gen)
+        {
+            sprintf(buf, "%s/%s", stage_root, dp->d_name);
+            if(verbose)
+                printf("Removing generation %s\n", buf);
+            stage_remove_tree(buf);
+        }
+    }
+    closedir(dfd);
+    return EXIT_SUCCESS;
+}
+
+/* Switch directory <directory> to new generation and remove generations older than STAGE_KEEP */
+int stage_commit(const char * directory)
+{
+    int status = stage_switch(directory);
+    stage_unlock();
+    return status;
+}
+
+#else
+
+/* Lock directory <directory>, make its new generation working directory, it is filled by stage_prepare() */
+int stage_begin(const char * directory)
+{
+    (void)directory;
+    fprintf(ERRFP, "Error: Staged updates are not supported on this system\n");
+    return EXIT_FAILURE;
+}
+
+/* Link file <filename> of current generation into new generation before it is prepared */
+void stage_need(const char * filename)
+{
+    (void)filename;
+}
+
+/* Fill new generation with all files of current generation, files which are already there are kept */
+int stage_prepare(void)
+{
+    return EXIT_SUCCESS;
+}
+
+/* Return to working directory before update, generation is kept for next try */
+void stage_abort(void)
+{
+}
+
+/* Return to working directory before update and remove new generation of directory <directory>,
+ * nothing was changed on server, only remote timestamp is kept */
+void stage_discard(const char * directory)
+{
+    (void)directory;
+}
+
+/* Switch directory <directory> to new generation and remove generations older than STAGE_KEEP */
+int stage_commit(const char * directory)
+{
+    (void)directory;
+    return EXIT_FAILURE;
+}
+
+#endif
@@ -0,0 +1,315 @@
+/*
+   Copyright (C) 2014-2020, Rudolf Sikorski <rudolf.sikorski@freenet.de>
+
+   This file is part of the `drwebmirror' program.
+
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "drwebmirror.h"
+#include <sys/stat.h>
+#include <fcntl.h>
+#if defined(__linux__)
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/fs.h>
+#endif
+#if !defined (NO_POSIX_API)
+#include <dirent.h>
+#endif
+
+#if !defined(O_BINARY)
+#define O_BINARY 0
+#endif
+
+/*
+   Object store is a directory shared by all mirrored remotes, file with
+   SHA256 sum <hash> is kept there as <hash[0..1]>/<hash>. Files in remote
+   directories are hard links to objects where possible, otherwise reflinks
+   or copies.
+   Seed index maps SHA256 sums to files of other remotes found under seed
+   directory, it is built from their version.lst and xml lists, so files
+   themselves are not read.
+*/
+
+/* Object store directory, empty if not used */
+char store_dir[STRBUFSIZE];
+/* Directory with other remotes used for seeding, empty if not used */
+char seed_dir[STRBUFSIZE];
+
+/* Files of other remotes by SHA256 sum */
+static avl_node * seed_tree;
+static int8_t seed_ready;
+static unsigned long seed_count;
+/* Remote being updated, it is not indexed */
+static char seed_own[STRBUFSIZE];
+
+/* Get path <path> of object with SHA256 sum <hash> */
+static int store_path(const char * hash, char path[STRBUFSIZE])
+{
+    size_t i;
+    for(i = 0; i < 64; i++)
+        if(!((hash[i] >= '0' && hash[i] <= '9') || (hash[i] >= 'a' && hash[i] <= 'f')))
+            return EXIT_FAILURE;
+    if(hash[64] != '\0' || strlen(store_dir) + 64 + 5 > STRBUFSIZE)
+        return EXIT_FAILURE;
+    sprintf(path, "%s/%c%c/%s", store_dir, hash[0], hash[1], hash);
+    return EXIT_SUCCESS;
+}
+
+/* Make file <dst> with content of file <src>, as hard link, reflink or copy in kernel or user space */
+static int store_link(const char * src, const char * dst)
+{
+    int fd_src, fd_dst, status = EXIT_SUCCESS;
+    char * buffer;
+    long len;
+
+#if !defined(_WIN32)
+    if(link(src, dst) == 0)
+        return EXIT_SUCCESS;
+    if(errno == EEXIST)
+        return EXIT_FAILURE;
+#endif
+    fd_src = open(src, O_RDONLY | O_BINARY, 0);
+    if(fd_src < 0)
+        return EXIT_FAILURE;
+    fd_dst = open(dst, O_WRONLY | O_CREAT | O_EXCL | O_BINARY, MODE_FILE);
+    if(fd_dst < 0)
+    {
+        close(fd_src);
+        return EXIT_FAILURE;
+    }
+#if defined(FICLONE)
+    if(ioctl(fd_dst, FICLONE, fd_src) == 0)
+    {
+        close(fd_src);
+        close(fd_dst);
+        return EXIT_SUCCESS;
+    }
+#endif
+#if defined(SYS_copy_file_range)
+    {
+        long copied = 0;
+        while((len = syscall(SYS_copy_file_range, fd_src, NULL, fd_dst, NULL, (size_t)NETBUFSIZE, 0U)) > 0)
+            copied += len;
+        if(len == 0)
+        {
+            close(fd_src);
+            close(fd_dst);
+            return EXIT_SUCCESS;
+        }
+        if(copied > 0) /* Failed in the middle */
+            status = EXIT_FAILURE;
+    }
+#endif
+    buffer = status == EXIT_SUCCESS ? (char *)malloc(NETBUFSIZE) : NULL;
+    if(!buffer)
+        status = EXIT_FAILURE;
+    while(status == EXIT_SUCCESS && (len = (long)read(fd_src, buffer, NETBUFSIZE)) != 0)
+        if(len < 0 || (long)write(fd_dst, buffer, (size_t)len) != len)
+            status = EXIT_FAILURE;
+    free(buffer);
+    close(fd_src);
+    close(fd_dst);
+    if(status != EXIT_SUCCESS)
+        remove(dst);
+    return status;
+}
+
+/* Make file <filename> from object with SHA256 sum <hash> if store has it */
+int store_fetch(const char * filename, const char * hash)
+{
+    char path[STRBUFSIZE];
+    if(store_dir[0] == '\0' || store_path(hash, path) != EXIT_SUCCESS || !exist(path))
+        return EXIT_FAILURE;
+    file_changed(filename);
+    remove(filename);
+    if(store_link(path, filename) != EXIT_SUCCESS)
+    {
+        fprintf(ERRFP, "Warning: Can't take %s from object store\n", filename);
+        return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}
+
+/* Put verified file <filename> with SHA256 sum <hash> into store */
+void store_add(const char * filename, const char * hash)
+{
+    char path[STRBUFSIZE];
+    if(store_dir[0] == '\0' || store_path(hash, path) != EXIT_SUCCESS || exist(path))
+        return;
+    if(make_path_for(path) != EXIT_SUCCESS)
+        return;
+    file_changed(path);
+    if(store_link(filename, path) != EXIT_SUCCESS && verbose)
+        printf("Warning: Can't put %s into object store\n", filename);
+}
+
+/* Remove broken object with SHA256 sum <hash> from store */
+void store_drop(const char * hash)
+{
+    char path[STRBUFSIZE];
+    if(store_dir[0] == '\0' || store_path(hash, path) != EXIT_SUCCESS)
+        return;
+    fprintf(ERRFP, "Warning: Removing broken object %s from object store\n", path);
+    file_changed(path);
+    remove(path);
+}
+
+/* Add file <filename> with SHA256 sum <hash> to seed index */
+static void seed_add(const char * hash, const char * filename)
+{
+    char key[65];
+    size_t i;
+    for(i = 0; i < 64; i++)
+    {
+        key[i] = (hash[i] >= 'A' && hash[i] <= 'F') ? (char)(hash[i] - 'A' + 'a') : hash[i];
+        if(!((key[i] >= '0' && key[i] <= '9') || (key[i] >= 'a' && key[i] <= 'f')))
+            return;
+    }
+    key[64] = '\0';
+    if(!avl_hash(seed_tree, key))
+    {
+        seed_tree = avl_insert(seed_tree, key, filename);
+        seed_count++;
+    }
+}
+
+/* Add files of flat list <file> (version.lst) in directory <directory> to seed index */
+static void seed_list(const char * file, const char * directory)
+{
+    char hash[65], filename[STRBUFSIZE];
+    mf_file mf;
+    mf_slice line, fields[5];
+    if(mf_open(& mf, file) != EXIT_SUCCESS)
+        return;
+    while(mf_line(& mf, & line))
+    {
+        if(line.ptr[0] != '+' && line.ptr[0] != '=' && line.ptr[0] != '!')
+            continue;
+        if(mf_parse_entry(line, directory, filename, fields) != 0 && fields[1].len >= 64 &&
+           mf_copy(fields[1], hash, sizeof(hash)) == EXIT_SUCCESS)
+            seed_add(hash, filename);
+    }
+    mf_close(& mf);
+}
+
+/* Add files of xml list <file> in directory <directory> to seed index */
+static void seed_xml(const char * file, const char * directory)
+{
+    char hash[65], name[STRBUFSIZE], filename[STRBUFSIZE];
+    xml_parser xp;
+    mf_file mf;
+    mf_slice slice;
+    const char * data;
+    size_t size;
+    if(mf_open(& mf, file) != EXIT_SUCCESS)
+        return;
+    xml_init(& xp);
+    data = mf.data;
+    size = mf.size;
+    while(size > 0)
+    {
+        int event;
+        size_t used = xml_parse(& xp, data, size, & event);
+        data += used;
+        size -= used;
+        if(event == XML_ERROR)
+            break;
+        else if(event == XML_ELEMENT)
+            name[0] = hash[0] = '\0';
+        else if(event == XML_ATTRIBUTE && strcmp(xp.name, "name") == 0)
+            bsd_strlcpy(name, xp.value, sizeof(name));
+        else if(event == XML_ATTRIBUTE && strcmp(xp.name, "hash") == 0 && xp.value_len < sizeof(hash))
+            strcpy(hash, xp.value);
+        else if(event == XML_TAG_END && name[0] != '\0' && hash[0] != '\0')
+        {
+            slice.ptr = name;
+            slice.len = strlen(name);
+            if(mf_path(filename, directory, slice) == EXIT_SUCCESS)
+                seed_add(hash, filename);
+        }
+    }
+    mf_close(& mf);
+}
+
+/* Find lists in directory <directory> and its subdirectories */
+static void seed_walk(const char * directory)
+{
+#if !defined (NO_POSIX_API)
+    char buf[STRBUFSIZE];
+    DIR * dfd = opendir(directory);
+    struct dirent * dp;
+    struct stat st;
+
+    if(dfd == NULL)
+        return;
+    while((dp = readdir(dfd)) != NULL)
+    {
+        size_t len = strlen(dp->d_name);
+        if(dp->d_name[0] == '.' || (len > 6 && strcmp(dp->d_name + len - 6, ".stage") == 0))
+            continue;
+        if(strlen(directory) + len + 2 > sizeof(buf))
+            continue;
+        sprintf(buf, "%s/%s", directory, dp->d_name);
+        if(strcmp(buf, seed_own) == 0 || stat(buf, & st) != 0)
+            continue;
+        if(S_ISDIR(st.st_mode))
+            seed_walk(buf);
+        else if(strcmp(dp->d_name, "version.lst") == 0 || strcmp(dp->d_name, "version2.lst") == 0)
+            seed_list(buf, directory);
+        else if(len > 4 && strcmp(dp->d_name + len - 4, ".xml") == 0)
+            seed_xml(buf, directory);
+    }
+    closedir(dfd);
+#else
+    (void)directory;
+#endif
+}
+
+/* Make file <filename> from file with SHA256 sum <hash> of other remote if seed directory has it */
+int seed_fetch(const char * filename, const char * hash)
+{
+    char key[65];
+    const char * path;
+    size_t i;
+
+    if(seed_dir[0] == '\0' || strlen(hash) != 64)
+        return EXIT_FAILURE;
+    if(!seed_ready)
+    {
+        seed_ready = 1;
+        if(getcwd(seed_own, sizeof(seed_own)) == NULL ||
+           strlen(seed_own) + strlen(remotedir) + 2 > sizeof(seed_own))
+            seed_own[0] = '\0';
+        else
+            strcat(strcat(seed_own, "/"), remotedir);
+        seed_walk(seed_dir);
+        if(verbose)
+            printf("Indexed %lu files of other remotes in %s\n", seed_count, seed_dir);
+    }
+    for(i = 0; i < 65; i++)
+        key[i] = (hash[i] >= 'A' && hash[i] <= 'F') ? (char)(hash[i] - 'A' + 'a') : hash[i];
+    path = avl_hash(seed_tree, key);
+    if(!path || !exist(path))
+        return EXIT_FAILURE;
+    file_changed(filename);
+    remove(filename);
+    if(store_link(path, filename) != EXIT_SUCCESS)
+    {
+        fprintf(ERRFP, "Warning: Can't copy %s to %s\n", path, filename);
+        return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}
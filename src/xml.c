@@ -0,0 +1,281 @@
+/*
+   Copyright (C) 2014-2020, Rudolf Sikorski <rudolf.sikorski@freenet.de>
+
+   This file is part of the `drwebmirror' program.
+
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "drwebmirror.h"
+
+/*
+   Streaming tokenizer of xml lists. Input may be cut at any byte, state is
+   kept in parser between calls, so it is fed from memory map as well as by
+   pieces of downloaded content. Only tags are reported, text, comments,
+   processing instructions and declarations are skipped.
+*/
+
+/* States of xml parser */
+#define XS_TEXT         0   /* Outside of tags */
+#define XS_LT           1   /* After '<' */
+#define XS_ELEMENT      2   /* Name of element in start tag */
+#define XS_ATTRS        3   /* Between attributes */
+#define XS_ATTR_NAME    4   /* Name of attribute */
+#define XS_ATTR_EQ      5   /* Before '=' */
+#define XS_ATTR_QUOTE   6   /* Before opening quote */
+#define XS_ATTR_VALUE   7   /* Value of attribute */
+#define XS_EMPTY        8   /* After '/' of empty element */
+#define XS_CLOSE        9   /* Name of element in end tag */
+#define XS_PI           10  /* Processing instruction "<?...?>" */
+#define XS_BANG         11  /* After "<!" */
+#define XS_COMMENT      12  /* Comment "<!--...-->" */
+#define XS_DECL         13  /* Declaration "<!...>" */
+#define XS_ERROR        14  /* Malformed input, nothing more is parsed */
+
+/* Check if <c> is whitespace */
+#define XML_SPACE(c)    ((c) == ' ' || (c) == '\t' || (c) == '\r' || (c) == '\n')
+
+/* Prepare parser <xp> for new document */
+void xml_init(xml_parser * xp)
+{
+    xp->state = XS_TEXT;
+    xp->quote = '\0';
+    xp->empty = 0;
+    xp->count = 0;
+    xp->element[0] = xp->name[0] = xp->value[0] = '\0';
+    xp->element_len = xp->name_len = xp->value_len = 0;
+}
+
+/* Append <c> to <str> of <len> bytes with room for <size> bytes, return EXIT_FAILURE if it is too long */
+static int xml_append(char * str, size_t * len, size_t size, char c)
+{
+    if(* len + 1 >= size)
+        return EXIT_FAILURE;
+    str[(* len)++] = c;
+    str[* len] = '\0';
+    return EXIT_SUCCESS;
+}
+
+/* Replace character and entity references in <value> of <len> bytes, return EXIT_FAILURE if some is unknown */
+static int xml_unescape(char * value, size_t * len)
+{
+    static const char * const names[] = { "amp;", "lt;", "gt;", "quot;", "apos;" };
+    static const char chars[] = { '&', '<', '>', '\"', '\'' };
+    size_t i, j = 0;
+    for(i = 0; i < * len; i++)
+    {
+        size_t k, ref_len = 0;
+        if(value[i] != '&')
+        {
+            value[j++] = value[i];
+            continue;
+        }
+        for(k = 0; k < sizeof(chars) && ref_len == 0; k++)
+            if(strncmp(value + i + 1, names[k], strlen(names[k])) == 0)
+            {
+                value[j++] = chars[k];
+                ref_len = strlen(names[k]);
+            }
+        if(ref_len == 0 && value[i + 1] == '#') /* "&#NN;" or "&#xNN;", only ASCII */
+        {
+            int hex = value[i + 2] == 'x';
+            char * end;
+            unsigned long c = strtoul(value + i + 2 + hex, & end, hex ? 16 : 10);
+            if(* end != ';' || end == value + i + 2 + hex || c == 0 || c > 127)
+                return EXIT_FAILURE;
+            value[j++] = (char)c;
+            ref_len = (size_t)(end - (value + i));
+        }
+        if(ref_len == 0)
+            return EXIT_FAILURE;
+        i += ref_len;
+    }
+    value[j] = '\0';
+    * len = j;
+    return EXIT_SUCCESS;
+}
+
+/* Parse <buf> of <size> bytes until next event <event>, return number of consumed bytes */
+size_t xml_parse(xml_parser * xp, const char * buf, size_t size, int * event)
+{
+    size_t i;
+    * event = XML_NONE;
+    if(xp->state == XS_ERROR)
+    {
+        * event = XML_ERROR;
+        return size;
+    }
+    for(i = 0; i < size; i++)
+    {
+        char c = buf[i];
+        switch(xp->state)
+        {
+        case XS_TEXT:
+            if(c == '<')
+                xp->state = XS_LT;
+            break;
+        case XS_LT:
+            xp->element_len = 0;
+            xp->element[0] = '\0';
+            if(c == '/')
+                xp->state = XS_CLOSE;
+            else if(c == '?')
+            {
+                xp->state = XS_PI;
+                xp->count = 0;
+            }
+            else if(c == '!')
+            {
+                xp->state = XS_BANG;
+                xp->count = 0;
+            }
+            else if(XML_SPACE(c) || c == '>' || c == '=' || c == '<')
+                goto error;
+            else
+            {
+                xp->state = XS_ELEMENT;
+                xp->empty = 0;
+                xml_append(xp->element, & xp->element_len, sizeof(xp->element), c);
+            }
+            break;
+        case XS_ELEMENT:
+            if(XML_SPACE(c) || c == '/' || c == '>')
+            {
+                xp->state = XS_ATTRS;
+                * event = XML_ELEMENT;
+                return XML_SPACE(c) ? i + 1 : i; /* '/' and '>' are handled as part of attributes */
+            }
+            if(c == '<' || c == '=' || xml_append(xp->element, & xp->element_len, sizeof(xp->element), c) != EXIT_SUCCESS)
+                goto error;
+            break;
+        case XS_ATTRS:
+            if(XML_SPACE(c))
+                break;
+            if(c == '/')
+                xp->state = XS_EMPTY;
+            else if(c == '>')
+            {
+                xp->state = XS_TEXT;
+                * event = XML_TAG_END;
+                return i + 1;
+            }
+            else if(c == '<' || c == '=' || c == '\"' || c == '\'')
+                goto error;
+            else
+            {
+                xp->state = XS_ATTR_NAME;
+                xp->name_len = 0;
+                xml_append(xp->name, & xp->name_len, sizeof(xp->name), c);
+            }
+            break;
+        case XS_ATTR_NAME:
+            if(c == '=')
+                xp->state = XS_ATTR_QUOTE;
+            else if(XML_SPACE(c))
+                xp->state = XS_ATTR_EQ;
+            else if(c == '<' || c == '>' || c == '/' || xml_append(xp->name, & xp->name_len, sizeof(xp->name), c) != EXIT_SUCCESS)
+                goto error;
+            break;
+        case XS_ATTR_EQ:
+            if(c == '=')
+                xp->state = XS_ATTR_QUOTE;
+            else if(!XML_SPACE(c))
+                goto error;
+            break;
+        case XS_ATTR_QUOTE:
+            if(c == '\"' || c == '\'')
+            {
+                xp->state = XS_ATTR_VALUE;
+                xp->quote = c;
+                xp->value_len = 0;
+                xp->value[0] = '\0';
+            }
+            else if(!XML_SPACE(c))
+                goto error;
+            break;
+        case XS_ATTR_VALUE:
+            if(c == xp->quote)
+            {
+                if(xml_unescape(xp->value, & xp->value_len) != EXIT_SUCCESS)
+                    goto error;
+                xp->state = XS_ATTRS;
+                * event = XML_ATTRIBUTE;
+                return i + 1;
+            }
+            if(c == '<' || xml_append(xp->value, & xp->value_len, sizeof(xp->value), c) != EXIT_SUCCESS)
+                goto error;
+            break;
+        case XS_EMPTY:
+            if(c != '>')
+                goto error;
+            xp->state = XS_TEXT;
+            xp->empty = 1;
+            * event = XML_TAG_END;
+            return i + 1;
+        case XS_CLOSE:
+            if(c == '>')
+            {
+                if(xp->element_len == 0)
+                    goto error;
+                xp->state = XS_TEXT;
+                * event = XML_CLOSE;
+                return i + 1;
+            }
+            if(XML_SPACE(c))
+                break;
+            if(c == '<' || xml_append(xp->element, & xp->element_len, sizeof(xp->element), c) != EXIT_SUCCESS)
+                goto error;
+            break;
+        case XS_PI: /* count is 1 after '?' */
+            if(c == '>' && xp->count == 1)
+                xp->state = XS_TEXT;
+            xp->count = c == '?' ? 1 : 0;
+            break;
+        case XS_BANG: /* count is number of '-' after "<!" */
+            if(c == '-' && xp->count < 2)
+            {
+                if(++xp->count == 2)
+                {
+                    xp->state = XS_COMMENT;
+                    xp->count = 0;
+                }
+            }
+            else
+            {
+                xp->state = c == '>' ? XS_TEXT : XS_DECL;
+                xp->count = c == '[' ? 1 : 0;
+            }
+            break;
+        case XS_COMMENT: /* count is number of '-' before current character */
+            if(c == '>' && xp->count >= 2)
+                xp->state = XS_TEXT;
+            xp->count = c == '-' ? xp->count + 1 : 0;
+            break;
+        case XS_DECL: /* count is depth of '[' */
+            if(c == '[')
+                xp->count++;
+            else if(c == ']' && xp->count > 0)
+                xp->count--;
+            else if(c == '>' && xp->count == 0)
+                xp->state = XS_TEXT;
+            break;
+        }
+    }
+    return size;
+
+error:
+    xp->state = XS_ERROR;
+    * event = XML_ERROR;
+    return size;
+}